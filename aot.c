@@ -0,0 +1,312 @@
+// CHIP-8 ahead-of-time recompiler: translates a ROM into a C file
+//
+// Usage: chip8aot [-q vip|chip48|schip|modern] <rom.ch8> <out.c>
+//
+// The output links against cpu.c and implements aot.h. Every basic block
+// reachable from PROGRAM_START becomes one C function; aot_execute() is a
+// switch on pc which also catches the targets of JP_V0_addr. Blocks check
+// their bytes are unchanged before running, so self-modified code and code
+// that was never found statically fall back to the interpreter. The quirk
+// profile (default schip) picks which copy of the quirk-dependent handlers
+// the blocks call, and is exported so the interpreter can use the same one.
+//
+// The generator links against cpu.c too, and takes the handler names
+// (handler_name()), block boundaries (block_flags()) and quirk settings
+// from it, so generated code always matches the interpreter it runs with.
+#include "cpu.h"
+
+
+static uint8_t rom[MEMORY_SIZE - PROGRAM_START];
+static uint32_t rom_size;
+
+static uint8_t reachable[MEMORY_SIZE];
+static uint8_t leader[MEMORY_SIZE];
+
+static QuirkProfile profile = QUIRKS_SCHIP;
+
+
+static inline int in_rom(uint32_t addr) {
+	return addr >= PROGRAM_START && addr + 1 < PROGRAM_START + rom_size;
+}
+
+static inline uint16_t opcode_at(uint32_t addr) {
+	return (rom[addr - PROGRAM_START] << 8) | rom[addr - PROGRAM_START + 1];
+}
+
+
+/*
+ *	find_reachable_code()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Walks every static path from PROGRAM_START, marking reachable
+ *	          instructions and the addresses that start a basic block
+ */
+static void find_reachable_code(void) {
+	static uint16_t worklist[MEMORY_SIZE * 2];
+	uint32_t top = 0;
+
+	worklist[top++] = PROGRAM_START;
+	leader[PROGRAM_START] = 1;
+
+	while (top > 0) {
+		uint16_t addr = worklist[--top];
+		uint16_t succ[2];
+		int nsucc = 0;
+		int is_branch = 1;
+
+		if (!in_rom(addr) || reachable[addr])
+			continue;
+		reachable[addr] = 1;
+
+		uint16_t opcode = opcode_at(addr);
+		uint16_t nnn = opcode & 0x0FFF;
+
+		if (block_flags(opcode) & STARTS_BLOCK)
+			leader[addr] = 1;
+
+		switch (opcode & 0xF000) {
+		case 0x0000:
+			if ((opcode & 0x00FF) == 0x00E0) {
+				succ[nsucc++] = addr + 2;
+				is_branch = 0;
+			}
+			else if ((opcode & 0x00FF) != 0x00EE)
+				succ[nsucc++] = nnn;   // SYS
+			break;
+		case 0x1000:
+			succ[nsucc++] = nnn;
+			break;
+		case 0x2000:
+			succ[nsucc++] = nnn;
+			succ[nsucc++] = addr + 2;   // where RET comes back to
+			break;
+		case 0x3000: case 0x4000: case 0x5000: case 0x9000: case 0xE000:
+			succ[nsucc++] = addr + 2;
+			succ[nsucc++] = addr + 4;
+			break;
+		case 0xB000:
+			break;   // computed; handled by the interpreter unless the target is a leader
+		default:
+			succ[nsucc++] = addr + 2;
+			is_branch = (block_flags(opcode) & ENDS_BLOCK) != 0;
+			break;
+		}
+
+		for (int i=0; i < nsucc; ++i) {
+			if (succ[i] >= MEMORY_SIZE)
+				continue;
+			if (is_branch)
+				leader[succ[i]] = 1;
+			worklist[top++] = succ[i];
+		}
+	}
+}
+
+
+/*
+ *	emit_instruction()
+ *	Inputs: out - Output file
+ *	        addr - Address of the instruction
+ *	Return Value: Returns 1 if the emitted code sets pc itself
+ *	Function: Writes the C statements for one instruction. Register ops and
+ *	          branches are inlined; everything else calls its handler,
+ *	          including EX9E/EXA1 so key numbers are masked and checked the
+ *	          same way (see FAULT_BAD_KEY).
+ */
+static int emit_instruction(FILE * out, uint16_t addr) {
+	static const char * alu_op[4] = { "=", "|=", "&=", "^=" };
+	uint16_t opcode = opcode_at(addr);
+	uint16_t nnn = opcode & 0x0FFF;
+	uint8_t x = (opcode & 0x0F00) >> 8;
+	uint8_t y = (opcode & 0x00F0) >> 4;
+	uint8_t n = opcode & 0x000F;
+	uint8_t kk = opcode & 0x00FF;
+	const char * cond = NULL;
+	char buf[64];
+
+	switch (opcode & 0xF000) {
+	case 0x0000:
+		if (kk != 0xE0 && kk != 0xEE) {
+			fprintf(out, "\tcpu_reg->pc = 0x%03X;\n", nnn);
+			return 1;
+		}
+		break;
+	case 0x1000:
+		fprintf(out, "\tcpu_reg->pc = 0x%03X;\n", nnn);
+		return 1;
+	case 0x3000:
+		snprintf(buf, sizeof(buf), "cpu_reg->V[0x%X] == 0x%02X", x, kk);
+		cond = buf;
+		break;
+	case 0x4000:
+		snprintf(buf, sizeof(buf), "cpu_reg->V[0x%X] != 0x%02X", x, kk);
+		cond = buf;
+		break;
+	case 0x5000:
+		snprintf(buf, sizeof(buf), "cpu_reg->V[0x%X] == cpu_reg->V[0x%X]", x, y);
+		cond = buf;
+		break;
+	case 0x9000:
+		snprintf(buf, sizeof(buf), "cpu_reg->V[0x%X] != cpu_reg->V[0x%X]", x, y);
+		cond = buf;
+		break;
+	case 0x6000:
+		fprintf(out, "\tcpu_reg->V[0x%X] = 0x%02X;\n", x, kk);
+		return 0;
+	case 0x7000:
+		fprintf(out, "\tcpu_reg->V[0x%X] += 0x%02X;\n", x, kk);
+		return 0;
+	case 0x8000:
+		if (n <= 3) {
+			fprintf(out, "\tcpu_reg->V[0x%X] %s cpu_reg->V[0x%X];\n", x, alu_op[n], y);
+			return 0;
+		}
+		break;
+	case 0xA000:
+		fprintf(out, "\tcpu_reg->I = 0x%03X;\n", nnn);
+		return 0;
+	case 0xB000:
+		fprintf(out, "\tcpu_reg->pc = cpu_reg->V[0x%X] + 0x%03X;\n",
+		        get_quirk_settings(profile)->jump_vx ? x : 0, nnn);
+		return 1;
+	case 0xF000:
+		if (kk == 0x1E) {
+			fprintf(out, "\tcpu_reg->I += cpu_reg->V[0x%X];\n", x);
+			return 0;
+		}
+		break;
+	}
+
+	if (cond != NULL) {
+		fprintf(out, "\tcpu_reg->pc = (%s) ? 0x%03X : 0x%03X;\n", cond, addr + 4, addr + 2);
+		return 1;
+	}
+
+	// handlers advance pc themselves and fault() records it, so start them on the instruction
+	const char * handler = handler_name(profile, opcode);
+	int ends = (block_flags(opcode) & ENDS_BLOCK) || !strcmp(handler, "TRAP");
+	fprintf(out, "\tcpu_reg->pc = 0x%03X;\n", addr);
+	fprintf(out, "\t{\n\t\tstatic const Instruction ins = { .fn = %s, .opcode = 0x%04X, .nnn = 0x%03X,"
+	             " .x = 0x%X, .y = 0x%X, .n = 0x%X, .kk = 0x%02X };\n\t\t%s(&ins, cpu_reg);\n\t}\n",
+	        handler, opcode, nnn, x, y, n, kk, handler);
+	return ends;
+}
+
+
+/*
+ *	emit_block()
+ *	Inputs: out - Output file
+ *	        start - Address of the block's first instruction
+ *	Return Value: None
+ *	Function: Writes the C function for the basic block starting at start
+ */
+static void emit_block(FILE * out, uint16_t start) {
+	uint16_t addr = start;
+	uint32_t length = 0;
+	int sets_pc = 0;
+
+	// the block's length is needed up front for the self-modification check
+	for (;;) {
+		uint16_t opcode = opcode_at(addr);
+		length++;
+		addr += 2;
+		if ((block_flags(opcode) & ENDS_BLOCK) || !in_rom(addr) || leader[addr])
+			break;
+	}
+
+	fprintf(out, "static uint32_t block_%03X(Chip8 * cpu_reg) {\n", start);
+	fprintf(out, "\tif (memcmp(cpu_reg->memory + 0x%03X, aot_rom + 0x%03X, %u) != 0)\n\t\treturn 0;\n\n",
+	        start, start - PROGRAM_START, length * 2);
+
+	for (addr = start; addr < start + length * 2; addr += 2)
+		sets_pc = emit_instruction(out, addr);
+
+	if (!sets_pc)
+		fprintf(out, "\tcpu_reg->pc = 0x%03X;\n", addr);
+	fprintf(out, "\tretire_instructions(cpu_reg, %u);\n\treturn %u;\n}\n\n\n", length, length);
+}
+
+
+/*
+ *	emit_file()
+ *	Inputs: out - Output file
+ *	        rom_name - Name of the ROM, for the header comment
+ *	Return Value: None
+ *	Function: Writes the ROM image, all of the block functions and the
+ *	          pc trampoline
+ */
+static void emit_file(FILE * out, const char * rom_name) {
+	fprintf(out, "// Generated by chip8aot from %s (%s quirks) -- do not edit\n",
+	        rom_name, quirk_profile_name(profile));
+	fprintf(out, "#include \"cpu.h\"\n#include \"aot.h\"\n\n\n");
+
+	fprintf(out, "const QuirkProfile aot_quirk_profile = %d;   // %s\n\n", profile, quirk_profile_name(profile));
+	fprintf(out, "const uint32_t aot_rom_size = %u;\n\nconst uint8_t aot_rom[] = {", rom_size);
+	for (uint32_t i=0; i < rom_size; ++i)
+		fprintf(out, "%s0x%02X,", (i % 12) ? " " : "\n\t", rom[i]);
+	fprintf(out, "\n};\n\n\n");
+
+	for (uint32_t addr=PROGRAM_START; addr < MEMORY_SIZE; ++addr) {
+		if (reachable[addr] && leader[addr])
+			emit_block(out, addr);
+	}
+
+	fprintf(out, "/*\n *  Runs the block at pc; returns the number of instructions executed,\n"
+	             " *  or 0 if there is no valid block there\n */\n");
+	fprintf(out, "uint32_t aot_execute(Chip8 * cpu_reg) {\n\tswitch (cpu_reg->pc) {\n");
+	for (uint32_t addr=PROGRAM_START; addr < MEMORY_SIZE; ++addr) {
+		if (reachable[addr] && leader[addr])
+			fprintf(out, "\tcase 0x%03X: return block_%03X(cpu_reg);\n", addr, addr);
+	}
+	fprintf(out, "\tdefault: return 0;\n\t}\n}\n\n\n");
+
+	fprintf(out, "/*\n *  Runs at least count instructions, interpreting wherever there is no block\n */\n");
+	fprintf(out, "uint32_t aot_run(Chip8 * cpu_reg, uint32_t count) {\n"
+	             "\tuint64_t start = cpu_reg->instructions_retired;\n\n"
+	             "\t// counted by instructions_retired, as fde_cycle() may run a fused sequence\n"
+	             "\twhile (cpu_reg->instructions_retired - start < count) {\n"
+	             "\t\tif (aot_execute(cpu_reg) == 0)\n"
+	             "\t\t\tfde_cycle(cpu_reg);\n"
+	             "\t}\n\n"
+	             "\treturn cpu_reg->instructions_retired - start;\n}\n");
+}
+
+
+int main(int argc, char **argv) {
+	int arg = 1;
+
+	if (argc == 5 && strcmp(argv[1], "-q") == 0) {
+		int found = find_quirk_profile(argv[2]);
+
+		if (found == -1) {
+			fprintf(stderr, "unknown quirk profile: %s\n", argv[2]);
+			return 1;
+		}
+		profile = found;
+		arg = 3;
+	}
+	else if (argc != 3) {
+		fprintf(stderr, "usage: %s [-q vip|chip48|schip|modern] <rom.ch8> <out.c>\n", argv[0]);
+		return 1;
+	}
+
+	FILE * f = fopen(argv[arg], "rb");
+	if (f == NULL) {
+		perror(argv[arg]);
+		return 1;
+	}
+	rom_size = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+
+	find_reachable_code();
+
+	FILE * out = fopen(argv[arg+1], "w");
+	if (out == NULL) {
+		perror(argv[arg+1]);
+		return 1;
+	}
+	emit_file(out, argv[arg]);
+	fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _AOT_H_
+#define _AOT_H_
+
+#include "cpu.h"
+
+
+/*
+ *  Interface of the C file generated by chip8aot (see aot.c)
+ */
+extern const QuirkProfile aot_quirk_profile;   // profile the blocks were compiled for
+extern const uint8_t aot_rom[];   // ROM the file was generated from
+extern const uint32_t aot_rom_size;
+
+uint32_t aot_execute(Chip8 * cpu_reg);
+uint32_t aot_run(Chip8 * cpu_reg, uint32_t count);
+
+#endif
@@ -0,0 +1,325 @@
+// CHIP-8 audio
+//
+// The buzzer is a square wave that sounds for the frames that end with the
+// sound timer nonzero (see end_frame()). The emulation thread renders each
+// frame's AUDIO_FRAME_SAMPLES samples with audio_frame(), all tone or all
+// silence, so a beep starts and stops on exactly the sample where the
+// sound timer ticks, and puts them in a lock-free single-producer/
+// single-consumer ring. A dedicated audio thread takes AUDIO_PERIOD
+// samples at a time from the ring and hands them to the sink: an ALSA
+// device (built with -DCHIP8_ALSA, link with -lasound) or a WAV file,
+// which is written at the pace a sound card would take it so the same
+// buffering can be tested without sound hardware.
+//
+// audio_frame() never waits: when the ring is full the frame is dropped
+// (an overrun). When the ring runs dry the sink gets silence (an
+// underrun) and playback waits for AUDIO_PRIME samples before starting
+// again, so one late frame doesn't turn into a stutter every period.
+#include "audio.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef CHIP8_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+
+#define AUDIO_AMPLITUDE      6000   // of 32767
+#define AUDIO_PRIME          (AUDIO_FRAME_SAMPLES + AUDIO_PERIOD)   // samples queued before playback (re)starts
+#define AUDIO_LATENCY_US     20000  // ALSA device buffer
+#define PERIOD_NS            (1000000000ull * AUDIO_PERIOD / AUDIO_RATE)
+#define WAV_HEADER_SIZE      44
+
+_Static_assert((AUDIO_RING_SIZE & (AUDIO_RING_SIZE - 1)) == 0, "ring indices wrap with a mask");
+_Static_assert(AUDIO_RING_SIZE >= AUDIO_PRIME + AUDIO_FRAME_SAMPLES, "ring holds a frame on top of the priming");
+
+
+struct audio {
+	int16_t ring[AUDIO_RING_SIZE];
+	atomic_uint head;   // samples the audio thread has taken
+	atomic_uint tail;   // samples audio_frame() has added
+
+	// emulation thread
+	uint32_t phase;   // samples into the current beep
+	uint64_t frames;
+	atomic_uint overruns;
+
+	// audio thread
+	pthread_t thread;
+	atomic_int running;
+	atomic_uint underruns;
+	atomic_uint device_underruns;
+	int (*write)(Audio * audio, const int16_t * samples);
+
+#ifdef CHIP8_ALSA
+	snd_pcm_t * pcm;
+#endif
+	FILE * wav;
+	uint32_t wav_samples;
+	uint64_t wav_deadline;   // monotonic time the next period is due
+};
+
+
+static uint64_t monotonic_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*
+ *	audio_main()
+ *	Inputs: arg - The Audio
+ *	Return Value: NULL
+ *	Function: The audio thread: hands the sink one period after another,
+ *	          from the ring when it has enough, silence otherwise. The sink
+ *	          sets the pace by blocking until it can take more.
+ */
+static void * audio_main(void * arg) {
+	Audio * audio = arg;
+	int16_t period[AUDIO_PERIOD];
+	int playing = 0;
+
+	while (atomic_load(&audio->running)) {
+		uint32_t head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+		uint32_t queued = atomic_load_explicit(&audio->tail, memory_order_acquire) - head;
+
+		if (!playing && queued >= AUDIO_PRIME)
+			playing = 1;
+		else if (playing && queued < AUDIO_PERIOD) {
+			playing = 0;
+			atomic_fetch_add(&audio->underruns, 1);
+		}
+
+		if (playing) {
+			for (uint32_t i=0; i < AUDIO_PERIOD; ++i)
+				period[i] = audio->ring[(head + i) & (AUDIO_RING_SIZE - 1)];
+			atomic_store_explicit(&audio->head, head + AUDIO_PERIOD, memory_order_release);
+		} else {
+			memset(period, 0, sizeof(period));
+		}
+
+		if (audio->write(audio, period) == -1)
+			break;
+	}
+
+	return NULL;
+}
+
+
+/*
+ *	start_audio()
+ *	Inputs: audio - Audio with its sink set up
+ *	Return Value: audio; NULL (and audio is freed) if the thread can't start
+ */
+static Audio * start_audio(Audio * audio) {
+	atomic_store(&audio->running, 1);
+	if (pthread_create(&audio->thread, NULL, audio_main, audio) != 0) {
+		atomic_store(&audio->running, 0);
+		audio_close(audio);
+		return NULL;
+	}
+
+	return audio;
+}
+
+
+#ifdef CHIP8_ALSA
+static int write_alsa(Audio * audio, const int16_t * samples) {
+	snd_pcm_sframes_t written = snd_pcm_writei(audio->pcm, samples, AUDIO_PERIOD);
+
+	if (written == -EPIPE)
+		atomic_fetch_add(&audio->device_underruns, 1);
+	if (written < 0 && snd_pcm_recover(audio->pcm, written, 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ *	audio_open_alsa()
+ *	Inputs: device - ALSA playback device, e.g. "default"
+ *	Return Value: Audio playing through the device; NULL if it can't be opened
+ */
+Audio * audio_open_alsa(const char * device) {
+	Audio * audio = calloc(1, sizeof(Audio));
+
+	if (audio == NULL)
+		return NULL;
+
+	if (snd_pcm_open(&audio->pcm, device, SND_PCM_STREAM_PLAYBACK, 0) < 0 ||
+	    snd_pcm_set_params(audio->pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+	                       1, AUDIO_RATE, 1, AUDIO_LATENCY_US) < 0) {
+		audio_close(audio);
+		return NULL;
+	}
+
+	audio->write = write_alsa;
+	return start_audio(audio);
+}
+#endif
+
+
+static void put16(uint8_t * p, uint16_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+
+static void put32(uint8_t * p, uint32_t value) {
+	put16(p, value);
+	put16(p + 2, value >> 16);
+}
+
+
+/*
+ *	write_wav_header()
+ *	Inputs: f - WAV file, positioned at its start
+ *	        samples - Samples in the data chunk
+ *	Return Value: 0 on success; -1 if it can't be written
+ */
+static int write_wav_header(FILE * f, uint32_t samples) {
+	uint8_t header[WAV_HEADER_SIZE];
+
+	memcpy(header, "RIFF", 4);
+	put32(header + 4, WAV_HEADER_SIZE - 8 + samples * 2);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put32(header + 16, 16);   // fmt chunk size
+	put16(header + 20, 1);   // PCM
+	put16(header + 22, 1);   // mono
+	put32(header + 24, AUDIO_RATE);
+	put32(header + 28, AUDIO_RATE * 2);   // bytes per second
+	put16(header + 32, 2);   // bytes per sample
+	put16(header + 34, 16);   // bits per sample
+	memcpy(header + 36, "data", 4);
+	put32(header + 40, samples * 2);
+
+	return (fwrite(header, 1, sizeof(header), f) == sizeof(header)) ? 0 : -1;
+}
+
+
+static int write_wav(Audio * audio, const int16_t * samples) {
+	uint8_t data[AUDIO_PERIOD * 2];
+
+	for (uint32_t i=0; i < AUDIO_PERIOD; ++i)
+		put16(data + i * 2, samples[i]);
+	if (fwrite(data, 1, sizeof(data), audio->wav) != sizeof(data))
+		return -1;
+	audio->wav_samples += AUDIO_PERIOD;
+
+	// take the next period when a sound card would
+	audio->wav_deadline += PERIOD_NS;
+	struct timespec wake = { audio->wav_deadline / 1000000000, audio->wav_deadline % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+		;
+
+	return 0;
+}
+
+
+/*
+ *	audio_open_wav()
+ *	Inputs: filename - WAV file to write (48 kHz, mono, 16-bit)
+ *	Return Value: Audio recording to the file; NULL if it can't be created
+ */
+Audio * audio_open_wav(const char * filename) {
+	Audio * audio = calloc(1, sizeof(Audio));
+
+	if (audio == NULL)
+		return NULL;
+
+	audio->wav = fopen(filename, "wb");
+	if (audio->wav == NULL || write_wav_header(audio->wav, 0) == -1) {
+		audio_close(audio);
+		return NULL;
+	}
+
+	audio->write = write_wav;
+	audio->wav_deadline = monotonic_ns();
+	return start_audio(audio);
+}
+
+
+/*
+ *	audio_close()
+ *	Inputs: audio - Audio to stop (may be NULL)
+ *	Return Value: None
+ *	Function: Stops the audio thread, finishes the WAV file or closes the
+ *	          device, and frees audio
+ */
+void audio_close(Audio * audio) {
+	if (audio == NULL)
+		return;
+
+	if (atomic_exchange(&audio->running, 0))
+		pthread_join(audio->thread, NULL);
+
+#ifdef CHIP8_ALSA
+	if (audio->pcm != NULL) {
+		snd_pcm_drain(audio->pcm);
+		snd_pcm_close(audio->pcm);
+	}
+#endif
+	if (audio->wav != NULL) {
+		if (fseek(audio->wav, 0, SEEK_SET) == 0)
+			write_wav_header(audio->wav, audio->wav_samples);
+		fclose(audio->wav);
+	}
+
+	free(audio);
+}
+
+
+/*
+ *	audio_frame()
+ *	Inputs: audio - Audio
+ *	        tone - 1 if the buzzer sounded for the frame; 0 if not
+ *	Return Value: None
+ *	Function: Queues one 60 Hz frame of sound. Never blocks: if the ring
+ *	          has no room for the frame it is dropped and counted.
+ */
+void audio_frame(Audio * audio, int tone) {
+	uint32_t tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+	uint32_t queued = tail - atomic_load_explicit(&audio->head, memory_order_acquire);
+
+	audio->frames++;
+	if (AUDIO_RING_SIZE - queued < AUDIO_FRAME_SAMPLES) {
+		atomic_fetch_add(&audio->overruns, 1);
+		return;
+	}
+
+	for (uint32_t i=0; i < AUDIO_FRAME_SAMPLES; ++i) {
+		int16_t sample = 0;
+
+		// each beep starts at the same point of the wave
+		if (tone) {
+			sample = (((uint64_t)audio->phase * 2 * AUDIO_TONE_HZ / AUDIO_RATE) & 1) ? -AUDIO_AMPLITUDE : AUDIO_AMPLITUDE;
+			audio->phase++;
+		} else {
+			audio->phase = 0;
+		}
+		audio->ring[(tail + i) & (AUDIO_RING_SIZE - 1)] = sample;
+	}
+
+	atomic_store_explicit(&audio->tail, tail + AUDIO_FRAME_SAMPLES, memory_order_release);
+}
+
+
+/*
+ *	audio_stats()
+ *	Inputs: audio - Audio
+ *	        stats - Filled with the counters so far
+ *	Return Value: None
+ *	Function: Call it from the thread that calls audio_frame()
+ */
+void audio_stats(const Audio * audio, AudioStats * stats) {
+	stats->frames = audio->frames;
+	stats->overruns = atomic_load(&audio->overruns);
+	stats->underruns = atomic_load(&audio->underruns);
+	stats->device_underruns = atomic_load(&audio->device_underruns);
+}
@@ -0,0 +1,35 @@
+#ifndef _AUDIO_H_
+#define _AUDIO_H_
+
+#include "cpu.h"
+
+
+#define AUDIO_RATE           48000                // samples per second, mono 16-bit
+#define AUDIO_FRAME_SAMPLES  (AUDIO_RATE / 60)    // samples per 60 Hz frame
+#define AUDIO_PERIOD         240                  // samples the audio thread hands the sink at a time (5 ms)
+#define AUDIO_RING_SIZE      4096                 // samples buffered between the threads (power of two)
+#define AUDIO_TONE_HZ        440
+
+
+typedef struct audio Audio;   // buzzer output and the thread that plays it
+
+/*
+ *  Counters kept since audio_open_*()
+ */
+typedef struct audio_stats {
+	uint64_t frames;   // frames given to audio_frame()
+	uint32_t overruns;   // frames dropped because the ring was full
+	uint32_t underruns;   // periods the sink got silence because the ring ran dry
+	uint32_t device_underruns;   // underruns the sound card itself reported (ALSA only)
+} AudioStats;
+
+
+#ifdef CHIP8_ALSA
+Audio * audio_open_alsa(const char * device);
+#endif
+Audio * audio_open_wav(const char * filename);
+void audio_close(Audio * audio);
+void audio_frame(Audio * audio, int tone);
+void audio_stats(const Audio * audio, AudioStats * stats);
+
+#endif
@@ -0,0 +1,367 @@
+// CHIP-8 headless batch runner
+//
+// Usage: chip8-batch [-j threads] [-s seed] <manifest>
+//
+// Each manifest line is one session:
+//   <rom.ch8> <cycles> [<input script> [<quirk profile> [<seed> [<budget>]]]]
+// Blank lines and lines starting with '#' are skipped; use '-' for no input
+// script. An input script is an input log (see inputlog.c): one key change
+// per line, applied at the start of the frame it names. The seed defaults
+// to -s. The budget is the work per 60 Hz frame (see run_frame()): a number
+// of instructions (default DEFAULT_FRAME_BUDGET), or COSMAC VIP machine
+// cycles with a 'c' suffix.
+//
+// Sessions run on a pool of worker threads, one machine per worker. Every
+// worker owns a deque of sessions and takes work from its own end; a worker
+// that runs dry steals from the other end of someone else's. Results are
+// printed in manifest order: rom, instructions executed, FNV-1a hash of
+// the final screen, wall time and any faults (see Chip8Fault), followed by
+// the aggregate speed.
+#include "cpu.h"
+#include "inputlog.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+
+#define MAX_WORKERS          256
+
+
+/*
+ *  One manifest line and, once it has run, its result
+ */
+typedef struct session {
+	char rom[256];
+	uint64_t cycles;   // instruction budget
+	QuirkProfile profile;
+	uint32_t seed;
+	uint32_t frame_budget;   // see set_frame_budget()
+	uint8_t vip_timing;
+	InputLog input;
+
+	int failed;   // ROM couldn't be loaded
+	uint64_t executed;   // instructions actually executed
+	uint64_t screen_hash;
+	double seconds;
+	uint32_t faults;   // out-of-range accesses (see Chip8Fault)
+	uint8_t first_fault;
+	uint16_t first_fault_pc;
+} Session;
+
+/*
+ *  Worker thread with its deque of session indices. The owner pops from
+ *  the tail; thieves take from the head.
+ */
+typedef struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	uint32_t * tasks;
+	uint32_t head;
+	uint32_t tail;
+
+	Chip8 * cpu_reg;   // machine reused for every session this worker runs
+	uint32_t id;
+	uint32_t steals;
+} Worker;
+
+
+static Session * sessions;
+static uint32_t session_count;
+
+static Worker workers[MAX_WORKERS];
+static uint32_t worker_count;
+
+static uint32_t seed = 1;   // seed_random() seed of sessions that don't give their own
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ *	screen_hash()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: 64-bit FNV-1a hash of the video buffer
+ *	Function: Fingerprints the final screen so runs can be compared
+ */
+static uint64_t screen_hash(const Chip8 * cpu_reg) {
+	uint64_t hash = 0xCBF29CE484222325ull;
+
+	for (int row=0; row < HEIGHT; ++row) {
+		for (int b=0; b < 8; ++b) {
+			hash ^= (cpu_reg->video_buffer[row] >> (b * 8)) & 0xFF;
+			hash *= 0x100000001B3ull;
+		}
+	}
+
+	return hash;
+}
+
+
+/*
+ *	load_manifest()
+ *	Inputs: filename - Manifest file
+ *	Return Value: Returns 0 on success; returns -1 on a bad manifest
+ *	Function: Reads every session from the manifest
+ */
+static int load_manifest(const char * filename) {
+	FILE * f = fopen(filename, "r");
+	char line[1024];
+	uint32_t capacity = 0;
+	int lineno = 0;
+
+	if (f == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char rom[256], script[256], profile[32], budget[32];
+		unsigned long long cycles;
+		unsigned long session_seed;
+
+		lineno++;
+		int fields = sscanf(line, "%255s %llu %255s %31s %lu %31s", rom, &cycles, script, profile, &session_seed, budget);
+		if (fields <= 0 || rom[0] == '#')
+			continue;
+		if (fields < 2) {
+			fprintf(stderr, "%s:%d: expected <rom> <cycles> [<script> [<profile> [<seed> [<budget>]]]]\n", filename, lineno);
+			fclose(f);
+			return -1;
+		}
+
+		if (session_count == capacity) {
+			uint32_t grown = capacity ? capacity * 2 : 256;
+			Session * more = realloc(sessions, grown * sizeof(Session));
+			if (more == NULL) {
+				fprintf(stderr, "%s:%d: out of memory for %u sessions\n", filename, lineno, grown);
+				fclose(f);
+				return -1;
+			}
+			sessions = more;
+			capacity = grown;
+		}
+
+		Session * session = &sessions[session_count++];
+		memset(session, 0, sizeof(Session));
+		strcpy(session->rom, rom);
+		session->cycles = cycles;
+		session->profile = QUIRKS_SCHIP;
+		session->seed = (fields >= 5) ? session_seed : seed;
+		session->frame_budget = DEFAULT_FRAME_BUDGET;
+
+		if (fields >= 6) {
+			char * end;
+			session->frame_budget = strtoul(budget, &end, 0);
+			session->vip_timing = (*end == 'c');
+			if (session->frame_budget == 0 || (*end != '\0' && strcmp(end, "c") != 0)) {
+				fprintf(stderr, "%s:%d: bad frame budget %s\n", filename, lineno, budget);
+				fclose(f);
+				return -1;
+			}
+		}
+
+		if (fields >= 4) {
+			int found = find_quirk_profile(profile);
+			if (found == -1) {
+				fprintf(stderr, "%s:%d: unknown quirk profile %s\n", filename, lineno, profile);
+				fclose(f);
+				return -1;
+			}
+			session->profile = found;
+		}
+
+		if (fields >= 3 && strcmp(script, "-") != 0 && input_log_load(&session->input, script) == -1) {
+			fprintf(stderr, "%s:%d: can't read input script %s\n", filename, lineno, script);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+/*
+ *	run_session()
+ *	Inputs: cpu_reg - Machine to run the session on
+ *	        session - Session to run
+ *	Return Value: None
+ *	Function: Resets the machine, loads the ROM and runs frames until the
+ *	          session's cycles have executed, applying the input script on
+ *	          the way
+ */
+static void run_session(Chip8 * cpu_reg, Session * session) {
+	double start = now();
+
+	initialize_cpu(cpu_reg);
+	set_quirk_profile(cpu_reg, session->profile);
+	seed_random(cpu_reg, session->seed);
+	set_frame_budget(cpu_reg, session->frame_budget, session->vip_timing);
+
+	if (load_program(cpu_reg, session->rom) == -1) {
+		session->failed = 1;
+		return;
+	}
+
+	input_log_replay(&session->input, cpu_reg, session->cycles);
+
+	session->executed = cpu_reg->instructions_retired;
+	session->screen_hash = screen_hash(cpu_reg);
+	session->faults = cpu_reg->faults;
+	session->first_fault = cpu_reg->first_fault;
+	session->first_fault_pc = cpu_reg->first_fault_pc;
+	session->seconds = now() - start;
+}
+
+
+/*
+ *	take_task()
+ *	Inputs: worker - Worker looking for a session
+ *	Return Value: Index of a session to run; -1 once every deque is empty
+ *	Function: Pops from the worker's own deque, otherwise steals from the
+ *	          head of the other workers' deques, starting with the next one
+ */
+static int64_t take_task(Worker * worker) {
+	int64_t task = -1;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head < worker->tail)
+		task = worker->tasks[--worker->tail];
+	pthread_mutex_unlock(&worker->lock);
+
+	for (uint32_t i=1; task == -1 && i < worker_count; ++i) {
+		Worker * victim = &workers[(worker->id + i) % worker_count];
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail) {
+			task = victim->tasks[victim->head++];
+			worker->steals++;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return task;
+}
+
+
+static void * worker_main(void * arg) {
+	Worker * worker = arg;
+	int64_t task;
+
+	while ((task = take_task(worker)) != -1)
+		run_session(worker->cpu_reg, &sessions[task]);
+
+	return NULL;
+}
+
+
+/*
+ *	compare_budget()
+ *	Function: qsort() comparator putting the biggest budgets first
+ */
+static int compare_budget(const void * a, const void * b) {
+	uint64_t x = sessions[*(const uint32_t *)a].cycles;
+	uint64_t y = sessions[*(const uint32_t *)b].cycles;
+
+	return (x < y) - (x > y);
+}
+
+
+int main(int argc, char **argv) {
+	const char * manifest = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i=1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = atol(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else
+			manifest = argv[i];
+	}
+
+	if (manifest == NULL) {
+		fprintf(stderr, "usage: %s [-j threads] [-s seed] <manifest>\n", argv[0]);
+		return 1;
+	}
+	if (load_manifest(manifest) == -1)
+		return 1;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_WORKERS)
+		threads = MAX_WORKERS;
+	if (threads > session_count && session_count > 0)
+		threads = session_count;
+	worker_count = threads;
+
+	// deal the sessions out biggest first, so the long ones start early and
+	// the short ones are left over for stealing at the end
+	uint32_t * order = malloc((session_count + 1) * sizeof(uint32_t));
+	for (uint32_t i=0; i < session_count; ++i)
+		order[i] = i;
+	qsort(order, session_count, sizeof(uint32_t), compare_budget);
+
+	for (uint32_t w=0; w < worker_count; ++w) {
+		Worker * worker = &workers[w];
+
+		worker->id = w;
+		worker->tasks = malloc((session_count / worker_count + 1) * sizeof(uint32_t));
+		pthread_mutex_init(&worker->lock, NULL);
+
+		// initialize_cpu() builds the shared decode table on first use, so
+		// every machine is set up here before any thread starts
+		worker->cpu_reg = calloc(1, sizeof(Chip8));
+		initialize_cpu(worker->cpu_reg);
+	}
+
+	// the owner pops from the tail, so push each worker's share in reverse
+	for (uint32_t i=session_count; i-- > 0; ) {
+		Worker * worker = &workers[i % worker_count];
+		worker->tasks[worker->tail++] = order[i];
+	}
+
+	double start = now();
+
+	for (uint32_t w=0; w < worker_count; ++w)
+		pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]);
+
+	uint32_t steals = 0;
+	for (uint32_t w=0; w < worker_count; ++w) {
+		pthread_join(workers[w].thread, NULL);
+		steals += workers[w].steals;
+	}
+
+	double elapsed = now() - start;
+	uint64_t total = 0;
+	uint32_t failed = 0;
+
+	for (uint32_t i=0; i < session_count; ++i) {
+		const Session * session = &sessions[i];
+
+		if (session->failed) {
+			printf("%s\tfailed to load\n", session->rom);
+			failed++;
+			continue;
+		}
+
+		printf("%s\t%llu\t%016llx\t%.3f ms", session->rom, (unsigned long long)session->executed,
+		       (unsigned long long)session->screen_hash, session->seconds * 1e3);
+		if (session->faults)
+			printf("\t%u faults, first %s at %03x", session->faults, fault_name(session->first_fault),
+			       session->first_fault_pc);
+		printf("\n");
+		total += session->executed;
+	}
+
+	printf("# %u sessions (%u failed) on %u threads, %u steals: %llu instructions in %.3f s = %.1f M instructions/s\n",
+	       session_count, failed, worker_count, steals, (unsigned long long)total, elapsed,
+	       elapsed > 0 ? total / elapsed / 1e6 : 0.0);
+
+	return failed ? 2 : 0;
+}
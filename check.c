@@ -0,0 +1,995 @@
+// CHIP-8 regression checks
+//
+// Usage: chip8-check [rom.ch8 [check ...]]
+//
+// Runs each check below (or just the ones named) against random ROMs built
+// from the instruction sequences the interpreter treats specially, and
+// against rom.ch8 (Tetris.ch8 by default), printing one line per check.
+// The exit status is the number of checks that failed. `make check` builds
+// and runs it with and without -DCHIP8_THREADED, runs the jit and aot
+// checks again on faults.ch8, which faults in the middle of its blocks, and
+// the lockstep check again with lockstep.c built with -mavx2
+// (-DCHIP8_LOCKSTEP_AVX2).
+//
+//   fusion    run_cycles() in random slices (fused, idle-loop detection)
+//             retires exactly the instructions asked for and ends in the
+//             same state, with the same VIP cycles, as step_instruction()
+//   cycles    run_frame() with VIP cycle budgets (the real machine's, and
+//             small ones that frames overrun) charges the same cycles,
+//             carries the same overrun into the next frame and ends each
+//             frame in the same state as a scheduler that calls
+//             step_instruction() until the budget is spent, on random ROMs
+//             and rom.ch8 with random keys; every frame is budget cycles
+//   aot       (built with -DCHIP8_AOT and a chip8aot output) every block of
+//             the compiled ROM, and every instruction aot_run() interprets,
+//             leaves the machine as step_instruction() does, with random keys
+//   jit       rom.ch8 runs through jit_run_checked() with no mismatches, and
+//             jit_run() (which follows the blocks' successor links) matches
+//             step_instruction() frame by frame
+//   replay    rom.ch8 played with random keys and recorded with
+//             input_log_record() replays to the same state, frame for frame,
+//             from the saved log, with an instruction budget and with VIP
+//             cycle budgets small enough that some frames retire nothing
+//             (rewinding now and then, with input_log_truncate()); and a log
+//             in the old instruction-keyed format still replays
+//   lockstep  random ROMs, a ROM whose lanes rewrite one of its own
+//             instructions differently, and rom.ch8, on every profile, with a
+//             seed and keys of its own in every lane: each lane of
+//             lockstep_run() ends every run, and every lockstep_end_frame(),
+//             in the same state as a machine run with step_instruction()
+//   env       a batch of environments running a ROM that faults and then
+//             halts, and one running rom.ch8 with max_episode_steps, step
+//             through the same states, rewards and observations (views of
+//             video_buffer) as machines given the same keys with
+//             run_frame(); episodes end on the right step, with the right
+//             status, and are reset to a machine as fresh as a new one
+//   savestate random ROMs and rom.ch8, run with random keys and budgets:
+//             stepping the rewind buffer back gives every frame's
+//             save_state() byte for byte, and a machine given one of those
+//             states with load_state() (or a file) runs on through the
+//             same states and state_hash() values as the original
+#include "cpu.h"
+#include "env.h"
+#include "inputlog.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "savestate.h"
+#ifdef CHIP8_AOT
+#include "aot.h"
+#endif
+
+
+#define RANDOM_ROMS          3000   // per quirk profile
+#define RANDOM_ROM_SIZE      256
+#define RANDOM_ROM_STEPS     2000   // instructions each random ROM is run for
+#define MAX_SLICE            40     // instructions per run_cycles() call
+#define CHECK_FRAMES         3000   // frames the compiled ROM is run for
+#define KEY_HOLD_FRAMES      8      // frames each random key is held for
+#define JIT_FRAME_BUDGET     100    // instructions per frame given to the JIT
+#define CYCLE_ROMS           300    // random ROMs per quirk profile
+#define CYCLE_FRAMES         200    // frames each random ROM is run for
+#define REPLAY_FRAMES        6000
+#define REPLAY_FILE          "chip8-check.keys"
+#define REWIND_EVERY         13     // frames between rewinds while recording
+#define REWIND_BYTES         (1 << 20)
+#define SAVESTATE_ROMS       100    // random ROMs per quirk profile
+#define SAVESTATE_FRAMES     300    // frames each machine is saved and rewound over
+#define SAVESTATE_REWIND_BYTES (SAVESTATE_FRAMES * 2 * SAVE_STATE_SIZE)   // room to rewind every frame
+#define STATE_FILE           "chip8-check.state"
+#define LOCKSTEP_ROMS        40     // random ROMs per quirk profile
+#define LOCKSTEP_LANES       37     // not a whole number of vector chunks
+#define LOCKSTEP_STEPS       3000   // instructions each lane is run for
+#define ROM_FILE             "chip8-check.ch8"   // ROMs the checks build
+#define ENV_COUNT            5
+#define ENV_STEPS            150    // steps each batch is run for
+#define ENV_MAX_STEPS        60     // episode length the rom.ch8 batch is truncated to
+
+
+typedef struct check {
+	const char * name;
+	int (*run)(const char * rom);   // returns the number of failures
+} Check;
+
+
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+
+/*
+ *	next_random()
+ *	Return Value: Next number from an xorshift64* generator
+ */
+static uint32_t next_random(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (rng * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+
+/*
+ *	put_op()
+ *	Inputs: rom - ROM being built
+ *	        pos - Byte offset to write at
+ *	        opcode - Instruction word
+ *	Return Value: Offset of the next instruction
+ */
+static uint32_t put_op(uint8_t * rom, uint32_t pos, uint16_t opcode) {
+	rom[pos] = opcode >> 8;
+	rom[pos + 1] = opcode;
+	return pos + 2;
+}
+
+
+/*
+ *	random_rom()
+ *	Inputs: rom - RANDOM_ROM_SIZE bytes to fill
+ *	Return Value: None
+ *	Function: Strings together the sequences instruction fusion and
+ *	          idle-loop detection look for (with both outcomes of every
+ *	          test) and random instruction words
+ */
+static void random_rom(uint8_t * rom) {
+	uint32_t pos = 0;
+
+	while (pos + 6 <= RANDOM_ROM_SIZE) {
+		uint16_t x = next_random() & 0xF, y = next_random() & 0xF, kk = next_random() & 0xFF;
+		uint16_t here = PROGRAM_START + pos;
+		uint16_t target = PROGRAM_START + (next_random() % (RANDOM_ROM_SIZE / 2)) * 2;
+
+		switch (next_random() % 8) {
+		case 0:   // 6XKK 3XKK
+			pos = put_op(rom, pos, 0x6000 | x << 8 | kk);
+			pos = put_op(rom, pos, 0x3000 | ((next_random() & 1) ? x : y) << 8 | ((next_random() & 1) ? kk : next_random() & 0xFF));
+			break;
+		case 1:   // 6XKK 1NNN
+			pos = put_op(rom, pos, 0x6000 | x << 8 | kk);
+			pos = put_op(rom, pos, 0x1000 | target);
+			break;
+		case 2:   // counted loop: 7XKK 4XKK 1NNN back to the 7XKK
+			pos = put_op(rom, pos, 0x7000 | x << 8 | (1 + next_random() % 3));
+			pos = put_op(rom, pos, 0x4000 | x << 8 | kk);
+			pos = put_op(rom, pos, 0x1000 | here);
+			break;
+		case 3:   // 7XKK 4YKK
+			pos = put_op(rom, pos, 0x7000 | x << 8 | kk);
+			pos = put_op(rom, pos, 0x4000 | y << 8 | (next_random() & 0xFF));
+			break;
+		case 4:   // ANNN DXYN
+			pos = put_op(rom, pos, 0xA000 | (next_random() % MEMORY_SIZE));
+			pos = put_op(rom, pos, 0xD000 | x << 8 | y << 4 | (next_random() & 0xF));
+			break;
+		case 5:   // ANNN FX65
+			pos = put_op(rom, pos, 0xA000 | (next_random() % MEMORY_SIZE));
+			pos = put_op(rom, pos, 0xF065 | x << 8);
+			break;
+		case 6:   // polling loop: FX07 3XKK 1NNN back to the FX07
+			pos = put_op(rom, pos, 0xF007 | x << 8);
+			pos = put_op(rom, pos, 0x3000 | x << 8 | kk);
+			pos = put_op(rom, pos, 0x1000 | here);
+			break;
+		default:
+			pos = put_op(rom, pos, next_random());
+			break;
+		}
+	}
+
+	while (pos < RANDOM_ROM_SIZE)
+		pos = put_op(rom, pos, next_random());
+}
+
+
+/*
+ *	start_machine()
+ *	Inputs: cpu_reg - Zeroed or previously used machine
+ *	        profile - Quirk profile
+ *	        rom - ROM image
+ *	        size - Bytes in rom
+ *	        seed - seed_random() seed
+ *	Return Value: None
+ *	Function: Resets the machine and loads the ROM the way load_program() does
+ */
+static void start_machine(Chip8 * cpu_reg, QuirkProfile profile, const uint8_t * rom, uint32_t size, uint32_t seed) {
+	set_quirk_profile(cpu_reg, profile);
+	initialize_cpu(cpu_reg);
+	seed_random(cpu_reg, seed);
+	memcpy(cpu_reg->memory + PROGRAM_START, rom, size);
+	invalidate_icache(cpu_reg, PROGRAM_START, size);
+}
+
+
+/*
+ *	load_machine()
+ *	Inputs: cpu_reg - Zeroed or previously used machine
+ *	        rom_file - ROM to load
+ *	        seed - seed_random() seed
+ *	Return Value: Returns 0 on success; returns -1 if the ROM can't be loaded
+ *	Function: Resets the machine to the default profile and loads the ROM
+ */
+static int load_machine(Chip8 * cpu_reg, const char * rom_file, uint32_t seed) {
+	set_quirk_profile(cpu_reg, QUIRKS_SCHIP);
+	initialize_cpu(cpu_reg);
+	seed_random(cpu_reg, seed);
+	return (load_program(cpu_reg, rom_file) == -1) ? -1 : 0;
+}
+
+/*
+ *	same_machine()
+ *	Inputs: a, b - Machines to compare
+ *	Return Value: 1 if they have the same state, faults and instruction count; 0 otherwise
+ */
+static int same_machine(const Chip8 * a, const Chip8 * b) {
+	return state_hash(a) == state_hash(b) && a->pc == b->pc && a->faults == b->faults &&
+	       a->first_fault == b->first_fault && a->first_fault_pc == b->first_fault_pc &&
+	       a->instructions_retired == b->instructions_retired;
+}
+
+
+/*
+ *	random_keys()
+ *	Inputs: a, b - Machines to press the same keys on
+ *	Return Value: None
+ *	Function: Lets go of everything, then usually presses one random key
+ */
+static void random_keys(Chip8 * a, Chip8 * b) {
+	uint32_t key = next_random() % 20;
+
+	for (uint32_t k=0; k < 16; ++k)
+		a->keys[k] = b->keys[k] = (k == key);
+}
+
+
+/*
+ *	check_fusion()
+ *	Function: See the top of the file
+ */
+static int check_fusion(const char * rom_file) {
+	Chip8 * fused = calloc(1, sizeof(Chip8));
+	Chip8 * stepped = calloc(1, sizeof(Chip8));
+	uint8_t rom[RANDOM_ROM_SIZE];
+	uint64_t fusions = 0;
+	int failures = 0;
+
+	for (int profile=0; profile < QUIRK_PROFILE_COUNT; ++profile) {
+		for (int n=0; n < RANDOM_ROMS; ++n) {
+			uint32_t seed = next_random();
+			uint16_t keys = next_random();
+
+			random_rom(rom);
+			start_machine(fused, profile, rom, sizeof(rom), seed);
+			start_machine(stepped, profile, rom, sizeof(rom), seed);
+			for (int k=0; k < 16; ++k)
+				fused->keys[k] = stepped->keys[k] = (keys >> k) & 1;
+
+			for (uint32_t done=0; done < RANDOM_ROM_STEPS; ) {
+				uint32_t slice = 1 + next_random() % MAX_SLICE;
+
+				run_cycles(fused, slice);
+				for (uint32_t i=0; i < slice; ++i)
+					step_instruction(stepped);
+				done += slice;
+
+				if (!same_machine(fused, stepped) || fused->cycles != stepped->cycles || fused->instructions_retired != done) {
+					printf("  %s random ROM %d: after %u instructions, %llu retired, %llu vs %llu cycles\n",
+					       quirk_profile_name(profile), n, done, (unsigned long long)fused->instructions_retired,
+					       (unsigned long long)fused->cycles, (unsigned long long)stepped->cycles);
+					failures++;
+					break;
+				}
+			}
+
+			for (int i=0; i < MAX_FUSIONS; ++i)
+				fusions += fused->fusion_executions[i];
+		}
+	}
+
+	if (fusions == 0) {
+		printf("  no fused sequence ran\n");
+		failures++;
+	}
+
+	free(fused);
+	free(stepped);
+	return failures;
+}
+
+
+/*
+ *	cycles_match()
+ *	Inputs: framed - Machine to run with run_frame()
+ *	        stepped - The same machine, to run with step_instruction()
+ *	        frames - Frames to run them for
+ *	        label - What to call them in messages
+ *	Return Value: Number of failures
+ *	Function: See the top of the file
+ */
+static int cycles_match(Chip8 * framed, Chip8 * stepped, uint32_t frames, const char * label) {
+	uint32_t budget = framed->frame_budget;
+
+	for (uint32_t frame=0; frame < frames; ++frame) {
+		if (frame % KEY_HOLD_FRAMES == 0)
+			random_keys(framed, stepped);
+
+		run_frame(framed);
+
+		// what a VIP budget means, one instruction at a time
+		if (stepped->frame_overrun >= budget) {
+			stepped->frame_overrun -= budget;
+		} else {
+			uint64_t end = stepped->cycles + budget - stepped->frame_overrun;
+
+			while (stepped->cycles < end)
+				step_instruction(stepped);
+			stepped->frame_overrun = stepped->cycles - end;
+		}
+		end_frame(stepped);
+
+		if (!same_machine(framed, stepped) || framed->cycles != stepped->cycles ||
+		    framed->frame_overrun != stepped->frame_overrun || framed->frames != stepped->frames ||
+		    framed->cycles - framed->frame_overrun != (uint64_t)framed->frames * budget) {
+			printf("  %s, %u cycle budget: after frame %u, %llu cycles (%u over) vs %llu (%u over)\n",
+			       label, budget, frame, (unsigned long long)framed->cycles, framed->frame_overrun,
+			       (unsigned long long)stepped->cycles, stepped->frame_overrun);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ *	check_cycles()
+ *	Function: See the top of the file
+ */
+static int check_cycles(const char * rom_file) {
+	static const uint32_t budgets[] = { VIP_CYCLES_PER_FRAME, 100, 37 };
+	Chip8 * framed = calloc(1, sizeof(Chip8));
+	Chip8 * stepped = calloc(1, sizeof(Chip8));
+	uint8_t rom[RANDOM_ROM_SIZE];
+	char label[64];
+	int failures = 0;
+
+	for (size_t b=0; b < sizeof(budgets) / sizeof(budgets[0]); ++b) {
+		for (int profile=0; profile < QUIRK_PROFILE_COUNT; ++profile) {
+			for (int n=0; n < CYCLE_ROMS && failures == 0; ++n) {
+				uint32_t seed = next_random();
+
+				random_rom(rom);
+				start_machine(framed, profile, rom, sizeof(rom), seed);
+				start_machine(stepped, profile, rom, sizeof(rom), seed);
+				set_frame_budget(framed, budgets[b], 1);
+				set_frame_budget(stepped, budgets[b], 1);
+				snprintf(label, sizeof(label), "%s random ROM %d", quirk_profile_name(profile), n);
+				failures += cycles_match(framed, stepped, CYCLE_FRAMES, label);
+			}
+		}
+
+		uint32_t seed = next_random();
+		if (load_machine(framed, rom_file, seed) == -1 || load_machine(stepped, rom_file, seed) == -1) {
+			printf("  can't load %s\n", rom_file);
+			failures++;
+			break;
+		}
+		set_frame_budget(framed, budgets[b], 1);
+		set_frame_budget(stepped, budgets[b], 1);
+		failures += cycles_match(framed, stepped, CHECK_FRAMES, rom_file);
+	}
+
+	free(framed);
+	free(stepped);
+	return failures;
+}
+
+
+/*
+ *	check_jit()
+ *	Function: See the top of the file
+ */
+static int check_jit(const char * rom_file) {
+	Chip8 * checked = calloc(1, sizeof(Chip8));
+	Chip8 * compiled = calloc(1, sizeof(Chip8));
+	Chip8 * stepped = calloc(1, sizeof(Chip8));
+	uint32_t seed = next_random();
+	int failures = 0;
+
+	if (load_machine(checked, rom_file, seed) == -1) {
+		printf("  can't load %s\n", rom_file);
+		return 1;
+	}
+	load_machine(compiled, rom_file, seed);
+	load_machine(stepped, rom_file, seed);
+
+	Jit * checker = jit_create(checked);
+	Jit * jit = jit_create(compiled);
+
+	for (uint32_t frame=0; frame < CHECK_FRAMES && failures == 0; ++frame) {
+		if (frame % KEY_HOLD_FRAMES == 0) {
+			random_keys(compiled, stepped);
+			memcpy(checked->keys, compiled->keys, sizeof(checked->keys));
+		}
+
+		jit_run_checked(checker, JIT_FRAME_BUDGET);
+		jit_run(jit, JIT_FRAME_BUDGET);
+		while (stepped->instructions_retired < compiled->instructions_retired)
+			step_instruction(stepped);
+
+		if (!same_machine(compiled, stepped)) {
+			printf("  frame %u: jit_run() differs from the interpreter\n", frame);
+			failures++;
+		}
+
+		end_frame(checked);
+		end_frame(compiled);
+		end_frame(stepped);
+	}
+
+	const JitStats * stats = jit_get_stats(checker);
+	if (stats->mismatches > 0) {
+		printf("  jit_run_checked(): %u blocks differ from the interpreter\n", stats->mismatches);
+		failures++;
+	}
+	if (jit_get_stats(jit)->blocks_executed == 0)
+		printf("  no native code on this platform; only the interpreter fallback was checked\n");
+
+	jit_destroy(checker);
+	jit_destroy(jit);
+	free(checked);
+	free(compiled);
+	free(stepped);
+	return failures;
+}
+
+
+/*
+ *	replay_matches()
+ *	Inputs: rom_file - ROM the log was recorded on
+ *	        seed, budget, vip_timing - How the recorded machine was set up
+ *	        recorded - The recorded machine, at the end of the log
+ *	        log_file - Input log to replay
+ *	Return Value: 1 if replaying the log ends in the recorded state; 0 otherwise
+ */
+static int replay_matches(const char * rom_file, uint32_t seed, uint32_t budget, int vip_timing,
+                          const Chip8 * recorded, const char * log_file) {
+	Chip8 * replayed = calloc(1, sizeof(Chip8));
+	InputLog log = {0};
+	int same;
+
+	load_machine(replayed, rom_file, seed);
+	set_frame_budget(replayed, budget, vip_timing);
+	if (input_log_load(&log, log_file) == -1) {
+		free(replayed);
+		return 0;
+	}
+	input_log_replay(&log, replayed, recorded->instructions_retired);
+
+	same = same_machine(replayed, recorded) && replayed->frames == recorded->frames &&
+	       replayed->cycles == recorded->cycles && memcmp(replayed->keys, recorded->keys, sizeof(replayed->keys)) == 0;
+
+	input_log_free(&log);
+	free(replayed);
+	return same;
+}
+
+
+/*
+ *	check_replay()
+ *	Function: See the top of the file
+ */
+static int check_replay(const char * rom_file) {
+	static const struct {
+		uint32_t budget;
+		int vip_timing;
+	} budgets[] = {
+		{ DEFAULT_FRAME_BUDGET, 0 }, { VIP_CYCLES_PER_FRAME, 1 }, { 100, 1 }
+	};
+	Chip8 * recorded = calloc(1, sizeof(Chip8));
+	Rewind * rw = rewind_create(REWIND_BYTES);
+	int failures = 0;
+
+	for (size_t b=0; b < sizeof(budgets) / sizeof(budgets[0]); ++b) {
+		uint32_t seed = next_random();
+		uint32_t idle_frames = 0;
+		InputLog log = {0};
+		FILE * old_log = NULL;
+
+		if (load_machine(recorded, rom_file, seed) == -1) {
+			printf("  can't load %s\n", rom_file);
+			failures++;
+			break;
+		}
+		set_frame_budget(recorded, budgets[b].budget, budgets[b].vip_timing);
+		rewind_clear(rw);
+		rewind_capture(rw, recorded);
+
+		// an instruction budget also gets the log written the old way
+		if (!budgets[b].vip_timing)
+			old_log = fopen(REPLAY_FILE ".old", "w");
+
+		// carry on past REPLAY_FRAMES until a frame retires something, so
+		// the replay (which runs to an instruction count) stops on the same one
+		for (uint32_t frame=0; frame < REPLAY_FRAMES || idle_frames > 0; ++frame) {
+			uint64_t retired = recorded->instructions_retired;
+
+			if (frame % (1 + next_random() % KEY_HOLD_FRAMES) == 0 && frame < REPLAY_FRAMES) {
+				uint8_t before[16];
+
+				memcpy(before, recorded->keys, sizeof(before));
+				random_keys(recorded, recorded);
+				for (int k=0; k < 16 && old_log != NULL; ++k) {
+					if (recorded->keys[k] != before[k])
+						fprintf(old_log, "%llu %X %u\n", (unsigned long long)retired, k, recorded->keys[k]);
+				}
+			}
+
+			input_log_record(&log, recorded);
+			run_frame(recorded);
+			rewind_capture(rw, recorded);
+			idle_frames = (recorded->instructions_retired == retired) ? idle_frames + 1 : 0;
+
+			// go back now and then, as the emulator does while Backspace is held
+			if (old_log == NULL && frame % REWIND_EVERY == REWIND_EVERY - 1 && frame < REPLAY_FRAMES) {
+				for (uint32_t back = 1 + next_random() % KEY_HOLD_FRAMES; back > 0; --back)
+					rewind_step_back(rw, recorded);
+				input_log_truncate(&log, recorded);
+				idle_frames = 1;   // the frame rewound to may not have retired anything
+			}
+		}
+
+		if (input_log_save(&log, REPLAY_FILE) == -1 ||
+		    !replay_matches(rom_file, seed, budgets[b].budget, budgets[b].vip_timing, recorded, REPLAY_FILE)) {
+			printf("  budget %u%s: the replay differs from the recording\n", budgets[b].budget,
+			       budgets[b].vip_timing ? "c" : "");
+			failures++;
+		}
+
+		if (old_log != NULL) {
+			fclose(old_log);
+			if (!replay_matches(rom_file, seed, budgets[b].budget, 0, recorded, REPLAY_FILE ".old")) {
+				printf("  an old instruction-keyed log doesn't replay\n");
+				failures++;
+			}
+			remove(REPLAY_FILE ".old");
+		}
+
+		remove(REPLAY_FILE);
+		input_log_free(&log);
+	}
+
+	rewind_destroy(rw);
+	free(recorded);
+	return failures;
+}
+
+
+/*
+ *	savestate_round_trip()
+ *	Inputs: cpu_reg - Machine with its ROM loaded
+ *	        label - What to call it in messages
+ *	Return Value: Number of failures
+ *	Function: See the top of the file
+ */
+static int savestate_round_trip(Chip8 * cpu_reg, const char * label) {
+	static uint8_t states[SAVESTATE_FRAMES + 1][SAVE_STATE_SIZE];
+	static uint64_t hashes[SAVESTATE_FRAMES + 1];
+	static uint8_t keys[SAVESTATE_FRAMES][16];
+	uint8_t now[SAVE_STATE_SIZE];
+	Rewind * rw = rewind_create(SAVESTATE_REWIND_BYTES);
+	Chip8 * loaded = calloc(1, sizeof(Chip8));
+	uint32_t middle = next_random() % SAVESTATE_FRAMES;
+	int failures = 0;
+
+	static const uint32_t budgets[][2] = { { DEFAULT_FRAME_BUDGET, 0 }, { VIP_CYCLES_PER_FRAME, 1 }, { 100, 1 } };
+	uint32_t b = next_random() % 3;
+	set_frame_budget(cpu_reg, budgets[b][0], budgets[b][1]);
+
+	save_state(cpu_reg, states[0]);
+	hashes[0] = state_hash(cpu_reg);
+	rewind_capture(rw, cpu_reg);
+	for (uint32_t frame=0; frame < SAVESTATE_FRAMES; ++frame) {
+		if (frame % KEY_HOLD_FRAMES == 0)
+			random_keys(cpu_reg, cpu_reg);
+		memcpy(keys[frame], cpu_reg->keys, 16);
+
+		run_frame(cpu_reg);
+		save_state(cpu_reg, states[frame + 1]);
+		hashes[frame + 1] = state_hash(cpu_reg);
+		rewind_capture(rw, cpu_reg);
+	}
+
+	for (uint32_t frame=SAVESTATE_FRAMES; frame-- > 0; ) {
+		rewind_step_back(rw, cpu_reg);
+		save_state(cpu_reg, now);
+		if (memcmp(now, states[frame], SAVE_STATE_SIZE) != 0 || state_hash(cpu_reg) != hashes[frame]) {
+			printf("  %s: rewinding to frame %u doesn't restore it\n", label, frame);
+			failures++;
+			break;
+		}
+	}
+
+	// start the loaded machine off on another profile with nothing in memory
+	set_quirk_profile(loaded, (get_quirk_profile(cpu_reg) + 1) % QUIRK_PROFILE_COUNT);
+	initialize_cpu(loaded);
+	set_frame_budget(loaded, budgets[b][0], budgets[b][1]);
+	if (save_state_file(cpu_reg, STATE_FILE) == -1 || load_state_file(loaded, STATE_FILE) == -1 ||
+	    load_state(loaded, states[middle], SAVE_STATE_SIZE) == -1) {
+		printf("  %s: can't save or load a state\n", label);
+		failures++;
+	}
+	remove(STATE_FILE);
+
+	for (uint32_t frame=middle; frame < SAVESTATE_FRAMES && failures == 0; ++frame) {
+		memcpy(loaded->keys, keys[frame], 16);
+		run_frame(loaded);
+		save_state(loaded, now);
+		if (memcmp(now, states[frame + 1], SAVE_STATE_SIZE) != 0 || state_hash(loaded) != hashes[frame + 1]) {
+			printf("  %s: the state loaded at frame %u differs from the original by frame %u\n", label, middle, frame + 1);
+			failures++;
+		}
+	}
+
+	// damaged states are turned away
+	memcpy(now, states[middle], SAVE_STATE_SIZE);
+	now[4]++;
+	if (load_state(loaded, now, SAVE_STATE_SIZE) != -1 || load_state(loaded, states[middle], SAVE_STATE_SIZE - 1) != -1) {
+		printf("  %s: load_state() accepted a bad state\n", label);
+		failures++;
+	}
+
+	free(loaded);
+	rewind_destroy(rw);
+	return failures;
+}
+
+
+/*
+ *	check_savestate()
+ *	Function: See the top of the file
+ */
+static int check_savestate(const char * rom_file) {
+	Chip8 * cpu_reg = calloc(1, sizeof(Chip8));
+	uint8_t rom[RANDOM_ROM_SIZE];
+	char label[64];
+	int failures = 0;
+
+	for (int profile=0; profile < QUIRK_PROFILE_COUNT; ++profile) {
+		for (int n=0; n < SAVESTATE_ROMS && failures == 0; ++n) {
+			random_rom(rom);
+			start_machine(cpu_reg, profile, rom, sizeof(rom), next_random());
+			snprintf(label, sizeof(label), "%s random ROM %d", quirk_profile_name(profile), n);
+			failures += savestate_round_trip(cpu_reg, label);
+		}
+	}
+
+	if (load_machine(cpu_reg, rom_file, next_random()) == -1) {
+		printf("  can't load %s\n", rom_file);
+		failures++;
+	} else {
+		failures += savestate_round_trip(cpu_reg, rom_file);
+	}
+
+	free(cpu_reg);
+	return failures;
+}
+
+
+/*
+ *	env_reward()
+ *	Function: Reward callback for check_env(): V1, which its ROM counts in
+ */
+static float env_reward(const Chip8 * cpu_reg, void * data) {
+	return cpu_reg->V[1];
+}
+
+
+/*
+ *	env_matches()
+ *	Inputs: config - Batch settings
+ *	        episode_steps - Step every episode should end on
+ *	        end - EnvStatus it should end with
+ *	        label - What to call the batch in messages
+ *	Return Value: Number of failures
+ *	Function: See the top of the file
+ */
+static int env_matches(const EnvConfig * config, uint32_t episode_steps, EnvStatus end, const char * label) {
+	static Chip8 expected[ENV_COUNT];
+	uint32_t actions[ENV_COUNT];
+	float rewards[ENV_COUNT];
+	uint8_t status[ENV_COUNT];
+	EnvBatch * envs = env_create(config, ENV_COUNT);
+	int failures = 0;
+
+	if (envs == NULL) {
+		printf("  %s: env_create() failed\n", label);
+		return 1;
+	}
+
+	for (uint32_t step=0; step < ENV_STEPS && failures == 0; ++step) {
+		for (uint32_t env=0; env < ENV_COUNT && failures == 0; ++env) {
+			Chip8 * cpu_reg = env_machine(envs, env);
+
+			// a new episode: what a new machine would be, but for the seed
+			if (step % episode_steps == 0) {
+				set_quirk_profile(&expected[env], config->profile);
+				initialize_cpu(&expected[env]);
+				load_program(&expected[env], config->rom);
+				set_frame_budget(&expected[env], config->cycles_per_step, 0);
+				expected[env].rand_state = cpu_reg->rand_state;
+			}
+
+			EnvObservation obs = env_observation(envs, env);
+			if (!same_machine(cpu_reg, &expected[env]) || cpu_reg->frames != expected[env].frames ||
+			    cpu_reg->cycles != expected[env].cycles || cpu_reg->unknown_opcodes != expected[env].unknown_opcodes ||
+			    cpu_reg->waiting_for_key != expected[env].waiting_for_key ||
+			    obs.rows != cpu_reg->video_buffer || obs.width != WIDTH || obs.height != HEIGHT) {
+				printf("  %s: environment %u differs before step %u\n", label, env, step);
+				failures++;
+			}
+
+			actions[env] = next_random() % (env_action_count(envs) + 1);
+		}
+
+		env_step(envs, actions, rewards, status);
+
+		for (uint32_t env=0; env < ENV_COUNT && failures == 0; ++env) {
+			uint16_t keys = (actions[env] < ENV_DEFAULT_ACTIONS && actions[env] > 0) ? 1 << (actions[env] - 1) : 0;
+
+			for (int k=0; k < 16; ++k)
+				expected[env].keys[k] = (keys >> k) & 1;
+			run_frame(&expected[env]);
+
+			EnvStatus want = ((step + 1) % episode_steps == 0) ? end : ENV_RUNNING;
+			if (status[env] != want || rewards[env] != expected[env].V[1]) {
+				printf("  %s: environment %u, step %u: status %u, reward %g, expected %u, %u\n",
+				       label, env, step, status[env], rewards[env], want, expected[env].V[1]);
+				failures++;
+			}
+		}
+	}
+
+	env_destroy(envs);
+	return failures;
+}
+
+
+/*
+ *	check_env()
+ *	Function: See the top of the file
+ */
+static int check_env(const char * rom_file) {
+	// faults once, then counts V1 up a frame at a time and halts
+	static const uint8_t halting[] = {
+		0xAF, 0xFF,   // 200: LD I, FFF
+		0xD0, 0x1F,   // 202: DRW V0, V1, F (reads past memory)
+		0x71, 0x01,   // 204: ADD V1, 01
+		0x31, 0x0A,   // 206: SE V1, 0A
+		0x12, 0x04,   // 208: JP 204
+		0x12, 0x0A,   // 20A: JP 20A
+	};
+	EnvConfig config = { .rom = ROM_FILE, .cycles_per_step = 3, .seed = next_random(), .reward = env_reward };
+	int failures = 0;
+
+	FILE * f = fopen(ROM_FILE, "wb");
+	fwrite(halting, 1, sizeof(halting), f);
+	fclose(f);
+
+	// 200-204 the first frame, SE JP ADD up to V1 = 10, then SE JP halted
+	for (int profile=0; profile < QUIRK_PROFILE_COUNT; ++profile) {
+		config.profile = profile;
+		failures += env_matches(&config, 11, ENV_TERMINATED, "halting ROM");
+	}
+	remove(ROM_FILE);
+
+	config.rom = rom_file;
+	config.profile = QUIRKS_SCHIP;
+	config.cycles_per_step = DEFAULT_FRAME_BUDGET;
+	config.max_episode_steps = ENV_MAX_STEPS;
+	failures += env_matches(&config, ENV_MAX_STEPS, ENV_TRUNCATED, rom_file);
+
+	return failures;
+}
+
+
+/*
+ *	lockstep_matches()
+ *	Inputs: rom_file - ROM to run
+ *	        profile - Quirk profile
+ *	        label - What to call the ROM in messages
+ *	Return Value: Number of failures
+ *	Function: See the top of the file
+ */
+static int lockstep_matches(const char * rom_file, QuirkProfile profile, const char * label) {
+	static Chip8 stepped[LOCKSTEP_LANES];
+	Lockstep * ls = lockstep_create(LOCKSTEP_LANES, profile);
+	int failures = 0;
+
+	if (ls == NULL || lockstep_load(ls, rom_file) == -1) {
+		printf("  %s: can't load it into the lanes\n", label);
+		lockstep_destroy(ls);
+		return 1;
+	}
+
+	for (uint32_t lane=0; lane < LOCKSTEP_LANES; ++lane) {
+		uint32_t seed = next_random();
+
+		set_quirk_profile(&stepped[lane], profile);
+		initialize_cpu(&stepped[lane]);
+		load_program(&stepped[lane], rom_file);
+		seed_random(&stepped[lane], seed);
+		seed_random(lockstep_lane(ls, lane), seed);
+	}
+
+	for (uint32_t done=0; done < LOCKSTEP_STEPS && failures == 0; ) {
+		uint32_t slice = 1 + next_random() % MAX_SLICE;
+
+		// the lanes go their own ways
+		for (uint32_t lane=0; lane < LOCKSTEP_LANES; ++lane) {
+			if (next_random() % KEY_HOLD_FRAMES == 0)
+				random_keys(lockstep_lane(ls, lane), &stepped[lane]);
+		}
+
+		lockstep_run(ls, slice);
+		for (uint32_t lane=0; lane < LOCKSTEP_LANES; ++lane) {
+			for (uint32_t i=0; i < slice; ++i)
+				step_instruction(&stepped[lane]);
+		}
+		done += slice;
+
+		if (next_random() & 1) {
+			lockstep_end_frame(ls);
+			for (uint32_t lane=0; lane < LOCKSTEP_LANES; ++lane)
+				end_frame(&stepped[lane]);
+		}
+
+		for (uint32_t lane=0; lane < LOCKSTEP_LANES; ++lane) {
+			if (!same_machine(lockstep_lane(ls, lane), &stepped[lane])) {
+				printf("  %s, %s: lane %u differs after %u instructions\n",
+				       label, quirk_profile_name(profile), lane, done);
+				failures++;
+				break;
+			}
+		}
+	}
+
+	const LockstepStats * stats = lockstep_get_stats(ls);
+	if (failures == 0 && stats->vector_lanes == 0) {
+		printf("  %s, %s: no instruction ran vectorized\n", label, quirk_profile_name(profile));
+		failures++;
+	}
+
+	lockstep_destroy(ls);
+	return failures;
+}
+
+
+/*
+ *	check_lockstep()
+ *	Function: See the top of the file
+ */
+static int check_lockstep(const char * rom_file) {
+	// every lane stores its own random byte into the ADD at 0x20A
+	static const uint8_t self_modifying[] = {
+		0xC0, 0xFF,   // 200: RND V0, FF
+		0xA2, 0x0B,   // 202: LD I, 20B
+		0xF0, 0x55,   // 204: LD [I], V0
+		0x71, 0x01,   // 206: ADD V1, 01
+		0x62, 0x00,   // 208: LD V2, 00
+		0x71, 0x00,   // 20A: ADD V1, (patched)
+		0x12, 0x00,   // 20C: JP 200
+	};
+	uint8_t rom[RANDOM_ROM_SIZE];
+	char label[64];
+	int failures = 0;
+
+#ifdef CHIP8_LOCKSTEP_AVX2
+	if (!__builtin_cpu_supports("avx2")) {
+		printf("  no AVX2 on this CPU; lockstep.c was built for it, so it wasn't run\n");
+		return 0;
+	}
+#endif
+
+	for (int profile=0; profile < QUIRK_PROFILE_COUNT; ++profile) {
+		for (int n=0; n <= LOCKSTEP_ROMS && failures == 0; ++n) {
+			FILE * f = fopen(ROM_FILE, "wb");
+
+			if (n < LOCKSTEP_ROMS) {
+				random_rom(rom);
+				fwrite(rom, 1, sizeof(rom), f);
+				snprintf(label, sizeof(label), "random ROM %d", n);
+			} else {
+				fwrite(self_modifying, 1, sizeof(self_modifying), f);
+				snprintf(label, sizeof(label), "self-modifying ROM");
+			}
+			fclose(f);
+
+			failures += lockstep_matches(ROM_FILE, profile, label);
+		}
+
+		if (failures == 0)
+			failures += lockstep_matches(rom_file, profile, rom_file);
+	}
+
+	remove(ROM_FILE);
+	return failures;
+}
+
+
+#ifdef CHIP8_AOT
+/*
+ *	check_aot()
+ *	Function: See the top of the file. The ROM is the one compiled in
+ *	          (aot_rom), not rom_file.
+ */
+static int check_aot(const char * rom_file) {
+	Chip8 * compiled = calloc(1, sizeof(Chip8));
+	Chip8 * stepped = calloc(1, sizeof(Chip8));
+	uint32_t seed = next_random();
+	int failures = 0;
+
+	start_machine(compiled, aot_quirk_profile, aot_rom, aot_rom_size, seed);
+	start_machine(stepped, aot_quirk_profile, aot_rom, aot_rom_size, seed);
+
+	for (uint32_t frame=0; frame < CHECK_FRAMES && failures == 0; ++frame) {
+		uint64_t end = compiled->instructions_retired + DEFAULT_FRAME_BUDGET;
+
+		if (frame % KEY_HOLD_FRAMES == 0)
+			random_keys(compiled, stepped);
+
+		while (compiled->instructions_retired < end) {
+			uint16_t pc = compiled->pc;
+
+			aot_run(compiled, 1);
+			while (stepped->instructions_retired < compiled->instructions_retired)
+				step_instruction(stepped);
+
+			if (!same_machine(compiled, stepped)) {
+				printf("  frame %u: block at 0x%03X differs from the interpreter\n", frame, pc);
+				failures++;
+				break;
+			}
+		}
+
+		end_frame(compiled);
+		end_frame(stepped);
+	}
+
+	free(compiled);
+	free(stepped);
+	return failures;
+}
+#endif
+
+
+static const Check checks[] = {
+	{ "fusion", check_fusion },
+	{ "cycles", check_cycles },
+	{ "jit",    check_jit },
+	{ "replay", check_replay },
+	{ "savestate", check_savestate },
+	{ "lockstep", check_lockstep },
+	{ "env", check_env },
+#ifdef CHIP8_AOT
+	{ "aot",    check_aot },
+#endif
+};
+
+
+int main(int argc, char **argv) {
+	const char * rom = (argc > 1) ? argv[1] : "Tetris.ch8";
+	int failed = 0;
+
+	for (size_t i=0; i < sizeof(checks) / sizeof(checks[0]); ++i) {
+		int wanted = (argc <= 2);
+
+		for (int arg=2; arg < argc; ++arg)
+			wanted |= !strcmp(argv[arg], checks[i].name);
+		if (!wanted)
+			continue;
+
+		int failures = checks[i].run(rom);
+
+		printf("%-10s %s\n", checks[i].name, failures ? "FAIL" : "ok");
+		failed += (failures != 0);
+	}
+
+	return failed;
+}
@@ -2,194 +2,1091 @@
 #include "cpu.h"
 
 
-static uint16_t stack[16];   // Stack used to store the return addresses from subroutines
-static uint16_t delay_timer;   // Used for timeing of game events
-static uint16_t sound_timer;   // Used for sound effects; beeps when nonzero
+/*
+ *  Hexadecimal sprite fonts (16 total digits, each 5 bytes long)
+ */
+static uint8_t fonts[80] = {
+	0xF0,0x90,0x90,0x90,0xF0,  // '0'
+	0x20,0x60,0x20,0x20,0x70,  // '1'
+	0xF0,0x10,0xF0,0x80,0xF0,  // '2'
+	0xF0,0x10,0xF0,0x10,0xF0,  // '3'
+	0x90,0x90,0xF0,0x10,0x10,  // '4'
+	0xF0,0x10,0x20,0x40,0x40,  // '5'
+	0xF0,0x80,0xF0,0x90,0xF0,  // '6'
+	0xF0,0x10,0x20,0x40,0x40,  // '7'
+	0xF0,0x90,0xF0,0x90,0xF0,  // '8'
+	0xF0,0x90,0xE0,0x90,0xE0,  // '9'
+	0xF0,0x90,0xF0,0x90,0x90,  // 'A'
+	0xE0,0x90,0xE0,0x90,0xE0,  // 'B'
+	0xF0,0x80,0x80,0x80,0xF0,  // 'C'
+	0xE0,0x90,0x90,0x90,0xE0,  // 'D'
+	0xF0,0x80,0xF0,0x80,0xF0,  // 'E'
+	0xF0,0x80,0xF0,0x80,0xF0   // 'F'
+};
+
+
+/*
+ *  Opcode dispatch table
+ *  Every 16-bit opcode maps to the index of its instruction handler. The
+ *  table is filled once from decode_opcode() and turns decoding into a
+ *  single lookup. Handlers wrapped in QUIRK() have one copy per quirk
+ *  profile (see quirks.h); the rest are shared by all profiles.
+ */
+#define OPCODE_LIST(X) \
+	X(SYS,  SYS_addr)          X(CLS,  CLS)               X(RET,  RET) \
+	X(JP,   JP_addr)           X(CALL, CALL_addr)         X(SE_B, SE_VX_byte) \
+	X(SNE_B, SNE_VX_byte)      X(SE_R, SE_VX_VY)          X(LD_B, LD_VX_byte) \
+	X(ADD_B, ADD_VX_byte)      X(LD_R, LD_VX_VY)          X(OR,   OR_VX_VY) \
+	X(AND,  AND_VX_VY)         X(XOR,  XOR_VX_VY)         X(ADD_R, ADD_VX_VY) \
+	X(SUB,  SUB_VX_VY)         X(SHR,  QUIRK(SHR_VX_VY))  X(SUBN, SUBN_VX_VY) \
+	X(SHL,  QUIRK(SHL_VX_VY))  X(SNE_R, SNE_VX_VY)        X(LD_I, LD_I_addr) \
+	X(JP_V0, QUIRK(JP_V0_addr))  X(RND, RND_VX_byte)      X(DRW,  QUIRK(DRW_VX_VY_nibble)) \
+	X(SKP,  SKP_VX)            X(SKNP, SKNP_VX)           X(LD_DT, LD_VX_DT) \
+	X(LD_K, LD_VX_K)           X(SET_DT, LD_DT_VX)        X(SET_ST, LD_ST_VX) \
+	X(ADD_I, ADD_I_VX)         X(LD_F, LD_F_VX)           X(LD_BCD, LD_B_VX) \
+	X(STORE, QUIRK(LD_I_VX))   X(LOAD, QUIRK(LD_VX_I))    X(TRAP, TRAP) \
+	X(LD_SE, FUSED_LD_SE)      X(LD_JP, FUSED_LD_JP)      X(LD_I_DRW, QUIRK(FUSED_LD_I_DRW)) \
+	X(LD_I_LOAD, QUIRK(FUSED_LD_I_LOAD))  X(ADD_SNE, FUSED_ADD_SNE)  X(ADD_SNE_JP, FUSED_ADD_SNE_JP) \
+	X(JP_IDLE, JP_IDLE_LOOP)   X(DECODE, decode_entry)
+
+/*
+ *  Fused instruction sequences (see fuse_instruction())
+ */
+#define FUSION_LIST(X) \
+	X(LD_SE,       "LD_VX_byte, SE_VX_byte") \
+	X(LD_JP,       "LD_VX_byte, JP_addr") \
+	X(LD_I_DRW,    "LD_I_addr, DRW_VX_VY_nibble") \
+	X(LD_I_LOAD,   "LD_I_addr, LD_VX_I") \
+	X(ADD_SNE,     "ADD_VX_byte, SNE_VX_byte") \
+	X(ADD_SNE_JP,  "ADD_VX_byte, SNE_VX_byte, JP_addr")
+
+#define FUSION_ENUM(name, desc)    FUSION_##name,
+#define FUSION_NAME(name, desc)    desc,
+
+#define OPCODE_ENUM(name, fn)      OP_##name,
+#define OPCODE_HANDLER(name, fn)   [OP_##name] = fn,
+#define OPCODE_NAME(name, fn)      [OP_##name] = STRINGIFY(fn),
+#define STRINGIFY(x)               STRINGIFY_(x)
+#define STRINGIFY_(x)              #x
+
+enum {
+	OPCODE_LIST(OPCODE_ENUM)
+	OP_COUNT
+};
+
+enum {
+	FUSION_LIST(FUSION_ENUM)
+	FUSION_COUNT
+};
+
+/*
+ *  Approximate cost of each instruction on the COSMAC VIP, in machine
+ *  cycles (8 clocks, about 4.5 us), charged when vip_timing is set (see
+ *  run_frame()). DXYN leaves out the interpreter's wait for the display
+ *  interrupt and is charged per sprite row, FX55/FX65 per register. Fused
+ *  handlers charge each instruction of the sequence as it runs.
+ */
+#define VIP_CYCLES_PER_ROW       46
+#define VIP_CYCLES_PER_REGISTER  14
+
+static const uint16_t vip_cycles[OP_COUNT] = {
+	[OP_SYS] = 23,     [OP_CLS] = 24,     [OP_RET] = 23,     [OP_JP] = 23,      [OP_CALL] = 23,
+	[OP_SE_B] = 12,    [OP_SNE_B] = 12,   [OP_SE_R] = 16,    [OP_LD_B] = 6,     [OP_ADD_B] = 10,
+	[OP_LD_R] = 44,    [OP_OR] = 44,      [OP_AND] = 44,     [OP_XOR] = 44,     [OP_ADD_R] = 44,
+	[OP_SUB] = 44,     [OP_SHR] = 44,     [OP_SUBN] = 44,    [OP_SHL] = 44,     [OP_SNE_R] = 16,
+	[OP_LD_I] = 12,    [OP_JP_V0] = 23,   [OP_RND] = 36,     [OP_DRW] = 68,     [OP_SKP] = 16,
+	[OP_SKNP] = 16,    [OP_LD_DT] = 10,   [OP_LD_K] = 10,    [OP_SET_DT] = 10,  [OP_SET_ST] = 10,
+	[OP_ADD_I] = 19,   [OP_LD_F] = 20,    [OP_LD_BCD] = 204, [OP_STORE] = 14,   [OP_LOAD] = 14,
+	[OP_TRAP] = 23
+};
+
+/*
+ *  Values of QUIRK_INDEX: what FX55/FX65 leave in I
+ */
+#define INDEX_UNCHANGED      0
+#define INDEX_PLUS_X         1
+#define INDEX_PLUS_X_PLUS_1  2
+
+#define MAX_IDLE_LOOP        8      // instructions in a loop body idle-loop detection looks at
+#define MAX_IDLE_ITERATION   64     // instructions one iteration of an idle loop may take
+
+static void decode_entry(const Instruction * ins, Chip8 * cpu_reg);
+
+static uint8_t opcode_index[0x10000];
+static int dispatch_ready;
+
+#if defined(__GNUC__) && defined(CHIP8_THREADED)
+#define THREADED_LOOP
+#endif
+
+/*
+ *  One specialized copy of the interpreter (see quirks.h)
+ */
+typedef struct quirk_table {
+	const char * name;
+	const instruction_fn * handlers;   // dispatch table with the profile's quirk handlers
+	const char * const * handler_names;   // names of those handlers (see handler_name())
+	const QuirkSettings * settings;   // the QUIRK_* values the copy was built with
+#ifdef THREADED_LOOP
+	void (*run_cycles)(Chip8 * cpu_reg, uint32_t count);   // threaded loop built from those handlers
+#endif
+} QuirkTable;
+
+static const QuirkTable profiles[QUIRK_PROFILE_COUNT];   // filled in at the end of this file
+
+_Static_assert(MEMORY_SIZE / 64 <= 64, "dirty_lines() has one bit per 64-byte line");
+_Static_assert(FUSION_COUNT <= MAX_FUSIONS, "Chip8's fusion counters are too small");
+
+
+/*
+ *	decode_opcode()
+ *	Inputs: opcode - 16-bit instruction word
+ *	Return Value: Index of the handler which executes the opcode
+ *	Function: Decodes an opcode the slow way; only used to fill the dispatch table
+ */
+static uint8_t decode_opcode(uint16_t opcode) {
+	switch(opcode & 0xF000) {
+	case 0x0000:
+		// check lowest 8-bits
+		switch(opcode & 0x00FF) {
+		case 0x00E0: return OP_CLS;
+		case 0x00EE: return OP_RET;
+		default:     return OP_SYS;
+		}
+	case 0x1000: return OP_JP;
+	case 0x2000: return OP_CALL;
+	case 0x3000: return OP_SE_B;
+	case 0x4000: return OP_SNE_B;
+	case 0x5000: return OP_SE_R;
+	case 0x6000: return OP_LD_B;
+	case 0x7000: return OP_ADD_B;
+	case 0x8000:
+		// check lowest 4-bits
+		switch(opcode & 0x000F) {
+		case 0x0000: return OP_LD_R;
+		case 0x0001: return OP_OR;
+		case 0x0002: return OP_AND;
+		case 0x0003: return OP_XOR;
+		case 0x0004: return OP_ADD_R;
+		case 0x0005: return OP_SUB;
+		case 0x0006: return OP_SHR;
+		case 0x0007: return OP_SUBN;
+		case 0x000E: return OP_SHL;
+		default:     return OP_TRAP;
+		}
+	case 0x9000: return OP_SNE_R;
+	case 0xA000: return OP_LD_I;
+	case 0xB000: return OP_JP_V0;
+	case 0xC000: return OP_RND;
+	case 0xD000: return OP_DRW;
+	case 0xE000:
+		// check lowest 8-bits
+		switch(opcode & 0x00FF) {
+		case 0x009E: return OP_SKP;
+		case 0x00A1: return OP_SKNP;
+		default:     return OP_TRAP;
+		}
+	default:
+		// check lowest 8-bits
+		switch (opcode & 0x00FF) {
+		case 0x0007: return OP_LD_DT;
+		case 0x000A: return OP_LD_K;
+		case 0x0015: return OP_SET_DT;
+		case 0x0018: return OP_SET_ST;
+		case 0x001E: return OP_ADD_I;
+		case 0x0029: return OP_LD_F;
+		case 0x0033: return OP_LD_BCD;
+		case 0x0055: return OP_STORE;
+		case 0x0065: return OP_LOAD;
+		default:     return OP_TRAP;
+		}
+	}
+}
+
+
+/*
+ *	build_dispatch_table()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Fills in the handler index for all 64K opcodes (only done once)
+ */
+static void build_dispatch_table(void) {
+	if (dispatch_ready)
+		return;
+
+	for (uint32_t opcode=0; opcode < 0x10000; ++opcode)
+		opcode_index[opcode] = decode_opcode(opcode);
+
+	dispatch_ready = 1;
+}
+
+
+/*
+ *	retire_instruction()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        ins - Instruction about to execute
+ *	Return Value: None
+ *	Function: Counts one instruction (or fused sequence's first instruction)
+ *	          and charges its VIP cycles. The timers tick per frame instead
+ *	          (see end_frame()).
+ */
+static inline void retire_instruction(Chip8 * cpu_reg, const Instruction * ins) {
+	cpu_reg->instructions_retired++;
+	cpu_reg->cycles += ins->cost;
+}
+
+
+/*
+ *	decode_instruction()
+ *	Inputs: cpu_reg - Machine the instruction is decoded for (picks the quirk profile)
+ *	        opcode - 16-bit instruction word
+ *	        ins - Instruction to fill in
+ *	Return Value: None
+ *	Function: Looks up the handler for an opcode and extracts its operands
+ */
+void decode_instruction(const Chip8 * cpu_reg, uint16_t opcode, Instruction * ins) {
+	ins->op = opcode_index[opcode];
+	ins->fn = cpu_reg->quirks->handlers[ins->op];
+	ins->opcode = opcode;
+	ins->nnn = opcode & 0x0FFF;
+	ins->x = (opcode & 0x0F00) >> 8;
+	ins->y = (opcode & 0x00F0) >> 4;
+	ins->n = opcode & 0x000F;
+	ins->kk = opcode & 0x00FF;
+
+	ins->cost = vip_cycles[ins->op];
+	if (ins->op == OP_DRW)
+		ins->cost += ins->n * VIP_CYCLES_PER_ROW;
+	else if (ins->op == OP_STORE || ins->op == OP_LOAD)
+		ins->cost += (ins->x + 1) * VIP_CYCLES_PER_REGISTER;
+}
+
+
+/*
+ *	handler_name()
+ *	Inputs: profile - Quirk profile
+ *	        opcode - 16-bit instruction word
+ *	Return Value: Name of the function that executes the opcode under the
+ *	              profile, e.g. "SHR_VX_VY_vip"
+ *	Function: For code generators (see aot.c), so they call exactly the
+ *	          handlers decode_instruction() would pick
+ */
+const char * handler_name(QuirkProfile profile, uint16_t opcode) {
+	build_dispatch_table();
+	return profiles[(profile < QUIRK_PROFILE_COUNT) ? profile : QUIRKS_SCHIP].handler_names[opcode_index[opcode]];
+}
+
+
+/*
+ *	block_flags()
+ *	Inputs: opcode - 16-bit instruction word
+ *	Return Value: ENDS_BLOCK and/or STARTS_BLOCK
+ *	Function: Decides where a recompiled basic block has to be split around
+ *	          an instruction. The JIT and chip8aot both use it, so their
+ *	          blocks end in the same places.
+ */
+int block_flags(uint16_t opcode) {
+	switch (opcode & 0xF000) {
+	case 0x0000:
+		return ((opcode & 0x00FF) == 0x00E0) ? 0 : ENDS_BLOCK;   // RET and SYS leave the block
+	case 0x1000: case 0x2000: case 0x3000: case 0x4000:
+	case 0x5000: case 0x9000: case 0xB000: case 0xE000:
+		return ENDS_BLOCK;
+	case 0xF000:
+		switch (opcode & 0x00FF) {
+		case 0x000A:
+			return STARTS_BLOCK | ENDS_BLOCK;   // may leave pc where it is
+		case 0x0033: case 0x0055:
+			return ENDS_BLOCK;   // may overwrite the block itself
+		default:
+			return 0;
+		}
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ *	mix64()
+ *	Inputs: x - Any value
+ *	Return Value: x with every bit mixed into every other (MurmurHash3's finalizer)
+ */
+static inline uint64_t mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+
+/*
+ *	hash_line()
+ *	Inputs: bytes - 64-byte memory line
+ *	        line - Its line number
+ *	Return Value: Hash of the line's contents and position
+ */
+static inline uint64_t hash_line(const uint8_t * bytes, uint32_t line) {
+	uint64_t hash = (line + 1) * 0x9E3779B97F4A7C15ull;
+
+	for (int i=0; i < 8; ++i) {
+		uint64_t word;
+
+		memcpy(&word, bytes + i * 8, 8);
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
+	}
+
+	return mix64(hash);
+}
+
+
+/*
+ *	row_hash()
+ *	Inputs: row - Screen row
+ *	        bits - Its pixels
+ *	Return Value: Hash of the row's contents and position. video_hash is the
+ *	              XOR of row_hash(row, bits) ^ row_hash(row, 0) over all rows,
+ *	              so a blank screen hashes to 0 and changing a row costs two
+ *	              row_hash() calls.
+ */
+static inline uint64_t row_hash(uint32_t row, uint64_t bits) {
+	unsigned __int128 product = (unsigned __int128)(bits ^ ((row + 1) * 0x9E3779B97F4A7C15ull)) * 0xFF51AFD7ED558CCDull;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+
+/*
+ *	invalidate_icache()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        addr - First memory address that was written
+ *	        len - Number of bytes written
+ *	Return Value: None
+ *	Function: Drops the predecoded instructions overlapping the written range
+ */
+void invalidate_icache(Chip8 * cpu_reg, uint32_t addr, uint32_t len) {
+	if (len == 0 || addr >= MEMORY_SIZE)
+		return;
+	if (addr + len > MEMORY_SIZE)
+		len = MEMORY_SIZE - addr;
+
+	// entries up to two instructions back may have fused this range in
+	uint32_t first = (addr >= 4) ? (addr - 4) / 2 : 0;
+
+	for (uint32_t i = first; i <= (addr + len - 1) / 2; ++i) {
+		cpu_reg->icache[i].fn = decode_entry;
+		cpu_reg->icache[i].op = OP_DECODE;
+		cpu_reg->icache[i].cost = 0;   // decode_entry() charges the decoded cost
+	}
+
+	cpu_reg->memory_writes++;
+	for (uint32_t line = addr / 64; line <= (addr + len - 1) / 64; ++line) {
+		uint64_t hash = hash_line(cpu_reg->memory + line * 64, line);
+
+		cpu_reg->line_writes[line] = cpu_reg->memory_writes;
+		cpu_reg->memory_hash ^= cpu_reg->line_hash[line] ^ hash;
+		cpu_reg->line_hash[line] = hash;
+	}
+
+	if (cpu_reg->write_listener)
+		cpu_reg->write_listener(cpu_reg->write_listener_data, addr, len);
+}
+
+
+/*
+ *	state_hash()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: 64-bit hash of everything the machine's future depends on
+ *	              but the keys: memory, screen, registers, the live part of
+ *	              the stack, timers and random number state
+ *	Function: Memory and the screen are hashed incrementally as they change
+ *	          (line_hash, video_hash), so only the ~60 bytes of registers are
+ *	          hashed here. Equal machines always hash the same.
+ */
+uint64_t state_hash(const Chip8 * cpu_reg) {
+	uint64_t words[8] = {0};
+	uint64_t hash = cpu_reg->memory_hash ^ cpu_reg->video_hash;
+
+	memcpy(words, cpu_reg->V, 16);
+	words[2] = cpu_reg->I | ((uint64_t)cpu_reg->pc << 16) | ((uint64_t)cpu_reg->sp << 32);
+	words[3] = cpu_reg->delay_timer | ((uint64_t)cpu_reg->sound_timer << 16) | ((uint64_t)cpu_reg->rand_state << 32);
+	memcpy(&words[4], cpu_reg->stack, (cpu_reg->sp < 16 ? cpu_reg->sp : 16) * sizeof(uint16_t));
+
+	for (int i=0; i < 8; ++i)
+		hash = mix64(hash ^ words[i]) + i;
+
+	return mix64(hash);
+}
+
+
+/*
+ *	rehash_video()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Recomputes video_hash from scratch and marks every row dirty.
+ *	          Call it after writing video_buffer other than through CLS and DXYN.
+ */
+void rehash_video(Chip8 * cpu_reg) {
+	cpu_reg->dirty_rows = ~0u >> (32 - HEIGHT);
+	cpu_reg->video_hash = 0;
+	for (uint32_t row=0; row < HEIGHT; ++row)
+		cpu_reg->video_hash ^= row_hash(row, cpu_reg->video_buffer[row]) ^ row_hash(row, 0);
+}
+
+
+/*
+ *	dirty_lines()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        since - Earlier value of cpu_reg->memory_writes
+ *	Return Value: The 64-byte memory lines written since then (bit n = line n)
+ *	Function: Lets any number of users (snapshot resets, rewind) each find out
+ *	          what changed since they last looked, without clearing anything
+ */
+uint64_t dirty_lines(const Chip8 * cpu_reg, uint64_t since) {
+	uint64_t lines = 0;
+
+	for (uint32_t line=0; line < MEMORY_SIZE / 64; ++line)
+		lines |= (uint64_t)(cpu_reg->line_writes[line] > since) << line;
+
+	return lines;
+}
+
+
+/*
+ *	set_memory_write_listener()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        listener - Function to call whenever memory is written (or NULL)
+ *	        data - Passed back to the listener
+ *	Return Value: None
+ *	Function: Lets other code caches (e.g. the JIT) drop stale translations
+ */
+void set_memory_write_listener(Chip8 * cpu_reg, memory_write_listener listener, void * data) {
+	cpu_reg->write_listener = listener;
+	cpu_reg->write_listener_data = data;
+}
+
+
+/*
+ *	set_coverage_map()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        map - COVERAGE_SIZE hit counters, or NULL to stop recording
+ *	Return Value: None
+ *	Function: Has fde_cycle() count every (previous pc, pc) edge it takes in
+ *	          map, AFL style. The threaded loop, the JIT and AOT code don't.
+ */
+void set_coverage_map(Chip8 * cpu_reg, uint8_t * map) {
+	cpu_reg->coverage = map;
+	cpu_reg->coverage_prev = 0;
+}
+
+
+/*
+ *	seed_random()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        seed - Any value; equal seeds give equal RND sequences
+ *	Return Value: None
+ *	Function: Seeds the machine's own random number generator. The seed is
+ *	          mixed first, so nearby seeds don't give similar sequences and
+ *	          0 (which xorshift can't leave) still works.
+ */
+void seed_random(Chip8 * cpu_reg, uint32_t seed) {
+	seed ^= seed >> 16;
+	seed *= 0x85EBCA6Bu;
+	seed ^= seed >> 13;
+	seed *= 0xC2B2AE35u;
+	seed ^= seed >> 16;
+
+	cpu_reg->rand_state = seed ? seed : 0x9E3779B9u;
+}
+
+
+/*
+ *	next_random()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: Next xorshift32 number; the high bits are the good ones
+ */
+static inline uint32_t next_random(Chip8 * cpu_reg) {
+	uint32_t x = cpu_reg->rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	cpu_reg->rand_state = x;
+	return x;
+}
+
+
+/*
+ *	record_edge()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Counts the edge from the previous instruction to the one at pc
+ */
+static inline void record_edge(Chip8 * cpu_reg) {
+	uint16_t cur = (cpu_reg->pc >> 1) & (MEMORY_SIZE / 2 - 1);
+
+	cpu_reg->coverage[((cpu_reg->coverage_prev << 5) ^ cur) & (COVERAGE_SIZE - 1)]++;
+	cpu_reg->coverage_prev = cur;
+}
+
+
+/*
+ *	fault()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        kind - Chip8Fault
+ *	Return Value: None
+ *	Function: Counts an out-of-range access, remembering the first one. Must
+ *	          be called before the instruction changes pc.
+ */
+static void fault(Chip8 * cpu_reg, Chip8Fault kind) {
+	if (cpu_reg->faults++ == 0) {
+		cpu_reg->first_fault = kind;
+		cpu_reg->first_fault_pc = cpu_reg->pc;
+	}
+}
+
+
+const char * fault_name(Chip8Fault fault) {
+	static const char * const names[FAULT_COUNT] = {
+		"none", "memory-read", "memory-write", "stack-overflow", "stack-underflow", "bad-key"
+	};
+
+	return (fault < FAULT_COUNT) ? names[fault] : "unknown";
+}
+
+
+/*
+ *	retire_instructions()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        count - Number of instructions executed outside of fde_cycle()
+ *	Return Value: None
+ *	Function: Counts a run of instructions (their VIP cycles aren't charged)
+ */
+void retire_instructions(Chip8 * cpu_reg, uint32_t count) {
+	cpu_reg->instructions_retired += count;
+}
+
+
+/*
+ *	fetch_instruction()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        scratch - Storage for instructions that can't be cached
+ *	Return Value: Decoded instruction at pc
+ *	Function: Returns the icache entry for pc. Odd addresses aren't cached,
+ *	          so they are decoded into scratch every time.
+ */
+static inline const Instruction * fetch_instruction(Chip8 * cpu_reg, Instruction * scratch) {
+	uint16_t pc = cpu_reg->pc;
+
+	if (!(pc & 1) && pc < MEMORY_SIZE)
+		return &cpu_reg->icache[pc >> 1];
+
+	pc &= MEMORY_SIZE - 1;
+	decode_instruction(cpu_reg, (cpu_reg->memory[pc] << 8) | cpu_reg->memory[(pc+1) & (MEMORY_SIZE - 1)], scratch);
+	return scratch;
+}
+
+
+/*
+ *	peek_op()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        entry - icache entry
+ *	        ahead - How many instructions past entry to look
+ *	Return Value: Handler index of that instruction (OP_DECODE past the end of memory)
+ *	Function: Looks at a following instruction without touching its entry
+ */
+static uint8_t peek_op(const Chip8 * cpu_reg, const Instruction * entry, uint32_t ahead) {
+	uint32_t addr = (entry - cpu_reg->icache + ahead) * 2;
+
+	if (addr >= MEMORY_SIZE)
+		return OP_DECODE;
+
+	return opcode_index[(cpu_reg->memory[addr] << 8) | cpu_reg->memory[addr+1]];
+}
+
+
+/*
+ *	decode_following()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        entry - icache entry
+ *	        count - Number of following entries the fused handler reads
+ *	Return Value: None
+ *	Function: Makes sure the operands of the following instructions are
+ *	          available to a fused handler
+ */
+static void decode_following(Chip8 * cpu_reg, Instruction * entry, uint32_t count) {
+	for (uint32_t i=1; i <= count; ++i) {
+		if (entry[i].op == OP_DECODE) {
+			uint32_t addr = (entry - cpu_reg->icache + i) * 2;
+			decode_instruction(cpu_reg, (cpu_reg->memory[addr] << 8) | cpu_reg->memory[addr+1], &entry[i]);
+		}
+	}
+}
+
+
+/*
+ *	polling_loop()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        entry - icache entry of a 1NNN
+ *	Return Value: 1 if the jump closes a short loop that polls the delay
+ *	              timer or keys, or jumps to itself; 0 otherwise
+ *	Function: Picks the jumps JP_IDLE_LOOP() watches. The loop body may
+ *	          only read the timers, keys and memory and change V and I.
+ */
+static int polling_loop(const Chip8 * cpu_reg, const Instruction * entry) {
+	uint32_t addr = (entry - cpu_reg->icache) * 2;
+	uint32_t target = entry->nnn;
+	int polls = 0;
+
+	if (target > addr || addr - target > 2 * MAX_IDLE_LOOP)
+		return 0;
+	if (target == addr)
+		return 1;
+
+	for (uint32_t a = target; a < addr; a += 2) {
+		switch (opcode_index[(cpu_reg->memory[a] << 8) | cpu_reg->memory[a+1]]) {
+		case OP_LD_DT: case OP_SKP: case OP_SKNP:
+			polls++;
+			break;
+		case OP_SE_B: case OP_SNE_B: case OP_SE_R: case OP_SNE_R:
+		case OP_LD_B: case OP_ADD_B: case OP_LD_R: case OP_OR: case OP_AND:
+		case OP_XOR: case OP_ADD_R: case OP_SUB: case OP_SHR: case OP_SUBN:
+		case OP_SHL: case OP_LD_I: case OP_ADD_I: case OP_LOAD:
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return polls > 0;
+}
+
+
+/*
+ *	fuse_instruction()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        entry - Freshly decoded icache entry
+ *	Return Value: None
+ *	Function: Replaces the entry's handler with a fused one when it starts
+ *	          one of the common two/three instruction idioms. Fused handlers
+ *	          only read operands from the following entries, so those can
+ *	          still be executed on their own. Jumps closing polling loops get
+ *	          JP_IDLE_LOOP().
+ */
+static void fuse_instruction(Chip8 * cpu_reg, Instruction * entry) {
+	uint8_t second = peek_op(cpu_reg, entry, 1);
+	uint8_t fused = OP_DECODE;
+	uint32_t length = 2;
+
+	switch (entry->op) {
+	case OP_LD_B:
+		if (second == OP_SE_B)
+			fused = OP_LD_SE;
+		else if (second == OP_JP)
+			fused = OP_LD_JP;
+		break;
+	case OP_LD_I:
+		if (second == OP_DRW)
+			fused = OP_LD_I_DRW;
+		else if (second == OP_LOAD)
+			fused = OP_LD_I_LOAD;
+		break;
+	case OP_ADD_B:
+		if (second == OP_SNE_B) {
+			fused = OP_ADD_SNE;
+			if (peek_op(cpu_reg, entry, 2) == OP_JP) {
+				fused = OP_ADD_SNE_JP;
+				length = 3;
+			}
+		}
+		break;
+	case OP_JP:
+		if (polling_loop(cpu_reg, entry)) {
+			entry->op = OP_JP_IDLE;
+			entry->fn = cpu_reg->quirks->handlers[OP_JP_IDLE];
+		}
+		break;
+	}
+
+	if (fused != OP_DECODE) {
+		decode_following(cpu_reg, entry, length - 1);
+		entry->op = fused;
+		entry->fn = cpu_reg->quirks->handlers[fused];
+	}
+}
+
+
+/*
+ *	print_fusion_stats()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        out - Stream to print to
+ *	Return Value: None
+ *	Function: Prints how often each fused sequence ran since initialize_cpu()
+ *	          and how many dispatches that saved
+ */
+void print_fusion_stats(const Chip8 * cpu_reg, FILE * out) {
+	static const char * const names[FUSION_COUNT] = {
+		FUSION_LIST(FUSION_NAME)
+	};
+	uint64_t saved = 0;
+
+	fprintf(out, "%-40s %12s %12s\n", "fused sequence", "executions", "instructions");
+	for (int i=0; i < FUSION_COUNT; ++i) {
+		fprintf(out, "%-40s %12llu %12llu\n", names[i],
+		        (unsigned long long)cpu_reg->fusion_executions[i], (unsigned long long)cpu_reg->fusion_instructions[i]);
+		saved += cpu_reg->fusion_instructions[i] - cpu_reg->fusion_executions[i];
+	}
+	fprintf(out, "dispatches saved: %llu\n", (unsigned long long)saved);
+}
+
+
+/*
+ *	unpack_video()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        pixels - WIDTH * HEIGHT bytes, row by row
+ *	Return Value: None
+ *	Function: Converts the screen to one byte per pixel (1 = on) for code
+ *	          that wants that layout
+ */
+void unpack_video(const Chip8 * cpu_reg, uint8_t * pixels) {
+	for (int row=0; row < HEIGHT; ++row) {
+		uint64_t bits = cpu_reg->video_buffer[row];
+
+		for (int col=0; col < WIDTH; ++col)
+			pixels[col + row * WIDTH] = (bits >> (WIDTH - 1 - col)) & 1;
+	}
+}
+
+
+/*
+ *	pack_video()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        pixels - WIDTH * HEIGHT bytes, row by row; nonzero = on
+ *	Return Value: None
+ *	Function: The reverse of unpack_video()
+ */
+void pack_video(Chip8 * cpu_reg, const uint8_t * pixels) {
+	for (int row=0; row < HEIGHT; ++row) {
+		uint64_t bits = 0;
+
+		for (int col=0; col < WIDTH; ++col)
+			bits = (bits << 1) | (pixels[col + row * WIDTH] != 0);
+		cpu_reg->video_buffer[row] = bits;
+	}
+
+	rehash_video(cpu_reg);
+}
+
+
+/*
+ *	decode_entry()
+ *	Inputs: ins - icache entry that hasn't been decoded yet
+ *	        cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Decodes the opcode at the entry's address into the icache, then
+ *	          executes it
+ */
+static void decode_entry(const Instruction * ins, Chip8 * cpu_reg) {
+	Instruction * entry = &cpu_reg->icache[ins - cpu_reg->icache];
+	uint32_t addr = (ins - cpu_reg->icache) * 2;
+
+	decode_instruction(cpu_reg, (cpu_reg->memory[addr] << 8) | cpu_reg->memory[addr+1], entry);
+	fuse_instruction(cpu_reg, entry);
+	cpu_reg->cycles += entry->cost;
+	entry->fn(entry, cpu_reg);
+}
+
+
+/*
+ *	fde_cycle()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Reads in the opcode, decodes it, and then executes it
+ */
+void fde_cycle(Chip8 * cpu_reg) {
+	Instruction scratch;
+
+	// Fetch the predecoded instruction
+	const Instruction * ins = fetch_instruction(cpu_reg, &scratch);
+	
+	// debugger(cpu_reg, ins->opcode);
+
+	if (cpu_reg->coverage != NULL)
+		record_edge(cpu_reg);
+
+	// Count it before it runs: it may overwrite its own icache entry
+	retire_instruction(cpu_reg, ins);
+
+	// Execute it by calling its function
+	ins->fn(ins, cpu_reg);
+}
+
+
+/*
+ *	step_instruction()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Executes exactly one instruction, bypassing the icache (and so
+ *	          instruction fusion). Used where instructions have to be counted
+ *	          one by one, e.g. to check other execution engines.
+ */
+void step_instruction(Chip8 * cpu_reg) {
+	Instruction ins;
+	uint16_t pc = cpu_reg->pc & (MEMORY_SIZE - 1);
+
+	decode_instruction(cpu_reg, (cpu_reg->memory[pc] << 8) | cpu_reg->memory[(pc+1) & (MEMORY_SIZE - 1)], &ins);
+	retire_instruction(cpu_reg, &ins);
+	ins.fn(&ins, cpu_reg);
+}
+
+
+/*
+ *	run_cycles()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        count - Number of instructions to execute
+ *	Return Value: None
+ *	Function: Runs exactly count instructions. Threaded builds use the current profile's
+ *	          copy of the threaded loop (see quirks.h) unless a coverage map
+ *	          is set; otherwise it's fde_cycle() in a loop.
+ */
+void run_cycles(Chip8 * cpu_reg, uint32_t count) {
+	uint64_t end = cpu_reg->instructions_retired + count;
+
+	cpu_reg->run_end = end;
+	cpu_reg->run_cycle_end = UINT64_MAX;
+	cpu_reg->idle.instructions_retired = 0;
+
+#ifdef THREADED_LOOP
+	if (cpu_reg->coverage == NULL)
+		cpu_reg->quirks->run_cycles(cpu_reg, count);
+	else
+#endif
+	while (cpu_reg->instructions_retired < end)
+		fde_cycle(cpu_reg);
+
+	cpu_reg->run_end = cpu_reg->run_cycle_end = 0;
+}
+
+
+/*
+ *	set_frame_budget()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        budget - Work per 60 Hz frame: instructions, or VIP machine cycles
+ *	                 if vip_timing is set (0 = DEFAULT_FRAME_BUDGET instructions)
+ *	        vip_timing - Nonzero to charge instructions their COSMAC VIP cost
+ *	Return Value: None
+ *	Function: Configures run_frame()
+ */
+void set_frame_budget(Chip8 * cpu_reg, uint32_t budget, int vip_timing) {
+	cpu_reg->vip_timing = (vip_timing && budget > 0);
+	cpu_reg->frame_budget = (budget > 0) ? budget : DEFAULT_FRAME_BUDGET;
+	cpu_reg->frame_overrun = 0;
+}
+
+
+/*
+ *	end_frame()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Ticks the delay and sound timers, once per 60 Hz frame. A
+ *	          sound timer of N keeps the buzzer on for N frames.
+ */
+void end_frame(Chip8 * cpu_reg) {
+	if (cpu_reg->delay_timer > 0)
+		cpu_reg->delay_timer--;
+	if (cpu_reg->sound_timer > 0) {
+		cpu_reg->sound_timer--;
+		cpu_reg->sound_frames++;
+	}
+
+	cpu_reg->frames++;
+}
+
+
+/*
+ *	waiting_for_key()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: 1 if the machine is halted in FX0A with no key down;
+ *	              0 otherwise
+ *	Function: FX0A sets waiting_for_key when it finds no key down. The
+ *	          machine stays halted until a key is pressed (or something else
+ *	          moves pc), which clears it again.
+ */
+int waiting_for_key(Chip8 * cpu_reg) {
+	uint16_t pc = cpu_reg->pc & (MEMORY_SIZE - 1);
+
+	if (!cpu_reg->waiting_for_key)
+		return 0;
+
+	if ((cpu_reg->memory[pc] & 0xF0) == 0xF0 && cpu_reg->memory[(pc+1) & (MEMORY_SIZE - 1)] == 0x0A) {
+		int i;
+
+		for (i=0; i < 16 && cpu_reg->keys[i] != 1; ++i)
+			;
+		if (i == 16)
+			return 1;
+	}
+
+	cpu_reg->waiting_for_key = 0;
+	return 0;
+}
+
+
+/*
+ *	skip_frame()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Accounts for a frame of a machine waiting for a key without
+ *	          running it: retires and charges exactly what re-executing FX0A
+ *	          for the whole frame would have
+ */
+static void skip_frame(Chip8 * cpu_reg) {
+	if (!cpu_reg->vip_timing) {
+		retire_instructions(cpu_reg, cpu_reg->frame_budget);
+		cpu_reg->cycles += (uint64_t)cpu_reg->frame_budget * vip_cycles[OP_LD_K];
+	} else if (cpu_reg->frame_overrun >= cpu_reg->frame_budget) {
+		cpu_reg->frame_overrun -= cpu_reg->frame_budget;
+	} else {
+		uint32_t remaining = cpu_reg->frame_budget - cpu_reg->frame_overrun;
+		uint32_t count = (remaining + vip_cycles[OP_LD_K] - 1) / vip_cycles[OP_LD_K];
+
+		retire_instructions(cpu_reg, count);
+		cpu_reg->cycles += count * vip_cycles[OP_LD_K];
+		cpu_reg->frame_overrun = count * vip_cycles[OP_LD_K] - remaining;
+	}
+}
+
+
+/*
+ *	run_frame()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Runs one 60 Hz frame: frame_budget instructions, or with
+ *	          vip_timing instructions until frame_budget machine cycles have
+ *	          been charged, then ticks the timers. Cycles an instruction runs
+ *	          past the end of a frame come out of the next one's budget, so
+ *	          the long-run rate is exact. A machine waiting for a key only
+ *	          has its timers ticked (see waiting_for_key()).
+ */
+void run_frame(Chip8 * cpu_reg) {
+	if (waiting_for_key(cpu_reg)) {
+		skip_frame(cpu_reg);
+	} else if (!cpu_reg->vip_timing) {
+		run_cycles(cpu_reg, cpu_reg->frame_budget);
+	} else if (cpu_reg->frame_overrun >= cpu_reg->frame_budget) {
+		cpu_reg->frame_overrun -= cpu_reg->frame_budget;
+	} else {
+		uint64_t end = cpu_reg->cycles + cpu_reg->frame_budget - cpu_reg->frame_overrun;
+
+		cpu_reg->run_end = UINT64_MAX;
+		cpu_reg->run_cycle_end = end;
+		cpu_reg->idle.instructions_retired = 0;
+		while (cpu_reg->cycles < end)
+			fde_cycle(cpu_reg);
+		cpu_reg->run_end = cpu_reg->run_cycle_end = 0;
+		cpu_reg->frame_overrun = cpu_reg->cycles - end;
+	}
+
+	end_frame(cpu_reg);
+}
+
+
+/*
+ *	set_quirk_profile()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        profile - Quirk profile the loaded ROM expects
+ *	Return Value: None
+ *	Function: Switches decoding and run_cycles() over to the profile's copy
+ *	          of the interpreter. Meant to be called once per ROM when it is
+ *	          loaded; the icache is flushed so nothing decoded for the old
+ *	          profile runs again. initialize_cpu() selects QUIRKS_SCHIP,
+ *	          whose BXNN jumps to XNN + VX (before profiles, BNNN always
+ *	          added V0).
+ */
+void set_quirk_profile(Chip8 * cpu_reg, QuirkProfile profile) {
+	if (profile >= QUIRK_PROFILE_COUNT)
+		return;
+
+	cpu_reg->quirks = &profiles[profile];
+	invalidate_icache(cpu_reg, 0, MEMORY_SIZE);
+}
+
+
+/*
+ *	get_quirk_profile()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: The quirk profile instructions are decoded for
+ *	Function: See set_quirk_profile()
+ */
+QuirkProfile get_quirk_profile(const Chip8 * cpu_reg) {
+	return cpu_reg->quirks - profiles;
+}
 
 
 /*
- *  Hexadecimal sprite fonts (16 total digits, each 5 bytes long)
+ *	quirk_profile_name()
+ *	Inputs: profile - Quirk profile
+ *	Return Value: Short name of the profile ("vip", "chip48", "schip", "modern")
+ *	Function: Name used on the command line and in chip8aot output
  */
-static uint8_t fonts[80] = {
-	0xF0,0x90,0x90,0x90,0xF0,  // '0'
-	0x20,0x60,0x20,0x20,0x70,  // '1'
-	0xF0,0x10,0xF0,0x80,0xF0,  // '2'
-	0xF0,0x10,0xF0,0x10,0xF0,  // '3'
-	0x90,0x90,0xF0,0x10,0x10,  // '4'
-	0xF0,0x10,0x20,0x40,0x40,  // '5'
-	0xF0,0x80,0xF0,0x90,0xF0,  // '6'
-	0xF0,0x10,0x20,0x40,0x40,  // '7'
-	0xF0,0x90,0xF0,0x90,0xF0,  // '8'
-	0xF0,0x90,0xE0,0x90,0xE0,  // '9'
-	0xF0,0x90,0xF0,0x90,0x90,  // 'A'
-	0xE0,0x90,0xE0,0x90,0xE0,  // 'B'
-	0xF0,0x80,0x80,0x80,0xF0,  // 'C'
-	0xE0,0x90,0x90,0x90,0xE0,  // 'D'
-	0xF0,0x80,0xF0,0x80,0xF0,  // 'E'
-	0xF0,0x80,0xF0,0x80,0xF0   // 'F'
-};
+const char * quirk_profile_name(QuirkProfile profile) {
+	return (profile < QUIRK_PROFILE_COUNT) ? profiles[profile].name : "unknown";
+}
 
 
 /*
- *	fde_cycle()
- *	Inputs: cpu_reg - Pointer to CPU register struct
- *	Return Value: None
- *	Function: Reads in the opcode, decodes it, and then executes it
+ *	get_quirk_settings()
+ *	Inputs: profile - Quirk profile
+ *	Return Value: The quirk settings the profile's interpreter was built with
+ *	Function: For engines that implement instructions themselves (e.g. lockstep.c)
  */
-void fde_cycle(Chip8 * cpu_reg) {
-	// Fetch
-	uint16_t opcode = (memory[cpu_reg->pc] << 8) | memory[cpu_reg->pc+1];  // read 2 consecutive bytes
-	
-	// debugger(cpu_reg, opcode);
-	
-	// Decode the opcode and execute it by calling its function
-	switch(opcode & 0xF000) {
-	case 0x0000:
-		// check lowest 8-bits
-		switch(opcode & 0x00FF) {
-		case 0x00E0:
-			CLS(opcode, cpu_reg);
-			break;
-		case 0x00EE:
-			RET(opcode, cpu_reg);
-			break;
-		default:
-			JP_addr(opcode, cpu_reg);
-			break;
-		}
-		break;
-	case 0x1000:
-		JP_addr(opcode, cpu_reg);
-		break;
-	case 0x2000:
-		CALL_addr(opcode, cpu_reg);
-		break;
-	case 0x3000:
-		SE_VX_byte(opcode, cpu_reg);
-		break;
-	case 0x4000:
-		SNE_VX_byte(opcode, cpu_reg);
-		break;
-	case 0x5000:
-		SE_VX_VY(opcode, cpu_reg);
-		break;
-	case 0x6000:
-		LD_VX_byte(opcode, cpu_reg);
-		break;
-	case 0x7000:
-		ADD_VX_byte(opcode, cpu_reg);
-		break;
-	case 0x8000:
-		// check lowest 4-bits
-		switch(opcode & 0x000F) {
-		case 0x0000:
-			LD_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0001:
-			OR_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0002:
-			AND_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0003:
-			XOR_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0004:
-			ADD_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0005:
-			SUB_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0006:
-			SHR_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x0007:
-			SUBN_VX_VY(opcode, cpu_reg);
-			break;
-		case 0x000E:
-			SHL_VX_VY(opcode, cpu_reg);
-			break;
-		default:
-			printf("Unknown opcode\n");
-			break;
-		}
-		break;
-	case 0x9000:
-		SNE_VX_VY(opcode, cpu_reg);
-		break;
-	case 0xA000:
-		LD_I_addr(opcode, cpu_reg);
-		break;
-	case 0xB000:
-		JP_V0_addr(opcode, cpu_reg);
-		break;
-	case 0xC000:
-		RND_VX_byte(opcode, cpu_reg);
-		break;
-	case 0xD000:
-		DRW_VX_VY_nibble(opcode, cpu_reg);
-		break;
-	case 0xE000:
-		// check lowest 8-bits
-		switch(opcode & 0x00FF) {
-		case 0x009E:
-			SKP_VX(opcode, cpu_reg);
-			break;
-		case 0x00A1:
-			SKNP_VX(opcode, cpu_reg);
-			break;
-		default:
-			printf("Unknown opcode\n");
-			break;
-		}
-		break;
-	case 0xF000:
-		// check lowest 8-bits
-		switch (opcode & 0x00FF) {
-		case 0x0007:
-			LD_VX_DT(opcode, cpu_reg);
-			break;
-		case 0x000A:
-			LD_VX_K(opcode, cpu_reg);
-			break;
-		case 0x0015:
-			LD_DT_VX(opcode, cpu_reg);
-			break;
-		case 0x0018:
-			LD_ST_VX(opcode, cpu_reg);
-			break;
-		case 0x001E:
-			ADD_I_VX(opcode, cpu_reg);
-			break;
-		case 0x0029:
-			LD_F_VX(opcode, cpu_reg);
-			break;
-		case 0x0033:
-			LD_B_VX(opcode, cpu_reg);
-			break;
-		case 0x0055:
-			LD_I_VX(opcode, cpu_reg);
-			break;
-		case 0x0065:
-			LD_VX_I(opcode, cpu_reg);
-			break;
-		default:
-			printf("Unknown opcode\n");
-			break;
-		}
-		break;
-	default:
-		printf("Unknown opcode\n");
-		break;
-	}
+const QuirkSettings * get_quirk_settings(QuirkProfile profile) {
+	return profiles[(profile < QUIRK_PROFILE_COUNT) ? profile : QUIRKS_SCHIP].settings;
+}
+
 
-	// Decrement the timers
-	if (delay_timer > 0)
-		delay_timer--;
-	if (sound_timer > 0) {
-		// Make beeping sound
-		sound_timer--;
+/*
+ *	find_quirk_profile()
+ *	Inputs: name - Short name of a profile
+ *	Return Value: Returns the profile; returns -1 if no profile has that name
+ *	Function: Inverse of quirk_profile_name()
+ */
+int find_quirk_profile(const char * name) {
+	for (int i=0; i < QUIRK_PROFILE_COUNT; ++i) {
+		if (strcmp(name, profiles[i].name) == 0)
+			return i;
 	}
+
+	return -1;
+}
+
+
+/*
+ *	reset_counters()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: None
+ *	Function: Clears the instruction, cycle and frame counts, the faults and
+ *	          the scheduler's state, as initialize_cpu() does. Call it after
+ *	          restore_cpu_state() or reset_cpu_state() to start a run afresh.
+ */
+void reset_counters(Chip8 * cpu_reg) {
+	cpu_reg->unknown_opcodes = 0;
+	cpu_reg->faults = 0;
+	cpu_reg->first_fault = FAULT_NONE;
+	cpu_reg->first_fault_pc = 0;
+	cpu_reg->instructions_retired = 0;
+	cpu_reg->cycles = 0;
+	cpu_reg->frames = 0;
+	cpu_reg->sound_frames = 0;
+	cpu_reg->frame_overrun = 0;
+	cpu_reg->waiting_for_key = 0;
+	cpu_reg->idle.instructions_retired = 0;
+	cpu_reg->idle_instructions = 0;
+	memset(cpu_reg->fusion_executions, 0, sizeof(cpu_reg->fusion_executions));
+	memset(cpu_reg->fusion_instructions, 0, sizeof(cpu_reg->fusion_instructions));
 }
 
 
@@ -197,29 +1094,166 @@ void fde_cycle(Chip8 * cpu_reg) {
  *	initialize_cpu()
  *	Inputs: cpu_reg - Pointer to CPU register struct
  *	Return Value: None
- *	Function: Initializes all of the CPU register values
+ *	Function: Initializes all of the CPU register values. The quirk profile,
+ *	          frame budget, memory write listener and random number state are
+ *	          kept, so a Chip8
+ *	          must start out zeroed (static, calloc() or = {0}) before the
+ *	          first call.
  */
 void initialize_cpu(Chip8 * cpu_reg) {
+	if (cpu_reg->quirks == NULL)
+		cpu_reg->quirks = &profiles[QUIRKS_SCHIP];
+
 	cpu_reg->pc = PROGRAM_START;
 	cpu_reg->sp = 0;
 	cpu_reg->I = 0;
 
-	sound_timer = 0;
-	delay_timer = 0;
+	cpu_reg->sound_timer = 0;
+	cpu_reg->delay_timer = 0;
 
 	// initialize all memory/registers to 0
 	memset(cpu_reg->V, 0, sizeof(cpu_reg->V));
-	memset(stack, 0, sizeof(stack));
-	memset(video_buffer, 0, sizeof(video_buffer));
-	memset(memory, 0, sizeof(memory));
+	memset(cpu_reg->stack, 0, sizeof(cpu_reg->stack));
+	memset(cpu_reg->video_buffer, 0, sizeof(cpu_reg->video_buffer));
+	memset(cpu_reg->memory, 0, sizeof(cpu_reg->memory));
+	memset(cpu_reg->keys, 0, sizeof(cpu_reg->keys));
+	cpu_reg->video_hash = 0;
+	cpu_reg->dirty_rows = ~0u >> (32 - HEIGHT);
 
 	// load sprite fonts into memory
 	for (int i=0; i<80; ++i) {
-		memory[i] = fonts[i];
+		cpu_reg->memory[i] = fonts[i];
+	}
+
+	build_dispatch_table();
+	invalidate_icache(cpu_reg, 0, MEMORY_SIZE);
+	reset_counters(cpu_reg);
+	if (cpu_reg->frame_budget == 0)
+		cpu_reg->frame_budget = DEFAULT_FRAME_BUDGET;
+}
+
+
+/*
+ *	load_program()
+ *	Inputs: cpu_reg - Machine to load the ROM into
+ *	        filename - Name of the ROM file to be loaded
+ *	Return Value: Returns the size of the ROM if it was read into RAM
+ *	              successfully; returns -1 on failure
+ *	Function: Attempts to open the given filename and load it into RAM at
+ *	          PROGRAM_START. ROMs that don't fit in RAM are rejected.
+ */
+int load_program(Chip8 * cpu_reg, const char *filename) {
+	const size_t max_size = MEMORY_SIZE - PROGRAM_START;
+	FILE * f = fopen(filename, "rb");
+
+	if (f == NULL)
+		return -1;
+
+	size_t file_size = fread(cpu_reg->memory + PROGRAM_START, 1, max_size, f);
+	int too_big = (file_size == max_size && fgetc(f) != EOF);
+	fclose(f);
+
+	if (file_size == 0 || too_big)
+		return -1;
+
+	// drop any instructions predecoded from the old contents
+	invalidate_icache(cpu_reg, PROGRAM_START, file_size);
+	return file_size;
+}
+
+
+/*
+ *	save_cpu_state()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        state - Where to copy the machine state
+ *	Return Value: None
+ *	Function: Takes a snapshot of the registers, stack, timers, memory,
+ *	          video buffer, keys and random number state
+ */
+void save_cpu_state(const Chip8 * cpu_reg, CpuState * state) {
+	memcpy(state->V, cpu_reg->V, sizeof(cpu_reg->V));
+	state->I = cpu_reg->I;
+	state->pc = cpu_reg->pc;
+	state->sp = cpu_reg->sp;
+	memcpy(state->stack, cpu_reg->stack, sizeof(cpu_reg->stack));
+	state->delay_timer = cpu_reg->delay_timer;
+	state->sound_timer = cpu_reg->sound_timer;
+	memcpy(state->memory, cpu_reg->memory, sizeof(cpu_reg->memory));
+	memcpy(state->video_buffer, cpu_reg->video_buffer, sizeof(cpu_reg->video_buffer));
+	memcpy(state->keys, cpu_reg->keys, sizeof(cpu_reg->keys));
+	state->rand_state = cpu_reg->rand_state;
+}
+
+
+/*
+ *	restore_registers()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        state - Snapshot taken by save_cpu_state()
+ *	Return Value: None
+ *	Function: Restores everything in the snapshot but memory
+ */
+static void restore_registers(Chip8 * cpu_reg, const CpuState * state) {
+	memcpy(cpu_reg->V, state->V, sizeof(cpu_reg->V));
+	cpu_reg->I = state->I;
+	cpu_reg->pc = state->pc;
+	cpu_reg->sp = state->sp;
+	memcpy(cpu_reg->stack, state->stack, sizeof(cpu_reg->stack));
+	cpu_reg->delay_timer = state->delay_timer;
+	cpu_reg->sound_timer = state->sound_timer;
+	memcpy(cpu_reg->video_buffer, state->video_buffer, sizeof(cpu_reg->video_buffer));
+	memcpy(cpu_reg->keys, state->keys, sizeof(cpu_reg->keys));
+	cpu_reg->rand_state = state->rand_state;
+	rehash_video(cpu_reg);
+}
+
+
+/*
+ *	restore_cpu_state()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        state - Snapshot taken by save_cpu_state()
+ *	Return Value: None
+ *	Function: Puts the machine back into the snapshot's state. Only the
+ *	          64-byte memory lines that differ are copied and invalidated.
+ */
+void restore_cpu_state(Chip8 * cpu_reg, const CpuState * state) {
+	restore_registers(cpu_reg, state);
+
+	for (uint32_t addr=0; addr < MEMORY_SIZE; addr += 64) {
+		if (memcmp(cpu_reg->memory + addr, state->memory + addr, 64) != 0) {
+			memcpy(cpu_reg->memory + addr, state->memory + addr, 64);
+			invalidate_icache(cpu_reg, addr, 64);
+		}
+	}
+
+	cpu_reg->restored_at = cpu_reg->memory_writes;
+}
+
+
+/*
+ *	reset_cpu_state()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        state - Snapshot the machine was last restored to
+ *	Return Value: None
+ *	Function: Cheap restore_cpu_state() for going back to the same snapshot
+ *	          over and over (fuzzing, episode resets): only the memory lines
+ *	          written since that restore are copied back.
+ */
+void reset_cpu_state(Chip8 * cpu_reg, const CpuState * state) {
+	restore_registers(cpu_reg, state);
+
+	for (uint64_t lines = dirty_lines(cpu_reg, cpu_reg->restored_at); lines; lines &= lines - 1) {
+		uint32_t addr = __builtin_ctzll(lines) * 64;
+
+		memcpy(cpu_reg->memory + addr, state->memory + addr, 64);
+		invalidate_icache(cpu_reg, addr, 64);
 	}
+
+	cpu_reg->restored_at = cpu_reg->memory_writes;
 }
 
 
+
+
 void debugger(Chip8* cpu_reg, uint16_t opcode) {
 	printf("opcode = %02X\n", opcode);
 	printf("V[0] = %d\n", cpu_reg->V[0]);
@@ -252,23 +1286,36 @@ void debugger(Chip8* cpu_reg, uint16_t opcode) {
 /****************************************************************/
 /*************          Chip-8 Intructions          *************/
 /****************************************************************/
-/* Note: All instructions take an opcode and a pointer to a CPU 
-         register struct as their arguments */
+/* Note: All instructions take a decoded instruction and a pointer to a
+         CPU register struct as their arguments */
+
+/*
+ *  Unknown opcode - Count it and skip over it
+ */
+void TRAP(const Instruction * ins, Chip8 * cpu_reg) {
+	cpu_reg->unknown_opcodes++;
+	cpu_reg->pc += 2;
+}
+
 
 /*
  *  0x0NNN - Jump to a machine code routine at NNN
  */
-void SYS_addr(uint16_t opcode, Chip8 * cpu_reg) {
-	cpu_reg->pc = 0x0FFF & opcode;
+void SYS_addr(const Instruction * ins, Chip8 * cpu_reg) {
+	cpu_reg->pc = ins->nnn;
 }
 
 
 /*
  *  0x00E0 - Clear the display
  */
-void CLS(uint16_t opcode, Chip8 * cpu_reg) {
-	// reset all array values to 0
-	memset(video_buffer, 0, sizeof(video_buffer));
+void CLS(const Instruction * ins, Chip8 * cpu_reg) {
+	for (uint32_t row=0; row < HEIGHT; ++row)
+		cpu_reg->dirty_rows |= (uint32_t)(cpu_reg->video_buffer[row] != 0) << row;
+
+	// reset all rows to 0 (a few wide stores)
+	memset(cpu_reg->video_buffer, 0, sizeof(cpu_reg->video_buffer));
+	cpu_reg->video_hash = 0;
 	cpu_reg->pc += 2;
 }
 
@@ -276,8 +1323,14 @@ void CLS(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x00EE - Return from a subroutine
  */
-void RET(uint16_t opcode, Chip8 * cpu_reg) {
-	cpu_reg->pc = stack[--cpu_reg->sp];
+void RET(const Instruction * ins, Chip8 * cpu_reg) {
+	if (cpu_reg->sp == 0) {
+		fault(cpu_reg, FAULT_STACK_UNDERFLOW);
+		cpu_reg->pc += 2;
+		return;
+	}
+
+	cpu_reg->pc = cpu_reg->stack[--cpu_reg->sp];
 	cpu_reg->pc += 2;
 }
 
@@ -285,28 +1338,32 @@ void RET(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x1NNN - Jump to location NNN
  */
-void JP_addr(uint16_t opcode, Chip8 * cpu_reg) {
-	cpu_reg->pc = opcode & 0x0FFF;
+void JP_addr(const Instruction * ins, Chip8 * cpu_reg) {
+	cpu_reg->pc = ins->nnn;
 }
 
 
 /*
  *  0x2NNN - Call subroutine at NNN
  */
-void CALL_addr(uint16_t opcode, Chip8 * cpu_reg) {
-	stack[cpu_reg->sp] = cpu_reg->pc;  // push current addr onto stack
-	cpu_reg->sp++;
-	cpu_reg->pc = opcode & 0x0FFF;
+void CALL_addr(const Instruction * ins, Chip8 * cpu_reg) {
+	if (cpu_reg->sp >= sizeof(cpu_reg->stack) / sizeof(cpu_reg->stack[0])) {
+		fault(cpu_reg, FAULT_STACK_OVERFLOW);
+	} else {
+		cpu_reg->stack[cpu_reg->sp] = cpu_reg->pc;  // push current addr onto stack
+		cpu_reg->sp++;
+	}
+	cpu_reg->pc = ins->nnn;
 }
 
 
 /*
  *  0x3XKK - Skip next instruction if VX == KK
  */
-void SE_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
+void SE_VX_byte(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
 
-	if (cpu_reg->V[X] == (opcode & 0x00FF))
+	if (cpu_reg->V[X] == ins->kk)
 		cpu_reg->pc += 2;
 
 	cpu_reg->pc += 2;
@@ -316,10 +1373,10 @@ void SE_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x4XKK - Skip next instruction if VX != KK
  */
-void SNE_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
- 	uint32_t X = (opcode & 0x0F00) >> 8;
+void SNE_VX_byte(const Instruction * ins, Chip8 * cpu_reg) {
+ 	uint32_t X = ins->x;
 
- 	if (cpu_reg->V[X] != (opcode & 0x00FF))
+ 	if (cpu_reg->V[X] != ins->kk)
  		cpu_reg->pc += 2;
 
  	cpu_reg->pc += 2;
@@ -329,9 +1386,9 @@ void SNE_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x5XY0 - Skip next instruction if VX == VY
  */
-void SE_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t Y = (opcode & 0x00F0) >> 4;
+void SE_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	uint32_t Y = ins->y;
 
 	if (cpu_reg->V[X] == cpu_reg->V[Y])
 		cpu_reg->pc += 2;
@@ -343,9 +1400,9 @@ void SE_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x6XKK - Put the value KK into register VX
  */
-void LD_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	cpu_reg->V[X] = (opcode & 0x00FF);
+void LD_VX_byte(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	cpu_reg->V[X] = ins->kk;
 	cpu_reg->pc += 2;
 }
 
@@ -353,9 +1410,9 @@ void LD_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x7XKK - Add the value KK to the value of VX, then store result in VX
  */
-void ADD_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	cpu_reg->V[X] += (opcode & 0x00FF);
+void ADD_VX_byte(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	cpu_reg->V[X] += ins->kk;
 	cpu_reg->pc += 2;
 }
 
@@ -363,9 +1420,9 @@ void ADD_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY0 - Set VX = Vy
  */
-void LD_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
- 	uint32_t X = (opcode & 0x0F00) >> 8;
- 	uint32_t Y = (opcode & 0x00F0) >> 4;
+void LD_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+ 	uint32_t X = ins->x;
+ 	uint32_t Y = ins->y;
  	cpu_reg->V[X] = cpu_reg->V[Y];
  	cpu_reg->pc += 2;
 }
@@ -374,9 +1431,9 @@ void LD_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY1 - Set VX = VX OR VY
  */
-void OR_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t Y = (opcode & 0x00F0) >> 4;
+void OR_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	uint32_t Y = ins->y;
 	cpu_reg->V[X] = cpu_reg->V[X] | cpu_reg->V[Y];
 	cpu_reg->pc += 2;
 }
@@ -385,9 +1442,9 @@ void OR_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY2 - Set VX = VX AND VY
  */
-void AND_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-  	uint32_t X = (opcode & 0x0F00) >> 8;
- 	uint32_t Y = (opcode & 0x00F0) >> 4;
+void AND_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+  	uint32_t X = ins->x;
+ 	uint32_t Y = ins->y;
  	cpu_reg->V[X] = cpu_reg->V[X] & cpu_reg->V[Y];
  	cpu_reg->pc += 2;
 }
@@ -396,9 +1453,9 @@ void AND_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY3 - Set VX = VX XOR VY
  */
-void XOR_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
- 	uint32_t X = (opcode & 0x0F00) >> 8;
- 	uint32_t Y = (opcode & 0x00F0) >> 4;
+void XOR_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+ 	uint32_t X = ins->x;
+ 	uint32_t Y = ins->y;
  	cpu_reg->V[X] = cpu_reg->V[X] ^ cpu_reg->V[Y];
  	cpu_reg->pc += 2;
 }
@@ -407,9 +1464,9 @@ void XOR_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY4 - Set VX = VX + VY, set VF = carry
  */
-void ADD_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
- 	uint32_t Y = (opcode & 0x00F0) >> 4;
+void ADD_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+ 	uint32_t Y = ins->y;
 
  	// check for overflow & set flag=1 if there is a carry
  	if (cpu_reg->V[Y] > (MAX_INTEGER_8BIT - cpu_reg->V[X]))
@@ -425,9 +1482,9 @@ void ADD_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY5 - Set VX = VX - VY, set VF = NOT borrow
  */
-void SUB_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t Y = (opcode & 0x00F0) >> 4;
+void SUB_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	uint32_t Y = ins->y;
 
 	// check for a borrow; set flag=1 is there IS NOT a borrow
 	if (cpu_reg->V[X] > cpu_reg->V[Y])
@@ -441,15 +1498,14 @@ void SUB_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 
 
 /*
- *  0x8XY6 - Set VX = VX SHR 1, set VF = least sig. bit of VX
+ *  0x8XY6 - Set VX = VX SHR 1 (VY SHR 1 if shift_vy), set VF = the bit shifted out
  */
-void SHR_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
+static inline void shift_right(const Instruction * ins, Chip8 * cpu_reg, int shift_vy) {
+	uint8_t value = shift_vy ? cpu_reg->V[ins->y] : cpu_reg->V[ins->x];
 
-	// check least significant bit & set flag=1 if it's 1
-	cpu_reg->V[FLAG_REG] = (cpu_reg->V[X] & 0x1);
-
-	cpu_reg->V[X] = cpu_reg->V[X] >> 1;
+	// the flag is written last so it wins when X is F
+	cpu_reg->V[ins->x] = value >> 1;
+	cpu_reg->V[FLAG_REG] = value & 0x1;
 	cpu_reg->pc += 2;
 }
 
@@ -457,9 +1513,9 @@ void SHR_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x8XY7 - Set VX = VY - VX, set VF = NOT borrow
  */
-void SUBN_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t Y = (opcode & 0x00F0) >> 4;
+void SUBN_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	uint32_t Y = ins->y;
 
 	// check for a borrow; set flag=1 is there IS NOT a borrow
 	if (cpu_reg->V[Y] > cpu_reg->V[X])
@@ -473,15 +1529,13 @@ void SUBN_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 
 
 /*
- *  0x8XYE - Set VX = VX SHL 1, set VF = most sig. bit of VX
+ *  0x8XYE - Set VX = VX SHL 1 (VY SHL 1 if shift_vy), set VF = the bit shifted out
  */
-void SHL_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-
-	// check most significant bit & set flag=1 if it's 1
-	cpu_reg->V[FLAG_REG] = (cpu_reg->V[X] & 0x8) >> 7;
+static inline void shift_left(const Instruction * ins, Chip8 * cpu_reg, int shift_vy) {
+	uint8_t value = shift_vy ? cpu_reg->V[ins->y] : cpu_reg->V[ins->x];
 
-	cpu_reg->V[X] = cpu_reg->V[X] << 1;
+	cpu_reg->V[ins->x] = value << 1;
+	cpu_reg->V[FLAG_REG] = value >> 7;
 	cpu_reg->pc += 2;
 }
 
@@ -489,9 +1543,9 @@ void SHL_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0x9XY0 - Skip the next instruction if VX != VY
  */
-void SNE_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t Y = (opcode & 0x00F0) >> 4;
+void SNE_VX_VY(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	uint32_t Y = ins->y;
 
 	if (cpu_reg->V[X] != cpu_reg->V[Y])
 		cpu_reg->pc += 2;
@@ -503,63 +1557,81 @@ void SNE_VX_VY(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xANNN - Set I = NNN
  */
-void LD_I_addr(uint16_t opcode, Chip8 * cpu_reg) {
-	cpu_reg->I = (opcode & 0x0FFF);
+void LD_I_addr(const Instruction * ins, Chip8 * cpu_reg) {
+	cpu_reg->I = ins->nnn;
 	cpu_reg->pc += 2;
 }
 
 
 /*
- *  0xBNNN - Jump to location (NNN + V0)
+ *  0xBNNN - Jump to location (NNN + V0), or (XNN + VX) if jump_vx
  */
-void JP_V0_addr(uint16_t opcode, Chip8 * cpu_reg) {
-	cpu_reg->pc = cpu_reg->V[0] + (opcode & 0x0FFF);
+static inline void jump_offset(const Instruction * ins, Chip8 * cpu_reg, int jump_vx) {
+	cpu_reg->pc = cpu_reg->V[jump_vx ? ins->x : 0] + ins->nnn;
 }
 
 
 /*
  *  0xCXKK - Set VX = random byte AND KK
  */
-void RND_VX_byte(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t random = rand() % 256;   // generate a random number from 0 to 255
+void RND_VX_byte(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	uint32_t random = next_random(cpu_reg) >> 24;   // generate a random number from 0 to 255
 
-	cpu_reg->V[X] = random & (opcode & 0x00FF);
+	cpu_reg->V[X] = random & ins->kk;
 	cpu_reg->pc += 2;
 }
 
 
 /*
  *  0xDXYN - Display N-byte sprite starting at memory location I at (VX,VY), set VF = collison
+ *           The start position always wraps; pixels past the edge wrap if wrap is set,
+ *           otherwise they are clipped.
  */
-void DRW_VX_VY_nibble(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	uint32_t Y = (opcode & 0x00F0) >> 4;
-	uint32_t N = (opcode & 0x000F);
+static inline void draw_sprite(const Instruction * ins, Chip8 * cpu_reg, int wrap) {
+	uint32_t N = ins->n;
+	uint64_t collision = 0;
+	uint64_t hash_change = 0;
+	uint32_t dirty = 0;
 	cpu_reg->V[0xF] = 0;  // clear collision flag
 
 	// (x, y) position
-	uint32_t x = cpu_reg->V[X];
-	uint32_t y = cpu_reg->V[Y];
-
-	for (int yVal=0; yVal < N; ++yVal) {
-		uint8_t sprite_byte = memory[cpu_reg->I + yVal];
-
-		for (int xVal=0; xVal < 8; ++xVal) {
-			if (sprite_byte & (0x01 << xVal)) {
-				// if the current pixel is set, check it's value after XOR'ing it with its sprite font pixel
-				if (video_buffer[x + xVal + (y + yVal) * WIDTH] == 1)
-					// if the pixel is turned off, set collision flag
-					cpu_reg->V[0xF] = 1;
-				
-				video_buffer[x + xVal + (y + yVal) * WIDTH] ^= 1;
-			}
-			else {
-				video_buffer[x + xVal + (y + yVal) * WIDTH] ^= 0;
-			}
+	uint32_t x = cpu_reg->V[ins->x] % WIDTH;
+	uint32_t y = cpu_reg->V[ins->y] % HEIGHT;
+
+	if (cpu_reg->I + N > MEMORY_SIZE)
+		fault(cpu_reg, FAULT_MEMORY_READ);
+
+	for (uint32_t yVal=0; yVal < N; ++yVal) {
+		uint32_t row = y + yVal;
+		uint64_t bits = (uint64_t)cpu_reg->memory[(cpu_reg->I + yVal) & (MEMORY_SIZE - 1)] << 56;
+
+		if (row >= HEIGHT) {
+			if (!wrap)
+				break;
+			row -= HEIGHT;
 		}
+
+		// move the sprite byte to column x; past the right edge it wraps or falls off
+		if (wrap)
+			bits = (bits >> x) | (bits << ((WIDTH - x) % WIDTH));
+		else
+			bits >>= x;
+
+		// any pixel turned off sets the collision flag
+		uint64_t old = cpu_reg->video_buffer[row];
+		collision |= old & bits;
+		cpu_reg->video_buffer[row] = old ^ bits;
+		hash_change ^= row_hash(row, old) ^ row_hash(row, old ^ bits);
+		dirty |= (uint32_t)(bits != 0) << row;
 	}
 
+	cpu_reg->video_hash ^= hash_change;
+	cpu_reg->dirty_rows |= dirty;
+
+	if (collision)
+		cpu_reg->V[0xF] = 1;
+
 	cpu_reg->pc += 2;
 }
 
@@ -567,10 +1639,13 @@ void DRW_VX_VY_nibble(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xEX9E - Skip next instruction if key with the value of VX is pressed
  */
-void SKP_VX(uint16_t opcode, Chip8 * cpu_reg) {
-	int X = (opcode & 0x0F00) >> 8;
+void SKP_VX(const Instruction * ins, Chip8 * cpu_reg) {
+	int X = ins->x;
 
-	if (keys[cpu_reg->V[X]] == 1)
+	if (cpu_reg->V[X] > 0xF)
+		fault(cpu_reg, FAULT_BAD_KEY);
+
+	if (cpu_reg->keys[cpu_reg->V[X] & 0xF] == 1)
 		cpu_reg->pc += 2;
 	
 	cpu_reg->pc += 2;
@@ -580,10 +1655,13 @@ void SKP_VX(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xEXA1 - Skip next instruction if key with the value of VX is not pressed
  */
-void SKNP_VX(uint16_t opcode, Chip8 * cpu_reg) {
-	int X = (opcode & 0x0F00) >> 8;
+void SKNP_VX(const Instruction * ins, Chip8 * cpu_reg) {
+	int X = ins->x;
+
+	if (cpu_reg->V[X] > 0xF)
+		fault(cpu_reg, FAULT_BAD_KEY);
 
-	if (keys[cpu_reg->V[X]] == 0)
+	if (cpu_reg->keys[cpu_reg->V[X] & 0xF] == 0)
 		cpu_reg->pc += 2;
 
 	cpu_reg->pc += 2;
@@ -593,9 +1671,9 @@ void SKNP_VX(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xFX07 - Set VX = delay timer value
  */
-void LD_VX_DT(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	cpu_reg->V[X] = delay_timer;
+void LD_VX_DT(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	cpu_reg->V[X] = cpu_reg->delay_timer;
 	cpu_reg->pc += 2;
 }
 
@@ -603,25 +1681,28 @@ void LD_VX_DT(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  * 0xFX0A - Wait for a key press, store the value of the key in VX
  */
-void LD_VX_K(uint16_t opcode, Chip8 * cpu_reg) {
-	int X = (opcode & 0x0F00) >> 8;
+void LD_VX_K(const Instruction * ins, Chip8 * cpu_reg) {
+	int X = ins->x;
 
 	for (int i=0; i<16; ++i) {
-		if (keys[i] == 1) {
+		if (cpu_reg->keys[i] == 1) {
 			cpu_reg->V[X] = i;
 			cpu_reg->pc += 2;  // increment pc if key pressed; cpu will return here if not
-			break;
+			return;
 		}
 	}
+
+	// halt: run_frame() skips the machine's frames until a key goes down
+	cpu_reg->waiting_for_key = 1;
 }
 
 
 /*
  *  0xFX15 - Set delay timer = VX
  */
-void LD_DT_VX(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	delay_timer = cpu_reg->V[X];
+void LD_DT_VX(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
+	cpu_reg->delay_timer = cpu_reg->V[X];
 	cpu_reg->pc += 2;
 }
 
@@ -629,10 +1710,10 @@ void LD_DT_VX(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xFX18 - Set sound timer = VX
  */
-void LD_ST_VX(uint16_t opcode, Chip8 * cpu_reg) {
+void LD_ST_VX(const Instruction * ins, Chip8 * cpu_reg) {
 	// set ST = VX
-	uint32_t X = (opcode & 0x0F00) >> 8;
-	sound_timer = cpu_reg->V[X];
+	uint32_t X = ins->x;
+	cpu_reg->sound_timer = cpu_reg->V[X];
 	cpu_reg->pc += 2;
 }
 
@@ -640,8 +1721,8 @@ void LD_ST_VX(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xFX1E - Set I = I + VX
  */
-void ADD_I_VX(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
+void ADD_I_VX(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
 	cpu_reg->I += cpu_reg->V[X];
 	cpu_reg->pc += 2;
 }
@@ -650,51 +1731,311 @@ void ADD_I_VX(uint16_t opcode, Chip8 * cpu_reg) {
 /*
  *  0xFX29 - Set I = location of sprite for digit VX
  */
-void LD_F_VX(uint16_t opcode, Chip8 * cpu_reg) {
-	uint32_t X = (opcode & 0x0F00) >> 8;
+void LD_F_VX(const Instruction * ins, Chip8 * cpu_reg) {
+	uint32_t X = ins->x;
 	cpu_reg->I = cpu_reg->V[X] * 5;  // multiplied by 5 because sprites are 5 bytes long
 	cpu_reg->pc += 2;
 }
 
 
+/*
+ *	write_memory()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        addr - Where to write
+ *	        bytes - What to write
+ *	        len - How many bytes
+ *	Return Value: None
+ *	Function: Stores bytes for FX33/FX55 and invalidates what they overwrote.
+ *	          A write running past the end of memory is a fault and wraps.
+ */
+static inline void write_memory(Chip8 * cpu_reg, uint32_t addr, const uint8_t * bytes, uint32_t len) {
+	if (addr + len <= MEMORY_SIZE) {
+		memcpy(cpu_reg->memory + addr, bytes, len);
+		invalidate_icache(cpu_reg, addr, len);
+		return;
+	}
+
+	fault(cpu_reg, FAULT_MEMORY_WRITE);
+	for (uint32_t k=0; k < len; ++k) {
+		cpu_reg->memory[(addr + k) & (MEMORY_SIZE - 1)] = bytes[k];
+		invalidate_icache(cpu_reg, (addr + k) & (MEMORY_SIZE - 1), 1);
+	}
+}
+
+
 /*
  *  0xFX33 - Store the BCD representation of VX in mem. locations I, I+1, and I+2
  */
-void LD_B_VX(uint16_t opcode, Chip8 * cpu_reg) {
+void LD_B_VX(const Instruction * ins, Chip8 * cpu_reg) {
 	// take decimal value of V[X] and store its hundreds digit at mem. loc. I,
 	// its tens digit at I+1, and its ones digit at I+2
-	int X = (opcode & 0x0F00) >> 8;
+	int X = ins->x;
+	uint8_t digits[3] = { cpu_reg->V[X] / 100, (cpu_reg->V[X] % 100) / 10, cpu_reg->V[X] % 10 };
 
-	memory[cpu_reg->I] = cpu_reg->V[X] / 100;
-	memory[cpu_reg->I+1] = (cpu_reg->V[X] % 100) / 10;
-	memory[cpu_reg->I+2] = cpu_reg->V[X] % 10;
+	write_memory(cpu_reg, cpu_reg->I, digits, 3);
 
 	cpu_reg->pc += 2;
 }
 
 
 /*
- *  0xFX55 - Store registers V0 through VX in memory starting at location I
+ *  0xFX55 - Store registers V0 through VX in memory starting at location I,
+ *           then advance I as index_mode says (INDEX_*)
  */
-void LD_I_VX(uint16_t opcode, Chip8 * cpu_reg) {
-	int X = (opcode & 0x0F00) >> 8;
+static inline void store_registers(const Instruction * ins, Chip8 * cpu_reg, int index_mode) {
+	int X = ins->x;
 
-	for (int k=0; k <= X; ++k)
-		memory[cpu_reg->I + k] = cpu_reg->V[k];
+	write_memory(cpu_reg, cpu_reg->I, cpu_reg->V, X + 1);
 
+	if (index_mode != INDEX_UNCHANGED)
+		cpu_reg->I += X + (index_mode == INDEX_PLUS_X_PLUS_1);
 	cpu_reg->pc += 2;
 }
 
 
 /*
- *  0xFX65 - Read into registers V0 through VX from memory starting at location I
+ *  0xFX65 - Read into registers V0 through VX from memory starting at location I,
+ *           then advance I as index_mode says (INDEX_*)
  */
-void LD_VX_I(uint16_t opcode, Chip8 * cpu_reg) {
-	int X = (opcode & 0x0F00) >> 8;
+static inline void load_registers(const Instruction * ins, Chip8 * cpu_reg, int index_mode) {
+	int X = ins->x;
+
+	if (cpu_reg->I + X + 1 > MEMORY_SIZE)
+		fault(cpu_reg, FAULT_MEMORY_READ);
 
 	for (int k=0; k <= X; ++k)
-		cpu_reg->V[k] = memory[cpu_reg->I + k];
+		cpu_reg->V[k] = cpu_reg->memory[(cpu_reg->I + k) & (MEMORY_SIZE - 1)];
 
+	if (index_mode != INDEX_UNCHANGED)
+		cpu_reg->I += X + (index_mode == INDEX_PLUS_X_PLUS_1);
 	cpu_reg->pc += 2;
 }
 
+
+
+/****************************************************************/
+/*************          Fused Instructions          *************/
+/****************************************************************/
+/* Note: Each fused handler runs the same handlers the sequence would have
+         run one at a time, taking operands from the following cpu_reg->icache
+         entries, and retires the extra instructions itself. The entry only
+         costs the first instruction's VIP cycles; the others are charged as
+         they run, so a jump that gets skipped isn't paid for. A sequence
+         that would run past the end of the run (its instruction budget, or
+         the VIP cycles its frame has left) only runs its first instruction,
+         and the rest are dispatched one at a time. */
+
+static inline int fusion_fits(const Instruction * ins, const Chip8 * cpu_reg, uint32_t length) {
+	uint64_t cycles = cpu_reg->cycles;   // when the last one would be dispatched
+
+	for (uint32_t i=1; i < length - 1; ++i)
+		cycles += ins[i].cost;
+
+	return (cpu_reg->run_end == 0 || cpu_reg->instructions_retired + length - 1 <= cpu_reg->run_end) &&
+	       (cpu_reg->run_cycle_end == 0 || cycles < cpu_reg->run_cycle_end);
+}
+
+static inline void count_fusion(const Instruction * ins, Chip8 * cpu_reg, int fusion, uint32_t length) {
+	retire_instructions(cpu_reg, length - 1);
+	for (uint32_t i=1; i < length; ++i)
+		cpu_reg->cycles += ins[i].cost;
+	cpu_reg->fusion_executions[fusion]++;
+	cpu_reg->fusion_instructions[fusion] += length;
+}
+
+
+/*
+ *  0x6XKK, 0x3YKK - Load a register, then test one
+ */
+static void FUSED_LD_SE(const Instruction * ins, Chip8 * cpu_reg) {
+	LD_VX_byte(ins, cpu_reg);
+	if (!fusion_fits(ins, cpu_reg, 2))
+		return;
+
+	SE_VX_byte(ins + 1, cpu_reg);
+	count_fusion(ins, cpu_reg, FUSION_LD_SE, 2);
+}
+
+
+/*
+ *  0x6XKK, 0x1NNN - Load a register, then jump
+ */
+static void FUSED_LD_JP(const Instruction * ins, Chip8 * cpu_reg) {
+	LD_VX_byte(ins, cpu_reg);
+	if (!fusion_fits(ins, cpu_reg, 2))
+		return;
+
+	JP_addr(ins + 1, cpu_reg);
+	count_fusion(ins, cpu_reg, FUSION_LD_JP, 2);
+}
+
+
+/*
+ *  0x7XKK, 0x4YKK - Step a counter, then test it
+ */
+static void FUSED_ADD_SNE(const Instruction * ins, Chip8 * cpu_reg) {
+	ADD_VX_byte(ins, cpu_reg);
+	if (!fusion_fits(ins, cpu_reg, 2))
+		return;
+
+	SNE_VX_byte(ins + 1, cpu_reg);
+	count_fusion(ins, cpu_reg, FUSION_ADD_SNE, 2);
+}
+
+
+/*
+ *  0x7XKK, 0x4YKK, 0x1NNN - Counted loop: step, test, jump back unless skipped
+ */
+static void FUSED_ADD_SNE_JP(const Instruction * ins, Chip8 * cpu_reg) {
+	uint16_t jump_addr = cpu_reg->pc + 4;
+
+	ADD_VX_byte(ins, cpu_reg);
+	if (!fusion_fits(ins, cpu_reg, 2))
+		return;
+
+	SNE_VX_byte(ins + 1, cpu_reg);
+
+	// if the jump doesn't fit either, pc is left on it
+	if (cpu_reg->pc == jump_addr && fusion_fits(ins, cpu_reg, 3)) {
+		JP_addr(ins + 2, cpu_reg);
+		count_fusion(ins, cpu_reg, FUSION_ADD_SNE_JP, 3);
+	}
+	else {
+		count_fusion(ins, cpu_reg, FUSION_ADD_SNE_JP, 2);
+	}
+}
+
+
+
+/****************************************************************/
+/*************          Idle-Loop Detection         *************/
+/****************************************************************/
+
+/*
+ *	same_idle_state()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        loop - What the jump saw last time
+ *	Return Value: 1 if everything the machine's future depends on is as it was
+ */
+static inline int same_idle_state(const Chip8 * cpu_reg, const IdleLoop * loop) {
+	return memcmp(cpu_reg->V, loop->V, sizeof(loop->V)) == 0 && cpu_reg->I == loop->I &&
+	       cpu_reg->sp == loop->sp && cpu_reg->delay_timer == loop->delay_timer &&
+	       cpu_reg->sound_timer == loop->sound_timer && cpu_reg->rand_state == loop->rand_state &&
+	       cpu_reg->faults == loop->faults && cpu_reg->memory_writes == loop->memory_writes &&
+	       cpu_reg->video_hash == loop->video_hash;
+}
+
+
+/*
+ *  0x1NNN closing a polling loop (see polling_loop()) - Jump to location NNN,
+ *  skipping ahead if the loop can't get anywhere before the run ends.
+ *
+ *  The timers and keys only change between runs (see run_frame()), so if
+ *  the machine comes back to this jump within a run with its registers,
+ *  timers, memory and screen as they were the time before, every iteration
+ *  until the end of the run will do the same. Those iterations are counted (instructions
+ *  and VIP cycles) without being executed, stopping short of the end of
+ *  the run so the last partial iteration runs for real and the run ends
+ *  exactly where it would have. The screen is compared by video_hash.
+ */
+static void JP_IDLE_LOOP(const Instruction * ins, Chip8 * cpu_reg) {
+	IdleLoop * loop = &cpu_reg->idle;
+	uint16_t addr = cpu_reg->pc;
+	uint64_t retired = cpu_reg->instructions_retired;
+
+	JP_addr(ins, cpu_reg);
+
+	if (loop->pc == addr && loop->instructions_retired != 0 && retired > loop->instructions_retired &&
+	    retired - loop->instructions_retired <= MAX_IDLE_ITERATION && same_idle_state(cpu_reg, loop)) {
+		uint64_t length = retired - loop->instructions_retired;
+		uint64_t cost = cpu_reg->cycles - loop->cycles;
+		uint64_t skip = 0;
+
+		if (cpu_reg->run_end > retired && cpu_reg->run_cycle_end > cpu_reg->cycles && cost > 0) {
+			uint64_t by_count = (cpu_reg->run_end - retired - 1) / length;
+			uint64_t by_cycles = (cpu_reg->run_cycle_end - cpu_reg->cycles - 1) / cost;
+
+			skip = (by_count < by_cycles) ? by_count : by_cycles;
+		}
+
+		cpu_reg->instructions_retired += skip * length;
+		cpu_reg->cycles += skip * cost;
+		cpu_reg->idle_instructions += skip * length;
+	}
+
+	loop->pc = addr;
+	loop->I = cpu_reg->I;
+	loop->sp = cpu_reg->sp;
+	loop->delay_timer = cpu_reg->delay_timer;
+	loop->sound_timer = cpu_reg->sound_timer;
+	memcpy(loop->V, cpu_reg->V, sizeof(loop->V));
+	loop->rand_state = cpu_reg->rand_state;
+	loop->faults = cpu_reg->faults;
+	loop->instructions_retired = cpu_reg->instructions_retired;
+	loop->cycles = cpu_reg->cycles;
+	loop->memory_writes = cpu_reg->memory_writes;
+	loop->video_hash = cpu_reg->video_hash;
+}
+
+
+
+/****************************************************************/
+/*************            Quirk Profiles            *************/
+/****************************************************************/
+/* Note: quirks.h is included once per profile. Each inclusion defines the
+         profile's quirk handlers (SHR_VX_VY_vip() etc.), its handler table
+         and, in threaded builds, its own copy of the threaded loop, with
+         the quirk settings below as compile-time constants */
+
+#define PROFILE_CONCAT(fn, profile)   fn##_##profile
+#define PROFILE_NAME(fn, profile)     PROFILE_CONCAT(fn, profile)
+#define QUIRK(fn)                     PROFILE_NAME(fn, PROFILE)
+
+// COSMAC VIP
+#define PROFILE            vip
+#define QUIRK_SHIFT_VY     1
+#define QUIRK_INDEX        INDEX_PLUS_X_PLUS_1
+#define QUIRK_JUMP_VX      0
+#define QUIRK_DRAW_WRAP    0
+#include "quirks.h"
+
+// CHIP-48
+#define PROFILE            chip48
+#define QUIRK_SHIFT_VY     0
+#define QUIRK_INDEX        INDEX_PLUS_X
+#define QUIRK_JUMP_VX      1
+#define QUIRK_DRAW_WRAP    0
+#include "quirks.h"
+
+// SUPER-CHIP 1.1
+#define PROFILE            schip
+#define QUIRK_SHIFT_VY     0
+#define QUIRK_INDEX        INDEX_UNCHANGED
+#define QUIRK_JUMP_VX      1
+#define QUIRK_DRAW_WRAP    0
+#include "quirks.h"
+
+// Modern interpreters (Octo's defaults)
+#define PROFILE            modern
+#define QUIRK_SHIFT_VY     1
+#define QUIRK_INDEX        INDEX_PLUS_X_PLUS_1
+#define QUIRK_JUMP_VX      0
+#define QUIRK_DRAW_WRAP    1
+#include "quirks.h"
+
+#ifdef THREADED_LOOP
+#define QUIRK_TABLE(profile) \
+	{ #profile, PROFILE_NAME(handlers, profile), PROFILE_NAME(handler_names, profile), \
+	  &PROFILE_NAME(settings, profile), PROFILE_NAME(run_cycles, profile) }
+#else
+#define QUIRK_TABLE(profile) \
+	{ #profile, PROFILE_NAME(handlers, profile), PROFILE_NAME(handler_names, profile), \
+	  &PROFILE_NAME(settings, profile) }
+#endif
+
+static const QuirkTable profiles[QUIRK_PROFILE_COUNT] = {
+	[QUIRKS_VIP]    = QUIRK_TABLE(vip),
+	[QUIRKS_CHIP48] = QUIRK_TABLE(chip48),
+	[QUIRKS_SCHIP]  = QUIRK_TABLE(schip),
+	[QUIRKS_MODERN] = QUIRK_TABLE(modern)
+};
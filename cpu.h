@@ -13,28 +13,215 @@
 #define MAX_INTEGER_8BIT     255
 #define WIDTH                64
 #define HEIGHT               32
+_Static_assert(WIDTH == 64, "a screen row is one uint64_t");
+_Static_assert(HEIGHT <= 32, "dirty_rows has one bit per row");
+#define MEMORY_SIZE          4096
+#define MAX_FUSIONS          8      // fused sequences counted per machine (see cpu.c)
+#define COVERAGE_SIZE        65536  // entries in an edge coverage map (see set_coverage_map())
+#define DEFAULT_FRAME_BUDGET 10     // instructions per 60 Hz frame (see set_frame_budget())
+#define VIP_CYCLES_PER_FRAME 3668   // COSMAC VIP machine cycles per 60 Hz frame (1.76 MHz / 8 / 60)
+#define ENDS_BLOCK           0x1    // block_flags(): instruction changes control flow or writes memory
+#define STARTS_BLOCK         0x2    // block_flags(): instruction must be first in its block (FX0A)
 
 
-extern uint8_t memory[4096];   // CHIP-8 has 4KB of RAM
-extern uint8_t video_buffer[WIDTH * HEIGHT];  // video memory buffer to be drawn to screen
-extern uint8_t keys[16];  // holds CHIP-8's 16 key states; value is 1 when key is pressed, 0 when released
+typedef struct chip8 Chip8;
 
 
 /*
- *  CHIP-8 registers
+ *  Predecoded instruction
  */
-typedef struct registers {
+typedef struct instruction Instruction;
+typedef void (*instruction_fn)(const Instruction * ins, Chip8 * cpu_reg);
+
+struct instruction {
+	instruction_fn fn;   // handler which executes the instruction
+	uint16_t opcode;   // raw instruction word
+
+	// operands extracted from the opcode
+	uint16_t nnn;
+	uint8_t x;
+	uint8_t y;
+	uint8_t n;
+	uint8_t kk;
+
+	uint8_t op;   // handler index in the dispatch table
+	uint16_t cost;   // COSMAC VIP machine cycles of this instruction alone (see run_frame())
+};
+
+/*
+ *  What a polling loop's backward jump saw the last time it ran (see
+ *  JP_IDLE_LOOP() in cpu.c)
+ */
+typedef struct idle_loop {
+	uint16_t pc;   // address of the jump
+	uint16_t I;
+	uint16_t sp;
+	uint16_t delay_timer;
+	uint16_t sound_timer;
+	uint8_t V[16];
+	uint32_t rand_state;
+	uint32_t faults;
+	uint64_t instructions_retired;   // 0 = nothing recorded
+	uint64_t cycles;
+	uint64_t memory_writes;
+	uint64_t video_hash;
+} IdleLoop;
+
+typedef void (*memory_write_listener)(void * data, uint32_t addr, uint32_t len);
+
+
+/*
+ *  Quirk profiles (see set_quirk_profile())
+ */
+typedef enum quirk_profile {
+	QUIRKS_VIP,      // COSMAC VIP: shifts use VY, FX55/FX65 add X+1 to I, BNNN, sprites clip
+	QUIRKS_CHIP48,   // CHIP-48: shifts ignore VY, FX55/FX65 add X to I, BXNN, sprites clip
+	QUIRKS_SCHIP,    // SUPER-CHIP: shifts ignore VY, FX55/FX65 leave I alone, BXNN, sprites clip
+	QUIRKS_MODERN,   // Octo etc.: shifts use VY, FX55/FX65 add X+1 to I, BNNN, sprites wrap
+	QUIRK_PROFILE_COUNT
+} QuirkProfile;
+
+/*
+ *  Out-of-range accesses a ROM can make (see Chip8.faults). The access is
+ *  wrapped or dropped instead of touching anything outside the machine.
+ */
+typedef enum chip8_fault {
+	FAULT_NONE,
+	FAULT_MEMORY_READ,   // DXYN or FX65 reading past the end of memory
+	FAULT_MEMORY_WRITE,   // FX33 or FX55 writing past the end of memory
+	FAULT_STACK_OVERFLOW,   // 2NNN with the stack full; the jump happens, the push doesn't
+	FAULT_STACK_UNDERFLOW,   // 00EE with the stack empty; carries on with the next instruction
+	FAULT_BAD_KEY,   // EX9E/EXA1 with VX > 0xF; the low nibble is used
+	FAULT_COUNT
+} Chip8Fault;
+
+/*
+ *  What a quirk profile changes (see quirks.h)
+ */
+typedef struct quirk_settings {
+	uint8_t shift_vy;   // 8XY6/8XYE shift VY into VX
+	uint8_t index_mode;   // FX55/FX65 add 0 (0), X (1) or X+1 (2) to I
+	uint8_t jump_vx;   // BXNN jumps to XNN + VX instead of NNN + V0
+	uint8_t draw_wrap;   // sprites wrap around the screen edges instead of clipping
+} QuirkSettings;
+
+
+/*
+ *  One CHIP-8 machine: registers, memory, screen, keys and the
+ *  interpreter's caches. Every function takes the machine it works on, so
+ *  any number of them can run in one process.
+ */
+struct chip8 {
 	// 16 data registers -- Note: V[15] is the flag register
 	uint8_t V[16];
 
 	uint16_t I;   // address register - involved in mem. operations
 	uint16_t pc;   // program counter
 	uint16_t sp;   // stack pointer
-} Chip8;
+
+	uint16_t stack[16];   // Stack used to store the return addresses from subroutines
+	uint16_t delay_timer;   // Used for timeing of game events
+	uint16_t sound_timer;   // Used for sound effects; beeps when nonzero
+
+	uint8_t memory[MEMORY_SIZE];   // CHIP-8 has 4KB of RAM
+	uint64_t video_buffer[HEIGHT];  // one bit per pixel, 1 = on; bit 63 of a row is its leftmost pixel
+	uint8_t keys[16];  // holds CHIP-8's 16 key states; value is 1 when key is pressed, 0 when released
+	uint32_t rand_state;   // xorshift32 state used by RND_VX_byte (see seed_random())
+
+	// Interpreter state. initialize_cpu() keeps the profile, listener and coverage map.
+	Instruction icache[MEMORY_SIZE / 2];   // predecoded instruction for each even address
+	const struct quirk_table * quirks;   // copy of the interpreter in use (see set_quirk_profile())
+	memory_write_listener write_listener;   // told about every memory write
+	void * write_listener_data;
+
+	uint8_t * coverage;   // edge hit counts updated by fde_cycle(), or NULL (see set_coverage_map())
+	uint16_t coverage_prev;   // previous instruction address / 2, for the edges
+	uint64_t memory_writes;   // memory writes so far (see dirty_lines())
+	uint64_t line_writes[MEMORY_SIZE / 64];   // memory_writes as of the last write to each 64-byte line
+	uint64_t restored_at;   // memory_writes when the last restore_cpu_state()/reset_cpu_state() finished
+	uint64_t line_hash[MEMORY_SIZE / 64];   // hash of each 64-byte memory line, kept by invalidate_icache()
+	uint64_t memory_hash;   // XOR of line_hash (see state_hash())
+	uint64_t video_hash;   // hash of video_buffer, kept by CLS and DXYN (see state_hash())
+	uint32_t dirty_rows;   // rows changed since the host last cleared this (bit n = row n)
+
+	uint32_t unknown_opcodes;  // number of unknown opcodes hit since initialize_cpu()
+	uint32_t faults;   // out-of-range accesses since initialize_cpu()
+	uint8_t first_fault;   // Chip8Fault of the first of them
+	uint16_t first_fault_pc;   // and the address of its instruction
+	uint64_t instructions_retired;  // instructions executed since initialize_cpu()
+
+	// Frame scheduler (see run_frame()). initialize_cpu() keeps the budget and timing.
+	uint32_t frame_budget;   // instructions, or with vip_timing machine cycles, per frame
+	uint8_t vip_timing;   // charge each instruction its COSMAC VIP cycle cost
+	uint32_t frame_overrun;   // cycles the last frame ran past its budget (vip_timing)
+	uint64_t cycles;   // VIP machine cycles the interpreter has charged since initialize_cpu()
+	uint64_t frames;   // frames run since initialize_cpu()
+	uint64_t sound_frames;   // of those, frames the buzzer sounded for (sound_timer nonzero as they ended)
+	uint8_t waiting_for_key;   // FX0A found no key down (see waiting_for_key())
+	uint64_t run_end;   // instructions_retired the current run stops at; 0 outside one
+	uint64_t run_cycle_end;   // cycles it stops at; 0 outside one
+	IdleLoop idle;   // last pass through a polling loop
+	uint64_t idle_instructions;   // instructions skipped over by idle-loop detection
+
+	uint64_t fusion_executions[MAX_FUSIONS];   // times each fused handler ran
+	uint64_t fusion_instructions[MAX_FUSIONS];   // instructions those runs covered
+};
+
+
+/*
+ *  Snapshot of the whole machine (see save_cpu_state())
+ */
+typedef struct cpu_state {
+	uint8_t V[16];
+	uint16_t I;
+	uint16_t pc;
+	uint16_t sp;
+	uint16_t stack[16];
+	uint16_t delay_timer;
+	uint16_t sound_timer;
+	uint8_t memory[MEMORY_SIZE];
+	uint64_t video_buffer[HEIGHT];
+	uint8_t keys[16];
+	uint32_t rand_state;
+} CpuState;
 
 
 void fde_cycle(Chip8 * cpu_reg);
+void run_cycles(Chip8 * cpu_reg, uint32_t count);
+void step_instruction(Chip8 * cpu_reg);
+void decode_instruction(const Chip8 * cpu_reg, uint16_t opcode, Instruction * ins);
+const char * handler_name(QuirkProfile profile, uint16_t opcode);
+int block_flags(uint16_t opcode);
+void invalidate_icache(Chip8 * cpu_reg, uint32_t addr, uint32_t len);
+uint64_t dirty_lines(const Chip8 * cpu_reg, uint64_t since);
+uint64_t state_hash(const Chip8 * cpu_reg);
+void rehash_video(Chip8 * cpu_reg);
+void set_memory_write_listener(Chip8 * cpu_reg, memory_write_listener listener, void * data);
+void retire_instructions(Chip8 * cpu_reg, uint32_t count);
+void set_frame_budget(Chip8 * cpu_reg, uint32_t budget, int vip_timing);
+void run_frame(Chip8 * cpu_reg);
+void end_frame(Chip8 * cpu_reg);
+int waiting_for_key(Chip8 * cpu_reg);
+void set_coverage_map(Chip8 * cpu_reg, uint8_t * map);
+void seed_random(Chip8 * cpu_reg, uint32_t seed);
+const char * fault_name(Chip8Fault fault);
+
+void print_fusion_stats(const Chip8 * cpu_reg, FILE * out);
+void unpack_video(const Chip8 * cpu_reg, uint8_t * pixels);
+void pack_video(Chip8 * cpu_reg, const uint8_t * pixels);
+
+void set_quirk_profile(Chip8 * cpu_reg, QuirkProfile profile);
+QuirkProfile get_quirk_profile(const Chip8 * cpu_reg);
+const char * quirk_profile_name(QuirkProfile profile);
+const QuirkSettings * get_quirk_settings(QuirkProfile profile);
+int find_quirk_profile(const char * name);
+
+void save_cpu_state(const Chip8 * cpu_reg, CpuState * state);
+void restore_cpu_state(Chip8 * cpu_reg, const CpuState * state);
+void reset_cpu_state(Chip8 * cpu_reg, const CpuState * state);
+void reset_counters(Chip8 * cpu_reg);
 void initialize_cpu(Chip8 * cpu_reg);
+int load_program(Chip8 * cpu_reg, const char *filename);
 
 void debugger(Chip8* cpu_reg, uint16_t opcode);
 
@@ -42,41 +229,50 @@ void debugger(Chip8* cpu_reg, uint16_t opcode);
 /****************************************************************/
 /*************          Chip-8 Intructions          *************/
 /****************************************************************/
-void SYS_addr(uint16_t opcode, Chip8 * cpu_reg);
-void CLS(uint16_t opcode, Chip8 * cpu_reg);
-void RET(uint16_t opcode, Chip8 * cpu_reg);
-void JP_addr(uint16_t opcode, Chip8 * cpu_reg);
-void CALL_addr(uint16_t opcode, Chip8 * cpu_reg);
-void SE_VX_byte(uint16_t opcode, Chip8 * cpu_reg);
-void SNE_VX_byte(uint16_t opcode, Chip8 * cpu_reg);
-void SE_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void LD_VX_byte(uint16_t opcode, Chip8 * cpu_reg);
-void ADD_VX_byte(uint16_t opcode, Chip8 * cpu_reg);
-void LD_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void OR_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void AND_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void XOR_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void ADD_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void SUB_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void SHR_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void SUBN_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void SHL_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void SNE_VX_VY(uint16_t opcode, Chip8 * cpu_reg);
-void LD_I_addr(uint16_t opcode, Chip8 * cpu_reg);
-void JP_V0_addr(uint16_t opcode, Chip8 * cpu_reg);
-void RND_VX_byte(uint16_t opcode, Chip8 * cpu_reg);
-void DRW_VX_VY_nibble(uint16_t opcode, Chip8 * cpu_reg);
-void SKP_VX(uint16_t opcode, Chip8 * cpu_reg);
-void SKNP_VX(uint16_t opcode, Chip8 * cpu_reg);
-void LD_VX_DT(uint16_t opcode, Chip8 * cpu_reg);
-void LD_VX_K(uint16_t opcode, Chip8 * cpu_reg);
-void LD_DT_VX(uint16_t opcode, Chip8 * cpu_reg);
-void LD_ST_VX(uint16_t opcode, Chip8 * cpu_reg);
-void ADD_I_VX(uint16_t opcode, Chip8 * cpu_reg);
-void LD_F_VX(uint16_t opcode, Chip8 * cpu_reg);
-void LD_B_VX(uint16_t opcode, Chip8 * cpu_reg);
-void LD_I_VX(uint16_t opcode, Chip8 * cpu_reg);
-void LD_VX_I(uint16_t opcode, Chip8 * cpu_reg);
+void TRAP(const Instruction * ins, Chip8 * cpu_reg);
+void SYS_addr(const Instruction * ins, Chip8 * cpu_reg);
+void CLS(const Instruction * ins, Chip8 * cpu_reg);
+void RET(const Instruction * ins, Chip8 * cpu_reg);
+void JP_addr(const Instruction * ins, Chip8 * cpu_reg);
+void CALL_addr(const Instruction * ins, Chip8 * cpu_reg);
+void SE_VX_byte(const Instruction * ins, Chip8 * cpu_reg);
+void SNE_VX_byte(const Instruction * ins, Chip8 * cpu_reg);
+void SE_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void LD_VX_byte(const Instruction * ins, Chip8 * cpu_reg);
+void ADD_VX_byte(const Instruction * ins, Chip8 * cpu_reg);
+void LD_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void OR_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void AND_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void XOR_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void ADD_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void SUB_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void SUBN_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void SNE_VX_VY(const Instruction * ins, Chip8 * cpu_reg);
+void LD_I_addr(const Instruction * ins, Chip8 * cpu_reg);
+void RND_VX_byte(const Instruction * ins, Chip8 * cpu_reg);
+void SKP_VX(const Instruction * ins, Chip8 * cpu_reg);
+void SKNP_VX(const Instruction * ins, Chip8 * cpu_reg);
+void LD_VX_DT(const Instruction * ins, Chip8 * cpu_reg);
+void LD_VX_K(const Instruction * ins, Chip8 * cpu_reg);
+void LD_DT_VX(const Instruction * ins, Chip8 * cpu_reg);
+void LD_ST_VX(const Instruction * ins, Chip8 * cpu_reg);
+void ADD_I_VX(const Instruction * ins, Chip8 * cpu_reg);
+void LD_F_VX(const Instruction * ins, Chip8 * cpu_reg);
+void LD_B_VX(const Instruction * ins, Chip8 * cpu_reg);
+
+// Instructions that depend on the quirk profile; one copy per profile (quirks.h)
+#define QUIRK_HANDLERS(profile) \
+	void SHR_VX_VY_##profile(const Instruction * ins, Chip8 * cpu_reg); \
+	void SHL_VX_VY_##profile(const Instruction * ins, Chip8 * cpu_reg); \
+	void JP_V0_addr_##profile(const Instruction * ins, Chip8 * cpu_reg); \
+	void DRW_VX_VY_nibble_##profile(const Instruction * ins, Chip8 * cpu_reg); \
+	void LD_I_VX_##profile(const Instruction * ins, Chip8 * cpu_reg); \
+	void LD_VX_I_##profile(const Instruction * ins, Chip8 * cpu_reg);
+
+QUIRK_HANDLERS(vip)
+QUIRK_HANDLERS(chip48)
+QUIRK_HANDLERS(schip)
+QUIRK_HANDLERS(modern)
 
 
 #endif
\ No newline at end of file
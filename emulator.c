@@ -1,26 +1,183 @@
 // CHIP-8 Emulator
 #include "cpu.h"
 #include "emulator.h"
+#include "savestate.h"
+#include "inputlog.h"
+#include "audio.h"
+#ifdef CHIP8_PBO
+#define GL_GLEXT_PROTOTYPES   // glBindBuffer() and friends (GL 1.5)
+#endif
 #include "GL/glut.h"
-
-
-Chip8 cpu_reg;
-
-uint8_t memory[4096];
-uint8_t video_buffer[WIDTH * HEIGHT];
-uint16_t delay_timer;   // Used for timeing of game events
-uint16_t sound_timer;   // Used for sound effects; beeps when nonzero
-uint8_t keys[16];  // key states for hex keypad
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef CHIP8_AOT
+#include "aot.h"
+#endif
+
+
+#define FRAME_NS             16666667   // emulation thread period driving the 60 Hz frames
+#define MAX_FRAME_LAG        4          // frames behind before the schedule is reset rather than caught up
+#define SLACK_WINDOW         60         // frames summarized by each slack report
+#define PRESENT_POLL_MS      4          // how often the GLUT thread looks for a new frame
+#define TITLE_POLLS          250        // present_tick() calls between window title updates
+#define TURBO_SLICE_NS       12000000   // unthrottled turbo: emulation time per presented frame
+#define MAX_TURBO_SPEED      64         // fastest fixed turbo speed before unthrottled
+#define REWIND_BYTES         (8 << 20)  // rewind history kept, one capture per frame
+#define FRAME_FRESH          4          // frame_slot: the slot holds a frame display() hasn't taken
+#define KEY_QUEUE_SIZE       256        // key events in flight to the emulation thread (power of two)
+#define MIN_PRESS_FRAMES     3          // frames a tapped key stays down however soon it is released
+
+
+// One published screen. The emulation thread fills one, display() draws
+// another and the third sits in frame_slot, so neither side ever waits.
+typedef struct {
+	uint64_t video_buffer[HEIGHT];
+	uint32_t key_events;   // key events the machine had taken when the frame was published
+} Frame;
+
+// A key press or release, in the order GLUT delivered them
+typedef struct {
+	uint64_t time;   // monotonic_ns() when the callback ran
+	uint8_t key;   // hexpad key
+	uint8_t down;
+} HostKeyEvent;
+
+
+// Owned by the emulation thread
+Chip8 cpu_reg;   // the machine being displayed
+Rewind * rewind_buffer;
+uint8_t host_keys[16];   // keys as the events left them, copied into cpu_reg.keys every frame
+uint32_t held_frames[16];   // frames each key has been down
+uint8_t release_pending[16];   // released before MIN_PRESS_FRAMES: let go once it has been down long enough
+Audio * audio;   // buzzer output, NULL = silent
+uint64_t sound_frames_played;   // cpu_reg.sound_frames as of the last audio_frame()
+pthread_t emulation_thread;
+atomic_int emulating = 1;   // cleared to stop the emulation thread
+
+// Handed from the GLUT thread to the emulation thread
+HostKeyEvent key_queue[KEY_QUEUE_SIZE];   // single producer (GLUT thread), single consumer (emulation thread)
+atomic_uint key_queue_head;   // events taken by the emulation thread
+atomic_uint key_queue_tail;   // events queued by the GLUT thread
+atomic_uint dropped_key_events;   // queue was full
+atomic_int state_request;   // F5/F9 waiting to be done between frames (GLUT_KEY_F5/F9, or 0)
+atomic_int rewinding;   // backspace held: step back instead of running
+atomic_int turbo;   // Tab toggles: run turbo_speed frames per tick
+atomic_uint turbo_speed = 8;   // -t: frames per tick in turbo, 0 = as many as fit in TURBO_SLICE_NS
+
+// Emulation thread timing, shown in the window title
+atomic_int slack_us = -1;   // mean time left before the deadline over the last SLACK_WINDOW ticks, -1 = none yet
+atomic_int min_slack_us;   // least time left in that window; negative = finished late
+atomic_uint late_ticks;   // ticks that finished after their deadline, since startup
+
+// Triple buffer from the emulation thread to display()
+Frame frames[3];
+atomic_uint frame_slot = 1;   // published slot, | FRAME_FRESH until display() takes it
+uint32_t back_slot = 0;   // emulation thread's slot
+uint32_t front_slot = 2;   // display()'s slot
+
+// Owned by the GLUT thread
+uint64_t screen_rows[HEIGHT];   // the frame screen_pixels was expanded from
+uint32_t presented_events;   // key events reflected in a presented frame
+uint64_t latency_total;   // input-to-photon latency summed over latency_events (ns)
+uint64_t latency_max;
+uint32_t latency_events;
+GLuint screen_texture;   // WIDTH x HEIGHT luminance texture the screen is drawn from
+uint8_t screen_pixels[HEIGHT][WIDTH];   // the texture's contents, 0 or 255 per pixel
+#ifdef CHIP8_PBO
+GLuint screen_pbo;   // streaming pixel unpack buffer, 0 if the driver has none
+#endif
+char state_file[1024];   // F5 saves the machine here, F9 loads it
+
+const char * rom_file;
+uint32_t seed;   // seed_random() seed, printed so the run can be replayed
+const char * record_file;   // -r: where the input log goes on exit
+InputLog input_log;
 
 
 int main(int argc, char **argv) {
-	srand(time(NULL));
+	const char * rom = "Tetris.ch8";
+	int profile = QUIRKS_SCHIP;
+	uint32_t budget = DEFAULT_FRAME_BUDGET;
+	int vip_timing = 0;
+
+	seed = time(NULL);
+
+	const char * wav_file = NULL;
+
+	// Usage: chip8 [-q vip|chip48|schip|modern] [-s seed] [-c budget[c]] [-t speed] [-r input.keys] [-a sound.wav] [rom.ch8]
+	for (int i=1; i < argc; ++i) {
+		if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			profile = find_quirk_profile(argv[++i]);
+			if (profile == -1) {
+				fprintf(stderr, "unknown quirk profile: %s\n", argv[i]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			seed = strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			char * end;
+			budget = strtoul(argv[++i], &end, 0);
+			vip_timing = (*end == 'c');
+		}
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			turbo_speed = strtoul(argv[++i], NULL, 0);
+			turbo = 1;
+		}
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			record_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+			wav_file = argv[++i];
+		}
+		else if (argv[i][0] != '-') {
+			rom = argv[i];
+		}
+	}
 	
 	initialize_cpu(&cpu_reg);
+	seed_random(&cpu_reg, seed);
+	set_frame_budget(&cpu_reg, budget, vip_timing);
+	rom_file = rom;
+
+#ifdef CHIP8_AOT
+	// Use the ROM that was compiled into the binary, with the quirks it was compiled for
+	set_quirk_profile(&cpu_reg, aot_quirk_profile);
+	set_frame_budget(&cpu_reg, vip_timing ? DEFAULT_FRAME_BUDGET : budget, 0);   // blocks don't charge VIP cycles
+	memcpy(cpu_reg.memory + PROGRAM_START, aot_rom, aot_rom_size);
+	invalidate_icache(&cpu_reg, PROGRAM_START, aot_rom_size);
+#else
+	set_quirk_profile(&cpu_reg, profile);
 
 	// Attempt to load ROM file. If file fails to open, terminate program
-	if (load_program("Tetris.ch8", memory + PROGRAM_START) == -1)
+	if (load_program(&cpu_reg, rom) == -1)
+		exit(1);
+#endif
+
+	snprintf(state_file, sizeof(state_file), "%s.state", rom);
+	rewind_buffer = rewind_create(REWIND_BYTES);
+	if (rewind_buffer == NULL)
 		exit(1);
+	rewind_capture(rewind_buffer, &cpu_reg);
+
+	// sound goes to the WAV file given with -a, else to the sound card if built with ALSA
+	if (wav_file != NULL)
+		audio = audio_open_wav(wav_file);
+#ifdef CHIP8_ALSA
+	else
+		audio = audio_open_alsa("default");
+#endif
+	if (audio == NULL && wav_file != NULL)
+		fprintf(stderr, "couldn't write %s\n", wav_file);
+
+	if (record_file != NULL)
+		atexit(finish_recording);
+	atexit(stop_audio);
+	atexit(stop_emulation);   // runs first: finish_recording() reads the machine
+	atexit(report_latency);
 
 	// Initialize GLUT and create the window
 	glutInit(&argc, argv);
@@ -30,12 +187,17 @@ int main(int argc, char **argv) {
 	glutCreateWindow("CHIP-8 Emulator");
 
 	initGLUT();
+	show_speed();
 
 	// Set callback functions
 	glutKeyboardFunc(key_down);
 	glutKeyboardUpFunc(key_up);
+	glutSpecialFunc(special_key_down);
 	glutDisplayFunc(display);
-	glutIdleFunc(idle);
+	glutTimerFunc(PRESENT_POLL_MS, present_tick, 0);
+
+	if (pthread_create(&emulation_thread, NULL, emulation_main, NULL) != 0)
+		exit(1);
 
 	glutMainLoop();
 
@@ -43,86 +205,454 @@ int main(int argc, char **argv) {
 }
 
 
+/*
+ *	monotonic_ns()
+ *	Inputs: None
+ *	Return Value: Nanoseconds on the monotonic clock
+ */
+static uint64_t monotonic_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*
+ *	sleep_until()
+ *	Inputs: deadline - Time to wake up, as returned by monotonic_ns()
+ *	Return Value: None
+ */
+static void sleep_until(uint64_t deadline) {
+	struct timespec wake = { deadline / 1000000000, deadline % 1000000000 };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+		;
+}
+
+
 /*
  *	display()
  *	Inputs: None
  *	Return Value: None
- *	Function: 
+ *	Function: Redraws the screen from the newest frame the emulation thread
+ *	          published. Never touches the machine, so a slow swap can't
+ *	          hold up emulation.
  */
 void display() {
-	// execute one cpu cycle
-	fde_cycle(&cpu_reg);
+	if (atomic_load(&frame_slot) & FRAME_FRESH)
+		front_slot = atomic_exchange(&frame_slot, front_slot) & ~FRAME_FRESH;
 
-	draw_screen();
+	draw_screen(frames[front_slot].video_buffer);
+	measure_latency(frames[front_slot].key_events);
 }
 
 
 /*
- *	draw_screen()
+ *	measure_latency()
+ *	Inputs: key_events - Key events the presented frame reflects
+ *	Return Value: None
+ *	Function: Adds the time from each key event to the swap of the first
+ *	          changed frame the machine ran after taking it to the
+ *	          input-to-photon latency figures. Runs on the GLUT thread, which
+ *	          queued the events, so their times are still in key_queue.
+ */
+void measure_latency(uint32_t key_events) {
+	uint64_t now = monotonic_ns();
+	uint32_t tail = atomic_load_explicit(&key_queue_tail, memory_order_relaxed);
+
+	for (; presented_events != key_events; ++presented_events) {
+		if (tail - presented_events > KEY_QUEUE_SIZE)
+			continue;   // slot already reused
+
+		uint64_t latency = now - key_queue[presented_events % KEY_QUEUE_SIZE].time;
+		latency_total += latency;
+		if (latency > latency_max)
+			latency_max = latency;
+		latency_events++;
+	}
+}
+
+
+/*
+ *	report_latency()
  *	Inputs: None
  *	Return Value: None
- *	Function: Draw to the window screen
+ *	Function: Prints the input-to-photon latency figures on exit
  */
-void draw_screen() {
-	glClear(GL_COLOR_BUFFER_BIT);  // clear the screen
-	glLoadIdentity();  // reset the view
-	glColor3f(1.0, 1.0, 1.0);
+void report_latency() {
+	if (latency_events == 0)
+		return;
+
+	fprintf(stderr, "input-to-photon latency: %u key events, mean %.1f ms, max %.1f ms, %u dropped\n",
+	        latency_events, latency_total / 1e6 / latency_events, latency_max / 1e6,
+	        atomic_load(&dropped_key_events));
+}
+
+
+/*
+ *	present_tick()
+ *	Inputs: value - Unused
+ *	Return Value: None
+ *	Function: Asks GLUT for a re-paint when a new frame has been published
+ *	          (glutPostRedisplay() can only be called from the GLUT thread)
+ *	          and refreshes the timing in the window title once a second
+ */
+void present_tick(int value) {
+	static uint32_t polls;
 
+	glutTimerFunc(PRESENT_POLL_MS, present_tick, 0);
+
+	if (++polls % TITLE_POLLS == 0)
+		show_speed();
+
+	if (atomic_load(&frame_slot) & FRAME_FRESH)
+		glutPostRedisplay();
+}
+
+
+/*
+ *	draw_screen()
+ *	Inputs: video_buffer - Screen to draw, one uint64_t per row
+ *	Return Value: None
+ *	Function: Expands the rows that differ from the last call into
+ *	          screen_pixels, uploads the texture with one glTexSubImage2D
+ *	          (through the PBO when there is one) and draws it as a single
+ *	          nearest-filtered quad, so a present costs the same however
+ *	          many pixels are lit
+ */
+void draw_screen(const uint64_t * video_buffer) {
 	for (int i=0; i < HEIGHT; ++i) {
-		for (int j=0; j < WIDTH; ++j) {
-			if (video_buffer[j + i*WIDTH] == 1) {
-				float x = j * 10;
-				float y = i * 10;
-
-				// draw the pixel
-				glBegin(GL_QUADS);
-					glVertex3f(x, y, 0.0);
-					glVertex3f(x + 10, y, 0.0);
-					glVertex3f(x + 10, y + 10, 0.0);
-					glVertex3f(x, y + 10, 0.0);
-				glEnd();
-			}
-		}
+		if (video_buffer[i] == screen_rows[i])
+			continue;
+
+		screen_rows[i] = video_buffer[i];
+		for (int j=0; j < WIDTH; ++j)
+			screen_pixels[i][j] = -(uint8_t)((video_buffer[i] >> (WIDTH - 1 - j)) & 1);
 	}
 
+	glBindTexture(GL_TEXTURE_2D, screen_texture);
+#ifdef CHIP8_PBO
+	if (screen_pbo != 0) {
+		// orphan last frame's storage so the map never waits on the GPU
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, screen_pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, sizeof(screen_pixels), NULL, GL_STREAM_DRAW);
+		void * buffer = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		if (buffer != NULL) {
+			memcpy(buffer, screen_pixels, sizeof(screen_pixels));
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_LUMINANCE, GL_UNSIGNED_BYTE, 0);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (buffer == NULL)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_LUMINANCE, GL_UNSIGNED_BYTE, screen_pixels);
+	} else
+#endif
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_LUMINANCE, GL_UNSIGNED_BYTE, screen_pixels);
+
+	glLoadIdentity();  // reset the view
+	glBegin(GL_QUADS);
+		glTexCoord2f(0.0, 0.0); glVertex2f(0.0, 0.0);
+		glTexCoord2f(1.0, 0.0); glVertex2f(WIDTH * 10, 0.0);
+		glTexCoord2f(1.0, 1.0); glVertex2f(WIDTH * 10, HEIGHT * 10);
+		glTexCoord2f(0.0, 1.0); glVertex2f(0.0, HEIGHT * 10);
+	glEnd();
+
 	glutSwapBuffers();
 }
 
 
 /*
- *	idle()
+ *	emulate_frame()
  *	Inputs: None
  *	Return Value: None
- *	Function: Post a re-paint request to activate display()
+ *	Function: Runs one 60 Hz frame (or, while rewinding, goes back one),
+ *	          with the keys as of the key events queued before it started.
+ *	          Rows it changes are added to cpu_reg.dirty_rows.
  */
-void idle() {
-   glutPostRedisplay();
+void emulate_frame() {
+	take_key_events();
+	memcpy(cpu_reg.keys, host_keys, sizeof(host_keys));
+
+	if (atomic_load(&rewinding)) {
+		rewind_step_back(rewind_buffer, &cpu_reg);
+		input_log_truncate(&input_log, &cpu_reg);
+		return;
+	}
+
+	if (record_file != NULL)
+		input_log_record(&input_log, &cpu_reg);
+
+	// a machine halted in FX0A can't change the screen: only its timers tick
+	if (waiting_for_key(&cpu_reg)) {
+		run_frame(&cpu_reg);
+		rewind_capture(rewind_buffer, &cpu_reg);
+		return;
+	}
+
+#ifdef CHIP8_AOT
+	// compiled blocks don't charge VIP cycles, so the budget is instructions
+	aot_run(&cpu_reg, cpu_reg.frame_budget);
+	end_frame(&cpu_reg);
+#else
+	run_frame(&cpu_reg);
+#endif
+
+	rewind_capture(rewind_buffer, &cpu_reg);
 }
 
 
 /*
- *	load_program()
- *	Inputs: filename - Name of the ROM file to be loaded
- *	        mem_loc - Location in RAM where the ROM is to be read into
- *	Return Value: Returns 0 if file is read into ROM successfully;
- *	              returns -1 on failure
- *	Function: Attempts to open the given filename and load it into RAM
+ *	note_slack()
+ *	Inputs: slack - Time left before the tick's deadline when its work was
+ *	                done, in nanoseconds (negative = late)
+ *	Return Value: None
+ *	Function: Publishes the mean and least slack of every SLACK_WINDOW ticks
+ */
+void note_slack(int64_t slack) {
+	static int64_t sum, least;
+	static uint32_t ticks;
+
+	if (ticks == 0 || slack < least)
+		least = slack;
+	sum += slack;
+	if (slack < 0)
+		atomic_fetch_add(&late_ticks, 1);
+
+	if (++ticks == SLACK_WINDOW) {
+		atomic_store(&slack_us, sum / SLACK_WINDOW / 1000);
+		atomic_store(&min_slack_us, least / 1000);
+		sum = 0;
+		ticks = 0;
+	}
+}
+
+
+/*
+ *	queue_key()
+ *	Inputs: key - Hexpad key
+ *	        down - 1 for a press, 0 for a release
+ *	Return Value: None
+ *	Function: Time-stamps a key event from a GLUT callback and hands it to
+ *	          the emulation thread
+ */
+void queue_key(uint8_t key, uint8_t down) {
+	uint32_t tail = atomic_load_explicit(&key_queue_tail, memory_order_relaxed);
+
+	if (tail - atomic_load_explicit(&key_queue_head, memory_order_acquire) == KEY_QUEUE_SIZE) {
+		atomic_fetch_add(&dropped_key_events, 1);
+		return;
+	}
+
+	key_queue[tail % KEY_QUEUE_SIZE] = (HostKeyEvent){ monotonic_ns(), key, down };
+	atomic_store_explicit(&key_queue_tail, tail + 1, memory_order_release);
+}
+
+
+/*
+ *	take_key_events()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Applies the queued key events to host_keys at the start of a
+ *	          frame, in order. A key released before it has been down for
+ *	          MIN_PRESS_FRAMES frames stays down until it has, so a tap
+ *	          shorter than a frame can't fall between two polls.
  */
-int load_program(const char *filename, uint8_t *mem_loc) {
-	FILE * f;
-	f = fopen(filename,"r");
-
-	if (f != NULL) {
-		if (fseek(f, 0, SEEK_END) == 0) {
-			uint32_t file_size = ftell(f);
-			fseek(f, 0, SEEK_SET);   // go back to beginning of file
-			fread(mem_loc, sizeof(uint16_t), file_size, f);
-			fclose(f);
-			return 0;
+void take_key_events() {
+	uint32_t head = atomic_load_explicit(&key_queue_head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&key_queue_tail, memory_order_acquire);
+
+	for (int k=0; k < 16; ++k) {
+		held_frames[k] += host_keys[k];
+		if (release_pending[k] && held_frames[k] >= MIN_PRESS_FRAMES)
+			host_keys[k] = release_pending[k] = 0;
+	}
+
+	for (; head != tail; ++head) {
+		const HostKeyEvent * event = &key_queue[head % KEY_QUEUE_SIZE];
+		uint8_t k = event->key;
+
+		if (event->down) {
+			if (!host_keys[k])
+				held_frames[k] = 0;
+			host_keys[k] = 1;
+			release_pending[k] = 0;
+		} else if (host_keys[k] && held_frames[k] < MIN_PRESS_FRAMES) {
+			release_pending[k] = 1;
+		} else {
+			host_keys[k] = 0;
 		}
 	}
 
-	return -1;
+	atomic_store_explicit(&key_queue_head, head, memory_order_release);
+}
+
+
+/*
+ *	publish_frame()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Copies the screen into the emulation thread's slot and swaps
+ *	          it with the published one, which display() picks up next
+ */
+void publish_frame() {
+	memcpy(frames[back_slot].video_buffer, cpu_reg.video_buffer, sizeof(cpu_reg.video_buffer));
+	frames[back_slot].key_events = atomic_load_explicit(&key_queue_head, memory_order_relaxed);
+	back_slot = atomic_exchange(&frame_slot, back_slot | FRAME_FRESH) & ~FRAME_FRESH;
+	cpu_reg.dirty_rows = 0;
+}
+
+
+/*
+ *	take_state_request()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Does the F5 save or F9 load asked for since the last frame
+ */
+void take_state_request() {
+	switch (atomic_exchange(&state_request, 0)) {
+	case GLUT_KEY_F5:
+		if (save_state_file(&cpu_reg, state_file) == -1)
+			fprintf(stderr, "couldn't save %s\n", state_file);
+		break;
+	case GLUT_KEY_F9:
+		if (load_state_file(&cpu_reg, state_file) == -1) {
+			fprintf(stderr, "couldn't load %s\n", state_file);
+			break;
+		}
+		rewind_clear(rewind_buffer);
+		rewind_capture(rewind_buffer, &cpu_reg);
+
+		// the log can't replay a jump to another state, so end it here
+		finish_recording();
+		break;
+	default:
+		break;
+	}
+}
+
+
+/*
+ *	emulation_main()
+ *	Inputs: arg - Unused
+ *	Return Value: NULL
+ *	Function: The emulation thread. Every FRAME_NS it runs one frame, or in
+ *	          turbo turbo_speed frames (unthrottled: as many as fit in
+ *	          TURBO_SLICE_NS, back to back), publishes the screen if any
+ *	          row changed and sleeps until the next deadline. Deadlines are
+ *	          absolute, so time spent working doesn't add up into drift, and
+ *	          a late tick is made up by starting the next one at once;
+ *	          after falling more than MAX_FRAME_LAG frames behind (e.g.
+ *	          stopped in a debugger) the schedule starts over instead.
+ *	          Keys pressed during a frame take effect at the start of the
+ *	          next one.
+ */
+void * emulation_main(void * arg) {
+	uint64_t deadline = monotonic_ns();
+
+	while (atomic_load(&emulating)) {
+		int turbo_on = atomic_load(&turbo);
+		uint32_t speed = atomic_load(&turbo_speed);
+		int unthrottled = turbo_on && speed == 0;
+		uint32_t frames = turbo_on ? speed : 1;
+		uint64_t start = monotonic_ns();
+
+		take_state_request();
+
+		for (uint32_t n=0; unthrottled ? monotonic_ns() - start < TURBO_SLICE_NS : n < frames; ++n)
+			emulate_frame();
+
+		if (cpu_reg.dirty_rows)
+			publish_frame();
+
+		// one frame of sound per tick, so turbo doesn't flood the ring
+		if (audio != NULL && !unthrottled) {
+			audio_frame(audio, cpu_reg.sound_frames != sound_frames_played);
+			sound_frames_played = cpu_reg.sound_frames;
+		}
+
+		uint64_t now = monotonic_ns();
+		if (unthrottled) {
+			deadline = now;
+			continue;
+		}
+
+		deadline += FRAME_NS;
+		int64_t slack = (int64_t)(deadline - now);
+		note_slack(slack);
+
+		if (slack < -(int64_t)MAX_FRAME_LAG * FRAME_NS)
+			deadline = now;
+		else if (slack > 0)
+			sleep_until(deadline);
+	}
+
+	return NULL;
+}
+
+
+/*
+ *	stop_audio()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Prints the audio counters and closes the sink, once the
+ *	          emulation thread has stopped feeding it
+ */
+void stop_audio() {
+	AudioStats stats;
+
+	if (audio == NULL)
+		return;
+
+	audio_stats(audio, &stats);
+	fprintf(stderr, "audio: %llu frames, %u underruns, %u dropped frames, %u device underruns\n",
+	        (unsigned long long)stats.frames, stats.underruns, stats.overruns, stats.device_underruns);
+	audio_close(audio);
+	audio = NULL;
+}
+
+
+/*
+ *	stop_emulation()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Waits for the emulation thread to finish its frame and exit
+ */
+void stop_emulation() {
+	atomic_store(&emulating, 0);
+	pthread_join(emulation_thread, NULL);
+}
+
+
+/*
+ *	show_speed()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Puts the turbo setting and the emulation thread's frame slack
+ *	          (mean / least time to spare before each deadline over the
+ *	          last second, and late ticks so far) and the input-to-photon
+ *	          latency so far in the window title
+ */
+void show_speed() {
+	char title[160];
+	char slack[96] = "";
+	int mean = atomic_load(&slack_us);
+
+	if (mean != -1 && !(turbo && turbo_speed == 0))
+		snprintf(slack, sizeof(slack), " [slack: %.1f / %.1f ms, %u late]",
+		         mean / 1000.0, atomic_load(&min_slack_us) / 1000.0, atomic_load(&late_ticks));
+	if (latency_events != 0)
+		snprintf(slack + strlen(slack), sizeof(slack) - strlen(slack), " [input: %.1f ms, max %.1f]",
+		         latency_total / 1e6 / latency_events, latency_max / 1e6);
+
+	if (!turbo)
+		snprintf(title, sizeof(title), "CHIP-8 Emulator%s", slack);
+	else if (turbo_speed == 0)
+		snprintf(title, sizeof(title), "CHIP-8 Emulator [turbo: unthrottled]");
+	else
+		snprintf(title, sizeof(title), "CHIP-8 Emulator [turbo: %ux]%s", turbo_speed, slack);
+
+	glutSetWindowTitle(title);
 }
 
 
@@ -136,53 +666,69 @@ int load_program(const char *filename, uint8_t *mem_loc) {
  */
 void key_down(unsigned char key, int x, int y) {
 	switch(key) {
+	case '\b':
+		rewinding = 1;
+		break;
+	case '\t':
+		turbo = !turbo;
+		show_speed();
+		break;
+	case '=':   // faster turbo; past MAX_TURBO_SPEED it's unthrottled
+		if (turbo_speed != 0)
+			turbo_speed = (turbo_speed < MAX_TURBO_SPEED) ? turbo_speed * 2 : 0;
+		show_speed();
+		break;
+	case '-':
+		turbo_speed = (turbo_speed == 0) ? MAX_TURBO_SPEED : (turbo_speed > 1) ? turbo_speed / 2 : 1;
+		show_speed();
+		break;
 	case '1':
-		keys[0x0] = 1;
+		queue_key(0x0, 1);
 		break;
 	case '2':
-		keys[0x1] = 1;
+		queue_key(0x1, 1);
 		break;
 	case '3':
-		keys[0x2] = 1;
+		queue_key(0x2, 1);
 		break;
 	case '4':
-		keys[0x3] = 1;
+		queue_key(0x3, 1);
 		break;
 	case 'q':
-		keys[0x4] = 1;
+		queue_key(0x4, 1);
 		break;
 	case 'w':
-		keys[0x5] = 1;
+		queue_key(0x5, 1);
 		break;
 	case 'e':
-		keys[0x6] = 1;
+		queue_key(0x6, 1);
 		break;
 	case 'r':
-		keys[0x7] = 1;
+		queue_key(0x7, 1);
 		break;
 	case 'a':
-		keys[0x8] = 1;
+		queue_key(0x8, 1);
 		break;
 	case 's':
-		keys[0x9] = 1;
+		queue_key(0x9, 1);
 		break;
 	case 'd':
-		keys[0xA] = 1;
+		queue_key(0xA, 1);
 		break;
 	case 'f':
-		keys[0xB] = 1;
+		queue_key(0xB, 1);
 		break;
 	case 'z':
-		keys[0xC] = 1;
+		queue_key(0xC, 1);
 		break;
 	case 'x':
-		keys[0xD] = 1;
+		queue_key(0xD, 1);
 		break;
 	case 'c':
-		keys[0xE] = 1;
+		queue_key(0xE, 1);
 		break;
 	case 'v':
-		keys[0xF] = 1;
+		queue_key(0xF, 1);
 		break;
 	default:
 		break;
@@ -200,53 +746,56 @@ void key_down(unsigned char key, int x, int y) {
  */
 void key_up(unsigned char key, int x, int y) {
 	switch(key) {
+	case '\b':
+		rewinding = 0;
+		break;
 	case '1':
-		keys[0x0] = 0;
+		queue_key(0x0, 0);
 		break;
 	case '2':
-		keys[0x1] = 0;
+		queue_key(0x1, 0);
 		break;
 	case '3':
-		keys[0x2] = 0;
+		queue_key(0x2, 0);
 		break;
 	case '4':
-		keys[0x3] = 0;
+		queue_key(0x3, 0);
 		break;
 	case 'q':
-		keys[0x4] = 0;
+		queue_key(0x4, 0);
 		break;
 	case 'w':
-		keys[0x5] = 0;
+		queue_key(0x5, 0);
 		break;
 	case 'e':
-		keys[0x6] = 0;
+		queue_key(0x6, 0);
 		break;
 	case 'r':
-		keys[0x7] = 0;
+		queue_key(0x7, 0);
 		break;
 	case 'a':
-		keys[0x8] = 0;
+		queue_key(0x8, 0);
 		break;
 	case 's':
-		keys[0x9] = 0;
+		queue_key(0x9, 0);
 		break;
 	case 'd':
-		keys[0xA] = 0;
+		queue_key(0xA, 0);
 		break;
 	case 'f':
-		keys[0xB] = 0;
+		queue_key(0xB, 0);
 		break;
 	case 'z':
-		keys[0xC] = 0;
+		queue_key(0xC, 0);
 		break;
 	case 'x':
-		keys[0xD] = 0;
+		queue_key(0xD, 0);
 		break;
 	case 'c':
-		keys[0xE] = 0;
+		queue_key(0xE, 0);
 		break;
 	case 'v':
-		keys[0xF] = 0;
+		queue_key(0xF, 0);
 		break;
 	default:
 		break;
@@ -254,6 +803,45 @@ void key_up(unsigned char key, int x, int y) {
 }
 
 
+/*
+ *	special_key_down()
+ *	Inputs: key - GLUT_KEY_* code of the key pressed in the window
+ *	        x - Unused
+ *	        y - Unused
+ *	Return Value: None
+ *	Function: F5 saves the machine to <rom>.state, F9 loads it back
+ */
+void special_key_down(int key, int x, int y) {
+	// the emulation thread does it between frames
+	if (key == GLUT_KEY_F5 || key == GLUT_KEY_F9)
+		atomic_store(&state_request, key);
+}
+
+
+/*
+ *	finish_recording()
+ *	Inputs: None
+ *	Return Value: None
+ *	Function: Writes the input log recorded so far (-r) and prints the
+ *	          chip8-batch manifest line that replays the session
+ */
+void finish_recording() {
+	if (record_file == NULL)
+		return;
+
+	if (input_log_save(&input_log, record_file) == -1) {
+		fprintf(stderr, "couldn't write %s\n", record_file);
+	} else {
+		fprintf(stderr, "replay manifest line: %s %llu %s %s %u %u%s\n", rom_file,
+		        (unsigned long long)cpu_reg.instructions_retired, record_file,
+		        quirk_profile_name(get_quirk_profile(&cpu_reg)), seed,
+		        cpu_reg.frame_budget, cpu_reg.vip_timing ? "c" : "");
+	}
+
+	record_file = NULL;
+}
+
+
 /*
  *	initGLUT()
  *	Inputs: None
@@ -270,6 +858,23 @@ void initGLUT() {
 
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
+
+	// the screen is one WIDTH x HEIGHT texture, scaled up without blurring
+	glGenTextures(1, &screen_texture);
+	glBindTexture(GL_TEXTURE_2D, screen_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, WIDTH, HEIGHT, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, screen_pixels);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	glEnable(GL_TEXTURE_2D);
+
+#ifdef CHIP8_PBO
+	if (glutExtensionSupported("GL_ARB_pixel_buffer_object"))
+		glGenBuffers(1, &screen_pbo);
+#endif
 }
 
 
@@ -289,5 +894,5 @@ void hex_dump_ROM(int file_size) {
 	int s = PROGRAM_START;
 
 	for (int i=0; i < file_size; i+=2)
-		printf("%02X%02X\n",memory[s+i],memory[s+i+1]);
+		printf("%02X%02X\n",cpu_reg.memory[s+i],cpu_reg.memory[s+i+1]);
 }
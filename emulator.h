@@ -1,15 +1,30 @@
 #ifndef _EMULATOR_H_
 #define _EMULATOR_H_
 
+#include "cpu.h"
+
 
-int load_program(const char *filename, uint8_t *mem_loc);
 void hex_dump_ROM(int file_size);
 void key_down(unsigned char key, int x, int y);
 void key_up(unsigned char key, int x, int y);
+void special_key_down(int key, int x, int y);
+void finish_recording(void);
 
 void initGLUT(void);
 void display(void);
-void draw_screen(void);
-void idle(void);
+void measure_latency(uint32_t key_events);
+void report_latency(void);
+void present_tick(int value);
+void draw_screen(const uint64_t * video_buffer);
+void emulate_frame(void);
+void queue_key(uint8_t key, uint8_t down);
+void take_key_events(void);
+void publish_frame(void);
+void take_state_request(void);
+void * emulation_main(void * arg);
+void note_slack(int64_t slack);
+void stop_audio(void);
+void stop_emulation(void);
+void show_speed(void);
 
 #endif
\ No newline at end of file
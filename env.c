@@ -0,0 +1,225 @@
+// CHIP-8 batched environments for reinforcement learning
+//
+// Steps a batch of headless machines running the same ROM together: each
+// env_step() takes one action per environment, turns it into the key
+// state, runs one frame of cycles_per_step instructions (see run_frame())
+// and reports a reward and status.
+// Environments whose episode ended are reset before env_step() returns
+// (the status still says how it ended), so a caller only ever sees
+// observations of running episodes.
+//
+// Observations are views straight into each machine's bit-packed video
+// buffer; nothing is copied unless env_observation_pixels() is asked to
+// unpack one.
+#include "env.h"
+
+
+struct env_batch {
+	EnvConfig config;
+	uint32_t count;
+
+	Chip8 * machines;
+	CpuState initial;   // machine just after the ROM was loaded
+	uint32_t * episode_steps;
+	uint32_t * episodes;   // episodes each environment has started
+};
+
+
+static const uint16_t default_action_keys[ENV_DEFAULT_ACTIONS] = {
+	0x0000,
+	0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+	0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, 0x8000
+};
+
+
+/*
+ *	halted()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	Return Value: 1 if the machine is stuck on a jump to itself; 0 otherwise
+ *	Function: ROMs commonly end with 1NNN pointing at its own address
+ */
+static int halted(const Chip8 * cpu_reg) {
+	uint16_t pc = cpu_reg->pc;
+
+	if (pc & 1 || pc >= MEMORY_SIZE)
+		return 0;
+
+	return (cpu_reg->memory[pc] == (0x10 | (pc >> 8))) && (cpu_reg->memory[pc + 1] == (pc & 0xFF));
+}
+
+
+/*
+ *	env_create()
+ *	Inputs: config - Settings for every environment (copied)
+ *	        count - Number of environments
+ *	Return Value: New batch, with every environment reset; NULL if the ROM
+ *	              can't be loaded or memory runs out
+ */
+EnvBatch * env_create(const EnvConfig * config, uint32_t count) {
+	EnvBatch * envs = calloc(1, sizeof(EnvBatch));
+
+	if (envs == NULL || count == 0)
+		goto fail;
+
+	envs->config = *config;
+	envs->count = count;
+	if (envs->config.cycles_per_step == 0)
+		envs->config.cycles_per_step = DEFAULT_FRAME_BUDGET;
+	if (envs->config.action_keys == NULL) {
+		envs->config.action_keys = default_action_keys;
+		envs->config.action_count = ENV_DEFAULT_ACTIONS;
+	}
+
+	envs->machines = calloc(count, sizeof(Chip8));
+	envs->episode_steps = calloc(count, sizeof(uint32_t));
+	envs->episodes = calloc(count, sizeof(uint32_t));
+	if (envs->machines == NULL || envs->episode_steps == NULL || envs->episodes == NULL)
+		goto fail;
+
+	// load the ROM into the first machine for the snapshot every reset goes back to
+	Chip8 * first = &envs->machines[0];
+	set_quirk_profile(first, config->profile);
+	initialize_cpu(first);
+	if (load_program(first, config->rom) == -1)
+		goto fail;
+	save_cpu_state(first, &envs->initial);
+
+	env_reset_all(envs);
+	return envs;
+
+fail:
+	env_destroy(envs);
+	return NULL;
+}
+
+
+void env_destroy(EnvBatch * envs) {
+	if (envs == NULL)
+		return;
+
+	free(envs->machines);
+	free(envs->episode_steps);
+	free(envs->episodes);
+	free(envs);
+}
+
+
+uint32_t env_count(const EnvBatch * envs) {
+	return envs->count;
+}
+
+
+uint32_t env_action_count(const EnvBatch * envs) {
+	return envs->config.action_count;
+}
+
+
+/*
+ *	env_reset()
+ *	Inputs: envs - Environment batch
+ *	        env - Environment number
+ *	Return Value: None
+ *	Function: Starts a new episode: puts the machine back to how it was
+ *	          just after loading, with a fresh seed. After the first episode
+ *	          only the memory the last one wrote is copied back.
+ */
+void env_reset(EnvBatch * envs, uint32_t env) {
+	Chip8 * cpu_reg = &envs->machines[env];
+
+	if (envs->episodes[env] == 0) {
+		set_quirk_profile(cpu_reg, envs->config.profile);
+		initialize_cpu(cpu_reg);
+		restore_cpu_state(cpu_reg, &envs->initial);
+	} else {
+		reset_cpu_state(cpu_reg, &envs->initial);
+	}
+
+	reset_counters(cpu_reg);
+	set_frame_budget(cpu_reg, envs->config.cycles_per_step, 0);
+	seed_random(cpu_reg, envs->config.seed + env * 0x9E3779B9u + envs->episodes[env] * 0x85EBCA6Bu);
+
+	envs->episodes[env]++;
+	envs->episode_steps[env] = 0;
+}
+
+
+void env_reset_all(EnvBatch * envs) {
+	for (uint32_t env=0; env < envs->count; ++env)
+		env_reset(envs, env);
+}
+
+
+/*
+ *	env_step()
+ *	Inputs: envs - Environment batch
+ *	        actions - One action per environment (out of range = no keys)
+ *	        rewards - Filled with each environment's reward (may be NULL)
+ *	        status - Filled with each environment's EnvStatus (may be NULL)
+ *	Return Value: None
+ *	Function: Holds each action's keys down for one frame. Environments
+ *	          that finished are reset.
+ */
+void env_step(EnvBatch * envs, const uint32_t * actions, float * rewards, uint8_t * status) {
+	const EnvConfig * config = &envs->config;
+
+	for (uint32_t env=0; env < envs->count; ++env) {
+		Chip8 * cpu_reg = &envs->machines[env];
+		uint16_t keys = (actions[env] < config->action_count) ? config->action_keys[actions[env]] : 0;
+		EnvStatus result = ENV_RUNNING;
+
+		for (int k=0; k < 16; ++k)
+			cpu_reg->keys[k] = (keys >> k) & 1;
+
+		run_frame(cpu_reg);
+		envs->episode_steps[env]++;
+
+		if (rewards != NULL)
+			rewards[env] = config->reward ? config->reward(cpu_reg, config->data) : 0.0f;
+
+		if (halted(cpu_reg) || (config->is_done && config->is_done(cpu_reg, config->data)))
+			result = ENV_TERMINATED;
+		else if (config->max_episode_steps && envs->episode_steps[env] >= config->max_episode_steps)
+			result = ENV_TRUNCATED;
+
+		if (status != NULL)
+			status[env] = result;
+		if (result != ENV_RUNNING)
+			env_reset(envs, env);
+	}
+}
+
+
+/*
+ *	env_observation()
+ *	Inputs: envs - Environment batch
+ *	        env - Environment number
+ *	Return Value: View of the environment's screen (see EnvObservation)
+ */
+EnvObservation env_observation(const EnvBatch * envs, uint32_t env) {
+	EnvObservation obs = { envs->machines[env].video_buffer, WIDTH, HEIGHT };
+	return obs;
+}
+
+
+/*
+ *	env_observation_pixels()
+ *	Inputs: envs - Environment batch
+ *	        env - Environment number
+ *	        pixels - Filled with WIDTH * HEIGHT bytes, row by row, 1 = on
+ *	Return Value: None
+ */
+void env_observation_pixels(const EnvBatch * envs, uint32_t env, uint8_t * pixels) {
+	unpack_video(&envs->machines[env], pixels);
+}
+
+
+/*
+ *	env_machine()
+ *	Inputs: envs - Environment batch
+ *	        env - Environment number
+ *	Return Value: The environment's machine, e.g. to read a score from memory.
+ *	              Memory written directly (not by the ROM) may survive resets.
+ */
+Chip8 * env_machine(EnvBatch * envs, uint32_t env) {
+	return &envs->machines[env];
+}
@@ -0,0 +1,66 @@
+#ifndef _ENV_H_
+#define _ENV_H_
+
+#include "cpu.h"
+
+
+#define ENV_DEFAULT_ACTIONS  17   // no key, then each key 0-F on its own
+
+
+/*
+ *  How an environment's episode stands after env_step()
+ */
+typedef enum env_status {
+	ENV_RUNNING,
+	ENV_TERMINATED,   // is_done() said so, or the ROM jumped to itself and halted
+	ENV_TRUNCATED   // hit max_episode_steps
+} EnvStatus;
+
+/*
+ *  Settings shared by every environment in a batch
+ */
+typedef struct env_config {
+	const char * rom;
+	QuirkProfile profile;
+	uint32_t cycles_per_step;   // instructions per env_step(), which runs one frame; 0 = DEFAULT_FRAME_BUDGET
+	uint32_t max_episode_steps;   // 0 = no limit
+	unsigned int seed;   // episode seeds are derived from this, the environment and the episode number
+
+	// Key mask (bit n = key n pressed) for each action. NULL uses the
+	// ENV_DEFAULT_ACTIONS table: action 0 presses nothing, action n key n-1.
+	const uint16_t * action_keys;
+	uint32_t action_count;
+
+	// Optional, called after every step before any reset
+	float (*reward)(const Chip8 * cpu_reg, void * data);
+	int (*is_done)(const Chip8 * cpu_reg, void * data);
+	void * data;
+} EnvConfig;
+
+/*
+ *  View of an environment's screen. The rows are the machine's own video
+ *  buffer (one uint64_t per row, bit 63 = leftmost pixel, 1 = on), so it
+ *  stays valid, and current, for the life of the batch. Use
+ *  env_observation_pixels() for one byte per pixel instead.
+ */
+typedef struct env_observation {
+	const uint64_t * rows;
+	uint16_t width;
+	uint16_t height;
+} EnvObservation;
+
+typedef struct env_batch EnvBatch;   // environments stepped together
+
+
+EnvBatch * env_create(const EnvConfig * config, uint32_t count);
+void env_destroy(EnvBatch * envs);
+uint32_t env_count(const EnvBatch * envs);
+uint32_t env_action_count(const EnvBatch * envs);
+void env_reset(EnvBatch * envs, uint32_t env);
+void env_reset_all(EnvBatch * envs);
+void env_step(EnvBatch * envs, const uint32_t * actions, float * rewards, uint8_t * status);
+EnvObservation env_observation(const EnvBatch * envs, uint32_t env);
+void env_observation_pixels(const EnvBatch * envs, uint32_t env, uint8_t * pixels);
+Chip8 * env_machine(EnvBatch * envs, uint32_t env);
+
+#endif
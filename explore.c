@@ -0,0 +1,409 @@
+// CHIP-8 state-space explorer
+//
+// Usage: chip8-explore [-q profile] [-n states] [-d depth] [-c cycles] [-a addr] [-o out.keys] <rom.ch8>
+//
+// Searches a ROM's key inputs. From each state every action (no key, or
+// one of keys 0-F held down) is run for one frame of cycles instructions
+// (see run_frame()), and the state reached is kept unless its state_hash()
+// has been seen before, so loops and inputs that make no difference are
+// pruned for the price of a table lookup. The search is breadth-first; with -a it is best-first on the byte
+// at addr (e.g. a score), highest first, shallowest among equals.
+//
+// It stops after states unique states, or when nothing new is reachable
+// within depth steps, and prints what it found. The input log reaching the
+// best state (the deepest without -a) is written to -o, and a chip8-batch
+// manifest line that replays it is printed.
+//
+// Only the registers, the screen and the memory lines that differ from the
+// freshly loaded ROM are kept per state.
+#include "cpu.h"
+#include "inputlog.h"
+
+
+#define ACTIONS              17     // no key, then each key 0-F on its own
+#define MACHINE_SEED         1      // seed_random() seed, as chip8-batch's default -s
+#define NO_PARENT            0xFFFFFFFFu
+
+
+/*
+ *  One state found by the search and how it was reached
+ */
+typedef struct node {
+	uint32_t parent;
+	uint8_t action;   // action taken from the parent
+	uint8_t score;   // byte at -a's address
+	uint16_t depth;
+
+	// the machine, less the memory it shares with the root
+	uint8_t V[16];
+	uint16_t I;
+	uint16_t pc;
+	uint16_t sp;
+	uint16_t stack[16];
+	uint16_t delay_timer;
+	uint16_t sound_timer;
+	uint32_t rand_state;
+	uint64_t video_buffer[HEIGHT];
+	uint64_t instructions_retired;
+	uint64_t lines;   // memory lines that differ from the root (bit n = line n)
+	uint8_t * line_data;   // their contents, in line order
+} Node;
+
+
+static Chip8 * cpu_reg;
+static CpuState root;   // machine just after loading the ROM
+
+static uint32_t cycles_per_step = 500;
+static uint32_t max_depth = 0xFFFF;
+static int score_addr = -1;
+
+static Node * nodes;
+static uint32_t node_count;
+static uint32_t max_nodes = 100000;
+
+static uint64_t * seen;   // open-addressed set of state hashes (0 = empty)
+static uint64_t seen_mask;
+
+static uint32_t * heap;   // best-first queue of node indices
+static uint32_t heap_size;
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ *	insert_hash()
+ *	Inputs: hash - state_hash() of a state
+ *	Return Value: 1 if the hash is new (and is now in the set); 0 if seen before
+ */
+static int insert_hash(uint64_t hash) {
+	if (hash == 0)
+		hash = 1;
+
+	for (uint64_t slot = hash & seen_mask; ; slot = (slot + 1) & seen_mask) {
+		if (seen[slot] == hash)
+			return 0;
+		if (seen[slot] == 0) {
+			seen[slot] = hash;
+			return 1;
+		}
+	}
+}
+
+
+/*
+ *	better()
+ *	Return Value: Nonzero if node a should be expanded before node b
+ */
+static int better(uint32_t a, uint32_t b) {
+	if (nodes[a].score != nodes[b].score)
+		return nodes[a].score > nodes[b].score;
+
+	return nodes[a].depth < nodes[b].depth;
+}
+
+
+static void heap_push(uint32_t n) {
+	uint32_t i = heap_size++;
+
+	for (; i > 0 && better(n, heap[(i - 1) / 2]); i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i] = n;
+}
+
+
+static uint32_t heap_pop(void) {
+	uint32_t top = heap[0];
+	uint32_t last = heap[--heap_size];
+	uint32_t i = 0;
+
+	for (;;) {
+		uint32_t child = 2 * i + 1;
+
+		if (child >= heap_size)
+			break;
+		if (child + 1 < heap_size && better(heap[child + 1], heap[child]))
+			child++;
+		if (!better(heap[child], last))
+			break;
+
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+
+	return top;
+}
+
+
+/*
+ *	save_node()
+ *	Inputs: node - Node to fill in
+ *	Return Value: None
+ *	Function: Records the machine's state, keeping only the memory lines
+ *	          that differ from the root
+ */
+static void save_node(Node * node) {
+	uint8_t * data = NULL;
+	uint32_t count = 0;
+
+	memcpy(node->V, cpu_reg->V, sizeof(node->V));
+	node->I = cpu_reg->I;
+	node->pc = cpu_reg->pc;
+	node->sp = cpu_reg->sp;
+	memcpy(node->stack, cpu_reg->stack, sizeof(node->stack));
+	node->delay_timer = cpu_reg->delay_timer;
+	node->sound_timer = cpu_reg->sound_timer;
+	node->rand_state = cpu_reg->rand_state;
+	memcpy(node->video_buffer, cpu_reg->video_buffer, sizeof(node->video_buffer));
+	node->instructions_retired = cpu_reg->instructions_retired;
+	node->score = (score_addr >= 0) ? cpu_reg->memory[score_addr] : 0;
+
+	node->lines = 0;
+	for (uint64_t lines = dirty_lines(cpu_reg, cpu_reg->restored_at); lines; lines &= lines - 1) {
+		uint32_t line = __builtin_ctzll(lines);
+
+		if (memcmp(cpu_reg->memory + line * 64, root.memory + line * 64, 64) != 0)
+			node->lines |= 1ull << line;
+	}
+
+	if (node->lines) {
+		data = malloc(__builtin_popcountll(node->lines) * 64);
+		for (uint64_t lines = node->lines; lines; lines &= lines - 1)
+			memcpy(data + 64 * count++, cpu_reg->memory + __builtin_ctzll(lines) * 64, 64);
+	}
+	node->line_data = data;
+}
+
+
+/*
+ *	load_node()
+ *	Inputs: node - Node to put the machine into
+ *	Return Value: None
+ *	Function: Resets the machine to the root, which only copies back the
+ *	          lines the last step wrote, then applies the node's lines and
+ *	          registers. Keys are all released.
+ */
+static void load_node(const Node * node) {
+	uint32_t count = 0;
+
+	reset_cpu_state(cpu_reg, &root);
+
+	for (uint64_t lines = node->lines; lines; lines &= lines - 1) {
+		uint32_t addr = __builtin_ctzll(lines) * 64;
+
+		memcpy(cpu_reg->memory + addr, node->line_data + 64 * count++, 64);
+		invalidate_icache(cpu_reg, addr, 64);
+	}
+
+	memcpy(cpu_reg->V, node->V, sizeof(node->V));
+	cpu_reg->I = node->I;
+	cpu_reg->pc = node->pc;
+	cpu_reg->sp = node->sp;
+	memcpy(cpu_reg->stack, node->stack, sizeof(node->stack));
+	cpu_reg->delay_timer = node->delay_timer;
+	cpu_reg->sound_timer = node->sound_timer;
+	cpu_reg->rand_state = node->rand_state;
+	memcpy(cpu_reg->video_buffer, node->video_buffer, sizeof(node->video_buffer));
+	rehash_video(cpu_reg);
+	cpu_reg->instructions_retired = node->instructions_retired;
+	cpu_reg->frames = node->depth;   // one frame per action, as input logs count them
+	memset(cpu_reg->keys, 0, sizeof(cpu_reg->keys));
+}
+
+
+/*
+ *	run_action()
+ *	Inputs: action - 0 for no key, n for key n-1
+ *	Return Value: None
+ *	Function: Holds the action's key (only) down for one frame
+ */
+static void run_action(uint8_t action) {
+	memset(cpu_reg->keys, 0, sizeof(cpu_reg->keys));
+	if (action > 0)
+		cpu_reg->keys[action - 1] = 1;
+
+	run_frame(cpu_reg);
+}
+
+
+/*
+ *	save_path()
+ *	Inputs: target - Node to reach
+ *	        filename - Where to write the input log
+ *	Return Value: Returns 0 on success; returns -1 if it can't be written
+ *	Function: Replays the actions from the root to target, recording the
+ *	          key changes, and checks the replay ends up in target's state
+ */
+static int save_path(uint32_t target, const char * filename) {
+	uint8_t * actions = malloc(nodes[target].depth + 1);
+	InputLog log = {0};
+	int result;
+
+	for (uint32_t n = target; nodes[n].parent != NO_PARENT; n = nodes[n].parent)
+		actions[nodes[n].depth - 1] = nodes[n].action;
+
+	load_node(&nodes[0]);
+	for (uint32_t d=0; d < nodes[target].depth; ++d) {
+		memset(cpu_reg->keys, 0, sizeof(cpu_reg->keys));
+		if (actions[d] > 0)
+			cpu_reg->keys[actions[d] - 1] = 1;
+
+		input_log_record(&log, cpu_reg);
+		run_action(actions[d]);
+	}
+
+	if (cpu_reg->instructions_retired != nodes[target].instructions_retired ||
+	    memcmp(cpu_reg->video_buffer, nodes[target].video_buffer, sizeof(cpu_reg->video_buffer)) != 0)
+		fprintf(stderr, "warning: replaying the path didn't reach the same state\n");
+
+	result = input_log_save(&log, filename);
+	input_log_free(&log);
+	free(actions);
+
+	return result;
+}
+
+
+int main(int argc, char **argv) {
+	const char * rom = NULL;
+	const char * out = NULL;
+	QuirkProfile profile = QUIRKS_SCHIP;
+
+	for (int i=1; i < argc; ++i) {
+		if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			int found = find_quirk_profile(argv[++i]);
+			if (found == -1) {
+				fprintf(stderr, "unknown quirk profile %s\n", argv[i]);
+				return 1;
+			}
+			profile = found;
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			max_nodes = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			max_depth = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			cycles_per_step = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+			score_addr = strtol(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			out = argv[++i];
+		} else {
+			rom = argv[i];
+		}
+	}
+
+	if (rom == NULL || max_nodes < 1 || cycles_per_step == 0 || max_depth > 0xFFFF || score_addr >= MEMORY_SIZE) {
+		fprintf(stderr, "usage: %s [-q profile] [-n states] [-d depth (0-65535)] [-c cycles] [-a addr] [-o out.keys] <rom.ch8>\n",
+		        argv[0]);
+		return 1;
+	}
+
+	cpu_reg = calloc(1, sizeof(Chip8));
+	set_quirk_profile(cpu_reg, profile);
+	initialize_cpu(cpu_reg);
+	seed_random(cpu_reg, MACHINE_SEED);
+	set_frame_budget(cpu_reg, cycles_per_step, 0);
+
+	if (load_program(cpu_reg, rom) == -1) {
+		fprintf(stderr, "can't load %s\n", rom);
+		return 1;
+	}
+
+	// reset_cpu_state() needs the machine restored to the snapshot once
+	save_cpu_state(cpu_reg, &root);
+	restore_cpu_state(cpu_reg, &root);
+
+	nodes = calloc(max_nodes, sizeof(Node));
+	heap = malloc(max_nodes * sizeof(uint32_t));
+	for (seen_mask = 1023; seen_mask < 2ull * max_nodes; seen_mask = seen_mask * 2 + 1)
+		;
+	seen = calloc(seen_mask + 1, sizeof(uint64_t));
+
+	nodes[0].parent = NO_PARENT;
+	save_node(&nodes[0]);
+	insert_hash(state_hash(cpu_reg));
+	node_count = 1;
+	if (score_addr >= 0)
+		heap_push(0);
+
+	uint32_t next = 0;   // breadth-first: nodes are expanded in the order found
+	uint32_t best = 0;
+	uint64_t steps = 0, duplicates = 0;
+	double start = now();
+
+	while (node_count < max_nodes) {
+		uint32_t parent;
+
+		if (score_addr >= 0) {
+			if (heap_size == 0)
+				break;
+			parent = heap_pop();
+		} else {
+			if (next == node_count)
+				break;
+			parent = next++;
+		}
+		if (nodes[parent].depth >= max_depth)
+			continue;
+
+		for (uint8_t action=0; action < ACTIONS && node_count < max_nodes; ++action) {
+			load_node(&nodes[parent]);
+			run_action(action);
+			steps++;
+
+			if (!insert_hash(state_hash(cpu_reg))) {
+				duplicates++;
+				continue;
+			}
+
+			uint32_t child = node_count++;
+			Node * node = &nodes[child];
+
+			node->parent = parent;
+			node->action = action;
+			node->depth = nodes[parent].depth + 1;
+			save_node(node);
+
+			if (score_addr >= 0)
+				heap_push(child);
+			if (score_addr >= 0 ? node->score > nodes[best].score : node->depth > nodes[best].depth)
+				best = child;
+		}
+	}
+
+	double elapsed = now() - start;
+	uint64_t line_bytes = 0;
+	uint32_t max_found = 0;
+
+	for (uint32_t n=0; n < node_count; ++n) {
+		line_bytes += __builtin_popcountll(nodes[n].lines) * 64;
+		if (nodes[n].depth > max_found)
+			max_found = nodes[n].depth;
+	}
+
+	printf("%u unique states, depth %u, from %llu steps (%llu duplicates pruned, %.1f%%) in %.3f s = %.0f steps/s\n",
+	       node_count, max_found, (unsigned long long)steps, (unsigned long long)duplicates,
+	       steps ? 100.0 * duplicates / steps : 0.0, elapsed, elapsed > 0 ? steps / elapsed : 0.0);
+	printf("state storage: %.1f MB (%.0f bytes of memory lines per state)\n",
+	       (node_count * sizeof(Node) + line_bytes) / 1e6, (double)line_bytes / node_count);
+	if (score_addr >= 0)
+		printf("best score: %u at depth %u\n", nodes[best].score, nodes[best].depth);
+	else
+		printf("deepest state: depth %u\n", nodes[best].depth);
+
+	if (out != NULL) {
+		if (save_path(best, out) == -1) {
+			fprintf(stderr, "can't write %s\n", out);
+			return 1;
+		}
+		printf("replay manifest line: %s %llu %s %s %u %u\n", rom, (unsigned long long)nodes[best].instructions_retired,
+		       out, quirk_profile_name(profile), MACHINE_SEED, cycles_per_step);
+	}
+
+	return 0;
+}
@@ -0,0 +1,380 @@
+// CHIP-8 coverage-guided fuzzer
+//
+// Usage: chip8-fuzz [-q profile] [-n execs] [-f frames] [-c cycles] [-s seed] [-r] [-o dir] <rom.ch8>
+//
+// Each execution resets the machine to the freshly loaded ROM, then holds
+// down a mutated set of keys for each of frames frames of cycles
+// instructions (see run_frame()), stopping at the end of the frame with the
+// first fault (see Chip8Fault). fde_cycle()
+// records the (previous pc, pc) edges taken; a test case that takes a new
+// edge, or takes one a new number of times (AFL's hit count buckets), joins
+// the corpus for further mutation. With -r, ROM bytes are mutated as well
+// as keys.
+//
+// A fault of a kind not seen before at that address is a finding. It is
+// printed along with a chip8-batch manifest line that replays it and, with
+// -o, the test case is saved there as an input script (<fault>-<pc>.keys)
+// and, with -r, the mutated ROM (<fault>-<pc>.ch8).
+#include "cpu.h"
+#include "inputlog.h"
+
+
+#define MAX_FRAMES           4096
+#define MAX_PATCHES          8      // ROM bytes a test case can change
+#define MAX_CORPUS           4096
+#define MACHINE_SEED         1      // seed_random() seed of every execution, as chip8-batch's default -s
+
+
+/*
+ *  One changed ROM byte
+ */
+typedef struct rom_patch {
+	uint16_t addr;
+	uint8_t value;
+} RomPatch;
+
+/*
+ *  One execution's input: the keys held down in each frame (bit n = key n)
+ *  and any changed ROM bytes
+ */
+typedef struct test_case {
+	uint16_t * frames;
+	RomPatch patches[MAX_PATCHES];
+	uint32_t patch_count;
+} TestCase;
+
+
+static Chip8 * cpu_reg;
+static CpuState base;   // machine just after loading the ROM
+static uint32_t rom_size;
+
+static uint32_t frame_count = 60;
+static uint32_t cycles_per_frame = DEFAULT_FRAME_BUDGET;
+static uint32_t frames_run;
+static int mutate_rom;
+
+static uint8_t trace[COVERAGE_SIZE];   // this execution's edge hit counts
+static uint8_t virgin[COVERAGE_SIZE];   // hit count buckets seen so far, per edge
+static uint8_t buckets[256];
+static uint32_t edges;
+
+static TestCase corpus[MAX_CORPUS];
+static uint32_t corpus_size;
+
+static uint8_t seen_faults[FAULT_COUNT][MEMORY_SIZE];
+static uint32_t findings;
+
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ *	next_random()
+ *	Return Value: Next number from the mutator's xorshift64* generator
+ */
+static uint32_t next_random(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (rng * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+
+/*
+ *	build_buckets()
+ *	Function: Maps hit counts to AFL's buckets: 1, 2, 3, 4-7, 8-15, 16-31,
+ *	          32-127 and 128+, one bit each
+ */
+static void build_buckets(void) {
+	for (int count=1; count < 256; ++count) {
+		if (count <= 3)
+			buckets[count] = 1 << (count - 1);
+		else if (count < 8)
+			buckets[count] = 0x08;
+		else if (count < 16)
+			buckets[count] = 0x10;
+		else if (count < 32)
+			buckets[count] = 0x20;
+		else if (count < 128)
+			buckets[count] = 0x40;
+		else
+			buckets[count] = 0x80;
+	}
+}
+
+
+/*
+ *	run_case()
+ *	Inputs: tc - Test case
+ *	Return Value: None
+ *	Function: Resets the machine, applies the ROM patches and runs the frames,
+ *	          stopping at the first fault. Only the memory lines the last
+ *	          execution wrote are put back, so a reset costs next to nothing.
+ */
+static void run_case(const TestCase * tc) {
+	reset_cpu_state(cpu_reg, &base);
+	reset_counters(cpu_reg);
+
+	for (uint32_t i=0; i < tc->patch_count; ++i) {
+		cpu_reg->memory[tc->patches[i].addr] = tc->patches[i].value;
+		invalidate_icache(cpu_reg, tc->patches[i].addr, 1);
+	}
+
+	memset(trace, 0, sizeof(trace));
+	set_coverage_map(cpu_reg, trace);
+
+	for (frames_run=0; frames_run < frame_count && cpu_reg->faults == 0; ++frames_run) {
+		for (int k=0; k < 16; ++k)
+			cpu_reg->keys[k] = (tc->frames[frames_run] >> k) & 1;
+
+		run_frame(cpu_reg);
+	}
+}
+
+
+/*
+ *	new_coverage()
+ *	Return Value: 2 if the last execution took a new edge, 1 if it only
+ *	              hit one a new number of times, 0 otherwise
+ *	Function: Folds the execution's trace into the virgin map
+ */
+static int new_coverage(void) {
+	int result = 0;
+
+	for (uint32_t i=0; i < COVERAGE_SIZE; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, trace + i, sizeof(word));
+		if (word == 0)
+			continue;
+
+		for (uint32_t k=i; k < i + 8; ++k) {
+			uint8_t bucket = buckets[trace[k]];
+
+			if (bucket & ~virgin[k]) {
+				if (virgin[k] == 0) {
+					edges++;
+					result = 2;
+				} else if (result == 0) {
+					result = 1;
+				}
+				virgin[k] |= bucket;
+			}
+		}
+	}
+
+	return result;
+}
+
+
+/*
+ *	mutate()
+ *	Inputs: tc - Test case to change in place
+ *	Return Value: None
+ *	Function: Applies one to four random mutations
+ */
+static void mutate(TestCase * tc) {
+	int rounds = 1 + next_random() % 4;
+
+	for (int r=0; r < rounds; ++r) {
+		uint32_t f = next_random() % frame_count;
+		uint32_t len = 1 + next_random() % (frame_count - f);
+
+		switch (next_random() % (mutate_rom ? 6 : 5)) {
+		case 0:   // toggle one key in one frame
+			tc->frames[f] ^= 1 << (next_random() % 16);
+			break;
+		case 1:   // one frame with no key or a single key
+			tc->frames[f] = (next_random() % 4 == 0) ? 0 : 1 << (next_random() % 16);
+			break;
+		case 2:   // hold a frame's keys for a while
+			for (uint32_t k=f + 1; k < f + len; ++k)
+				tc->frames[k] = tc->frames[f];
+			break;
+		case 3:   // let go of everything for a while
+			memset(tc->frames + f, 0, len * sizeof(uint16_t));
+			break;
+		case 4:   // splice in frames from another test case
+			memcpy(tc->frames + f, corpus[next_random() % corpus_size].frames + f, len * sizeof(uint16_t));
+			break;
+		case 5: {   // change a ROM byte
+			uint32_t slot = (tc->patch_count < MAX_PATCHES) ? tc->patch_count++ : next_random() % MAX_PATCHES;
+			uint16_t addr = PROGRAM_START + next_random() % rom_size;
+
+			tc->patches[slot].addr = addr;
+			tc->patches[slot].value = (next_random() & 1) ? next_random() : base.memory[addr] ^ (1u << (next_random() % 8));
+			break;
+		}
+		}
+	}
+}
+
+
+/*
+ *	save_finding()
+ *	Inputs: tc - Test case that faulted
+ *	        rom - ROM file being fuzzed
+ *	        dir - Findings directory, or NULL
+ *	        profile - Quirk profile being fuzzed
+ *	Return Value: None
+ *	Function: Reports the fault and writes the test case out for replay
+ */
+static void save_finding(const TestCase * tc, const char * rom, const char * dir, QuirkProfile profile) {
+	char name[64], keys_path[1024], rom_path[1024];
+	uint16_t held = 0;
+
+	snprintf(name, sizeof(name), "%s-%03x", fault_name(cpu_reg->first_fault), cpu_reg->first_fault_pc);
+	printf("finding: %s at %u instructions\n", name, (unsigned)cpu_reg->instructions_retired);
+	if (dir == NULL)
+		return;
+
+	snprintf(keys_path, sizeof(keys_path), "%s/%s.keys", dir, name);
+	snprintf(rom_path, sizeof(rom_path), "%s/%s.ch8", dir, name);
+
+	FILE * f = fopen(keys_path, "w");
+	if (f == NULL) {
+		perror(keys_path);
+		return;
+	}
+	fprintf(f, "%s\n", INPUT_LOG_HEADER);
+	for (uint32_t frame=0; frame < frames_run; ++frame) {
+		for (int k=0; k < 16; ++k) {
+			if (((tc->frames[frame] ^ held) >> k) & 1)
+				fprintf(f, "%u %X %u\n", frame, k, (tc->frames[frame] >> k) & 1);
+		}
+		held = tc->frames[frame];
+	}
+	fclose(f);
+
+	if (tc->patch_count > 0) {
+		uint8_t image[MEMORY_SIZE - PROGRAM_START];
+
+		memcpy(image, base.memory + PROGRAM_START, rom_size);
+		for (uint32_t i=0; i < tc->patch_count; ++i)
+			image[tc->patches[i].addr - PROGRAM_START] = tc->patches[i].value;
+
+		f = fopen(rom_path, "wb");
+		if (f == NULL) {
+			perror(rom_path);
+			return;
+		}
+		fwrite(image, 1, rom_size, f);
+		fclose(f);
+		rom = rom_path;
+	}
+
+	printf("  replay manifest line: %s %llu %s %s %u %u\n", rom, (unsigned long long)cpu_reg->instructions_retired,
+	       keys_path, quirk_profile_name(profile), MACHINE_SEED, cycles_per_frame);
+}
+
+
+int main(int argc, char **argv) {
+	const char * rom = NULL;
+	const char * dir = NULL;
+	QuirkProfile profile = QUIRKS_SCHIP;
+	uint64_t execs = 100000;
+
+	for (int i=1; i < argc; ++i) {
+		if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			int found = find_quirk_profile(argv[++i]);
+			if (found == -1) {
+				fprintf(stderr, "unknown quirk profile %s\n", argv[i]);
+				return 1;
+			}
+			profile = found;
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			execs = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			frame_count = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			cycles_per_frame = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			rng = strtoull(argv[++i], NULL, 0) | 1;
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			dir = argv[++i];
+		} else if (strcmp(argv[i], "-r") == 0) {
+			mutate_rom = 1;
+		} else {
+			rom = argv[i];
+		}
+	}
+
+	if (rom == NULL || frame_count == 0 || frame_count > MAX_FRAMES || cycles_per_frame == 0) {
+		fprintf(stderr, "usage: %s [-q profile] [-n execs] [-f frames (1-%d)] [-c cycles] [-s seed] [-r] [-o dir] <rom.ch8>\n",
+		        argv[0], MAX_FRAMES);
+		return 1;
+	}
+
+	cpu_reg = calloc(1, sizeof(Chip8));
+	set_quirk_profile(cpu_reg, profile);
+	initialize_cpu(cpu_reg);
+	seed_random(cpu_reg, MACHINE_SEED);
+	set_frame_budget(cpu_reg, cycles_per_frame, 0);
+
+	int size = load_program(cpu_reg, rom);
+	if (size == -1) {
+		fprintf(stderr, "can't load %s\n", rom);
+		return 1;
+	}
+	rom_size = size;
+
+	// reset_cpu_state() needs the machine restored to the snapshot once
+	save_cpu_state(cpu_reg, &base);
+	restore_cpu_state(cpu_reg, &base);
+	build_buckets();
+
+	uint16_t * frames = calloc((size_t)(MAX_CORPUS + 1) * frame_count, sizeof(uint16_t));
+	for (uint32_t i=0; i < MAX_CORPUS; ++i)
+		corpus[i].frames = frames + (size_t)i * frame_count;
+
+	// the corpus starts out with no keys pressed
+	TestCase current = { .frames = frames + (size_t)MAX_CORPUS * frame_count };
+	corpus_size = 1;
+	run_case(&corpus[0]);
+	new_coverage();
+
+	double start = now(), last_report = start;
+
+	for (uint64_t n=1; n <= execs; ++n) {
+		const TestCase * parent = &corpus[next_random() % corpus_size];
+
+		memcpy(current.frames, parent->frames, frame_count * sizeof(uint16_t));
+		memcpy(current.patches, parent->patches, sizeof(current.patches));
+		current.patch_count = parent->patch_count;
+		mutate(&current);
+
+		run_case(&current);
+
+		if (cpu_reg->faults && !seen_faults[cpu_reg->first_fault][cpu_reg->first_fault_pc & (MEMORY_SIZE - 1)]) {
+			seen_faults[cpu_reg->first_fault][cpu_reg->first_fault_pc & (MEMORY_SIZE - 1)] = 1;
+			findings++;
+			save_finding(&current, rom, dir, profile);
+		}
+
+		if (new_coverage() && corpus_size < MAX_CORPUS) {
+			TestCase * keep = &corpus[corpus_size++];
+
+			memcpy(keep->frames, current.frames, frame_count * sizeof(uint16_t));
+			memcpy(keep->patches, current.patches, sizeof(keep->patches));
+			keep->patch_count = current.patch_count;
+		}
+
+		if ((n & 1023) == 0 || n == execs) {
+			double t = now();
+
+			if (t - last_report >= 1.0 || n == execs) {
+				fprintf(stderr, "%llu execs (%.0f/s), corpus %u, %u edges, %u findings\n", (unsigned long long)n,
+				        n / (t - start), corpus_size, edges, findings);
+				last_report = t;
+			}
+		}
+	}
+
+	return 0;
+}
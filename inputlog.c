@@ -0,0 +1,172 @@
+// CHIP-8 input logs
+//
+// An input log (the input scripts chip8-batch reads) is a text file that
+// starts with the line INPUT_LOG_HEADER, followed by one key change per
+// line:
+//   <frame> <key 0-F> <1 = pressed, 0 = released>
+// in increasing frame order, where frame is the index of the 60 Hz frame
+// (Chip8.frames, counted from initialize_cpu()) the change took effect at
+// the start of. Other lines starting with '#' are comments.
+//
+// Machines run in whole frames (see run_frame()), so key changes are
+// recorded and applied at frame boundaries. A machine started with the same
+// ROM, quirk profile, seed (see seed_random()) and frame budget and fed the
+// same log by input_log_replay() goes through exactly the same states as
+// the one it was recorded from. Events are keyed on frames rather than
+// instruction counts because with a VIP cycle budget a frame can retire no
+// instructions at all, so the count doesn't say which frame an event is for.
+//
+// Logs without the header line are from before this, and their first
+// column is the number of instructions retired when the change happened.
+// They are still replayed that way (by_instruction).
+#include "inputlog.h"
+
+
+static void add_event(InputLog * log, uint64_t frame, uint8_t key, uint8_t pressed) {
+	if (log->count == log->capacity) {
+		log->capacity = log->capacity ? log->capacity * 2 : 64;
+		log->events = realloc(log->events, log->capacity * sizeof(KeyEvent));
+	}
+
+	KeyEvent * ev = &log->events[log->count++];
+	ev->frame = frame;
+	ev->key = key;
+	ev->pressed = pressed;
+	log->keys[key] = pressed;
+}
+
+
+/*
+ *	event_clock()
+ *	Inputs: log - Input log
+ *	        cpu_reg - Machine between frames
+ *	Return Value: What the log's events are keyed on: the frame index, or
+ *	              for an old log the instruction count
+ */
+static inline uint64_t event_clock(const InputLog * log, const Chip8 * cpu_reg) {
+	return log->by_instruction ? cpu_reg->instructions_retired : cpu_reg->frames;
+}
+
+
+/*
+ *	input_log_load()
+ *	Inputs: log - Log to append the file's events to
+ *	        filename - Input log
+ *	Return Value: Returns 0 on success; returns -1 if the file can't be read
+ *	Function: A file that doesn't start with INPUT_LOG_HEADER is an old log
+ *	          keyed on instruction counts, and sets by_instruction
+ */
+int input_log_load(InputLog * log, const char * filename) {
+	FILE * f = fopen(filename, "r");
+	char line[256];
+
+	if (f == NULL)
+		return -1;
+
+	if (fgets(line, sizeof(line), f) == NULL || strncmp(line, INPUT_LOG_HEADER, strlen(INPUT_LOG_HEADER)) != 0) {
+		log->by_instruction = 1;
+		rewind(f);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long long frame;
+		unsigned int key, pressed;
+
+		if (line[0] != '#' && sscanf(line, "%llu %x %u", &frame, &key, &pressed) == 3)
+			add_event(log, frame, key & 0xF, pressed != 0);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+/*
+ *	input_log_save()
+ *	Inputs: log - Log to write
+ *	        filename - Where to write it
+ *	Return Value: Returns 0 on success; returns -1 if the file can't be written
+ */
+int input_log_save(const InputLog * log, const char * filename) {
+	FILE * f = fopen(filename, "w");
+
+	if (f == NULL)
+		return -1;
+
+	if (!log->by_instruction)
+		fprintf(f, "%s\n", INPUT_LOG_HEADER);
+	for (uint32_t i=0; i < log->count; ++i) {
+		const KeyEvent * ev = &log->events[i];
+		fprintf(f, "%llu %X %u\n", (unsigned long long)ev->frame, ev->key, ev->pressed);
+	}
+
+	return (fclose(f) == 0) ? 0 : -1;
+}
+
+
+/*
+ *	input_log_record()
+ *	Inputs: log - Log being recorded
+ *	        cpu_reg - Machine being recorded
+ *	Return Value: None
+ *	Function: Logs every key whose state differs from the last one logged.
+ *	          Call it before each run_frame(), once the keys for it are set.
+ */
+void input_log_record(InputLog * log, const Chip8 * cpu_reg) {
+	for (uint8_t k=0; k < 16; ++k) {
+		uint8_t pressed = cpu_reg->keys[k] != 0;
+
+		if (pressed != log->keys[k])
+			add_event(log, event_clock(log, cpu_reg), k, pressed);
+	}
+}
+
+
+/*
+ *	input_log_truncate()
+ *	Inputs: log - Log being recorded
+ *	        cpu_reg - Machine being recorded, just put back to an earlier
+ *	                  state (e.g. by rewinding)
+ *	Return Value: None
+ *	Function: Forgets the events from the machine's frame on, so recording
+ *	          can carry on from there
+ */
+void input_log_truncate(InputLog * log, const Chip8 * cpu_reg) {
+	while (log->count > 0 && log->events[log->count - 1].frame >= event_clock(log, cpu_reg))
+		log->count--;
+
+	for (int k=0; k < 16; ++k)
+		log->keys[k] = cpu_reg->keys[k] != 0;
+	if (log->next > log->count)
+		log->next = log->count;
+}
+
+
+/*
+ *	input_log_replay()
+ *	Inputs: log - Log to play back
+ *	        cpu_reg - Machine to run
+ *	        instructions - Run frames until this many instructions have retired
+ *	Return Value: None
+ *	Function: Runs the machine's frames as fast as it goes, applying each
+ *	          event at the start of its frame. Can be called repeatedly to
+ *	          replay in steps.
+ */
+void input_log_replay(InputLog * log, Chip8 * cpu_reg, uint64_t instructions) {
+	while (cpu_reg->instructions_retired < instructions) {
+		uint64_t now = event_clock(log, cpu_reg);
+
+		while (log->next < log->count && log->events[log->next].frame <= now) {
+			const KeyEvent * ev = &log->events[log->next++];
+			cpu_reg->keys[ev->key] = ev->pressed;
+		}
+
+		run_frame(cpu_reg);
+	}
+}
+
+
+void input_log_free(InputLog * log) {
+	free(log->events);
+	memset(log, 0, sizeof(InputLog));
+}
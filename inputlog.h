@@ -0,0 +1,41 @@
+#ifndef _INPUTLOG_H_
+#define _INPUTLOG_H_
+
+#include "cpu.h"
+
+
+#define INPUT_LOG_HEADER     "# frame key pressed"   // first line of a log keyed on frames (see inputlog.c)
+
+
+/*
+ *  Key change at a point in a run
+ */
+typedef struct key_event {
+	uint64_t frame;   // applied at the start of the frame with this index (see Chip8.frames)
+	uint8_t key;
+	uint8_t pressed;
+} KeyEvent;
+
+/*
+ *  Every key change of a session, in frame order (see inputlog.c). Zero
+ *  one (= {0}) before use.
+ */
+typedef struct input_log {
+	KeyEvent * events;
+	uint32_t count;
+	uint32_t capacity;
+
+	uint8_t keys[16];   // key state after the last event
+	uint32_t next;   // next event to apply when replaying
+	uint8_t by_instruction;   // old log: frame holds an instruction count instead (see input_log_load())
+} InputLog;
+
+
+int input_log_load(InputLog * log, const char * filename);
+int input_log_save(const InputLog * log, const char * filename);
+void input_log_record(InputLog * log, const Chip8 * cpu_reg);
+void input_log_truncate(InputLog * log, const Chip8 * cpu_reg);
+void input_log_replay(InputLog * log, Chip8 * cpu_reg, uint64_t instructions);
+void input_log_free(InputLog * log);
+
+#endif
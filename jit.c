@@ -0,0 +1,485 @@
+// CHIP-8 basic-block recompiler for x86-64
+//
+// Each block is a native function that runs its instructions and returns
+// to jit_run(). Blocks aren't patched to jump to each other: a block only
+// remembers the block that ran after it last time (link), and find_block()
+// tries that pointer before the block map. That saves a lookup per block,
+// not the call and return (blocks_chained counts the hits).
+#include "jit.h"
+
+#include "stddef.h"
+
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+
+#define CODE_BUFFER_SIZE     (1 << 20)
+#define MAX_BLOCKS           2048
+#define MAX_BLOCK_LENGTH     32     // instructions
+#define MAX_BLOCK_CODE       2048   // bytes of x86 code a block can take up
+
+#define OFFSET_V(x)          ((uint32_t)(offsetof(Chip8, V) + (x)))
+#define OFFSET_I             ((uint32_t)offsetof(Chip8, I))
+#define OFFSET_PC            ((uint32_t)offsetof(Chip8, pc))
+
+
+typedef void (*block_fn)(Chip8 * cpu_reg);
+
+/*
+ *  Compiled straight-line run of instructions [start, end)
+ */
+typedef struct jit_block {
+	block_fn code;
+	uint16_t start;
+	uint16_t end;
+	uint16_t length;   // number of CHIP-8 instructions
+	uint8_t valid;
+	struct jit_block * link;   // block that ran after this one last time (tried first by find_block())
+	Instruction ins[MAX_BLOCK_LENGTH];   // operands for handler calls
+} JitBlock;
+
+
+/*
+ *  Recompiler attached to one machine
+ */
+struct jit {
+	Chip8 * cpu_reg;
+	JitStats stats;
+
+	uint8_t * code_buffer;   // NULL if executable memory couldn't be had
+	uint32_t code_used;
+
+	JitBlock blocks[MAX_BLOCKS];
+	uint32_t blocks_used;
+	JitBlock * block_map[MEMORY_SIZE / 2];   // valid block starting at each even address
+
+	CpuState before, expected, actual;   // jit_run_checked() snapshots
+};
+
+
+/*****************************************************************/
+/**************          x86-64 code emitter        **************/
+/*****************************************************************/
+
+static inline void emit8(uint8_t ** p, uint8_t b) {
+	*(*p)++ = b;
+}
+
+static inline void emit16(uint8_t ** p, uint16_t w) {
+	memcpy(*p, &w, 2);
+	*p += 2;
+}
+
+static inline void emit32(uint8_t ** p, uint32_t d) {
+	memcpy(*p, &d, 4);
+	*p += 4;
+}
+
+static inline void emit64(uint8_t ** p, uint64_t q) {
+	memcpy(*p, &q, 8);
+	*p += 8;
+}
+
+/* <op> [rbx + disp32] with ModRM reg field = reg */
+static inline void emit_rbx_op(uint8_t ** p, uint8_t op, uint8_t reg, uint32_t disp) {
+	emit8(p, op);
+	emit8(p, 0x80 | (reg << 3) | 0x3);
+	emit32(p, disp);
+}
+
+/* mov word [rbx + pc], addr */
+static inline void emit_set_pc(uint8_t ** p, uint16_t addr) {
+	emit8(p, 0x66);
+	emit_rbx_op(p, 0xC7, 0, OFFSET_PC);
+	emit16(p, addr);
+}
+
+
+/*
+ *	emit_native()
+ *	Inputs: p - Code pointer
+ *	        ins - Instruction to translate
+ *	Return Value: Returns 1 if the instruction was translated; 0 if it has
+ *	              to go through its handler
+ *	Function: Emits inline x86 for the simple register instructions. None of
+ *	          these touch pc, so it is only written back when needed.
+ */
+static int emit_native(uint8_t ** p, const Instruction * ins) {
+	static const uint8_t alu_op[4] = { 0x88, 0x08, 0x20, 0x30 };   // mov, or, and, xor [m8], al
+
+	switch (ins->opcode & 0xF000) {
+	case 0x6000:
+		// mov byte [rbx + VX], kk
+		emit_rbx_op(p, 0xC6, 0, OFFSET_V(ins->x));
+		emit8(p, ins->kk);
+		return 1;
+	case 0x7000:
+		// add byte [rbx + VX], kk
+		emit_rbx_op(p, 0x80, 0, OFFSET_V(ins->x));
+		emit8(p, ins->kk);
+		return 1;
+	case 0x8000:
+		if (ins->n > 3)
+			return 0;   // the flag-setting ALU ops stay in C
+		// mov al, [rbx + VY]; <op> [rbx + VX], al
+		emit_rbx_op(p, 0x8A, 0, OFFSET_V(ins->y));
+		emit_rbx_op(p, alu_op[ins->n], 0, OFFSET_V(ins->x));
+		return 1;
+	case 0xA000:
+		// mov word [rbx + I], nnn
+		emit8(p, 0x66);
+		emit_rbx_op(p, 0xC7, 0, OFFSET_I);
+		emit16(p, ins->nnn);
+		return 1;
+	case 0xF000:
+		if (ins->kk != 0x1E)
+			return 0;
+		// movzx eax, byte [rbx + VX]; add word [rbx + I], ax
+		emit8(p, 0x0F);
+		emit_rbx_op(p, 0xB6, 0, OFFSET_V(ins->x));
+		emit8(p, 0x66);
+		emit_rbx_op(p, 0x01, 0, OFFSET_I);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ *	emit_handler_call()
+ *	Inputs: p - Code pointer
+ *	        ins - Instruction to execute
+ *	        addr - Address of the instruction
+ *	Return Value: None
+ *	Function: Emits a call to the instruction's C handler, with pc set up
+ *	          the way the interpreter would have it
+ */
+static void emit_handler_call(uint8_t ** p, const Instruction * ins, uint16_t addr) {
+	emit_set_pc(p, addr);
+
+	emit8(p, 0x48); emit8(p, 0xBF); emit64(p, (uint64_t)(uintptr_t)ins);      // mov rdi, ins
+	emit8(p, 0x48); emit8(p, 0x89); emit8(p, 0xDE);                          // mov rsi, rbx
+	emit8(p, 0x48); emit8(p, 0xB8); emit64(p, (uint64_t)(uintptr_t)ins->fn);  // mov rax, handler
+	emit8(p, 0xFF); emit8(p, 0xD0);                                          // call rax
+}
+
+
+/*****************************************************************/
+/**************           Block management          **************/
+/*****************************************************************/
+
+/*
+ *	jit_flush()
+ *	Inputs: jit - Recompiler
+ *	Return Value: None
+ *	Function: Throws away every compiled block
+ */
+void jit_flush(Jit * jit) {
+	jit->code_used = 0;
+	jit->blocks_used = 0;
+	memset(jit->block_map, 0, sizeof(jit->block_map));
+	jit->stats.flushes++;
+}
+
+
+/*
+ *	jit_memory_written()
+ *	Inputs: data - The Jit attached to the machine
+ *	        addr - First memory address that was written
+ *	        len - Number of bytes written
+ *	Return Value: None
+ *	Function: Drops the blocks compiled from the written range. The code stays
+ *	          in the buffer until the next flush, so a block can safely
+ *	          invalidate itself while it is running.
+ */
+static void jit_memory_written(void * data, uint32_t addr, uint32_t len) {
+	Jit * jit = data;
+	uint32_t first = (addr > MAX_BLOCK_LENGTH * 2) ? addr - MAX_BLOCK_LENGTH * 2 : 0;
+
+	for (uint32_t a = first & ~1u; a < addr + len && a < MEMORY_SIZE; a += 2) {
+		JitBlock * blk = jit->block_map[a / 2];
+
+		if (blk != NULL && blk->end > addr) {
+			blk->valid = 0;
+			jit->block_map[a / 2] = NULL;
+			jit->stats.blocks_invalidated++;
+		}
+	}
+}
+
+
+/*
+ *	compile_block()
+ *	Inputs: jit - Recompiler
+ *	        start - Even address of the first instruction
+ *	Return Value: Pointer to the new block
+ *	Function: Translates instructions from start up to the first control
+ *	          flow instruction or memory write
+ */
+static JitBlock * compile_block(Jit * jit, uint16_t start) {
+	if (jit->blocks_used == MAX_BLOCKS || jit->code_used + MAX_BLOCK_CODE > CODE_BUFFER_SIZE)
+		jit_flush(jit);
+
+	Chip8 * cpu_reg = jit->cpu_reg;
+	JitBlock * blk = &jit->blocks[jit->blocks_used++];
+	uint8_t * p = jit->code_buffer + jit->code_used;
+	uint16_t addr = start;
+	int native = 0;
+
+	blk->code = (block_fn)(void *)p;
+	blk->start = start;
+	blk->length = 0;
+	blk->link = NULL;
+
+	emit8(&p, 0x53);                                  // push rbx
+	emit8(&p, 0x48); emit8(&p, 0x89); emit8(&p, 0xFB);  // mov rbx, rdi
+
+	while (blk->length < MAX_BLOCK_LENGTH && addr < MEMORY_SIZE - 1) {
+		uint16_t opcode = (cpu_reg->memory[addr] << 8) | cpu_reg->memory[addr+1];
+		int flags = block_flags(opcode);
+
+		if ((flags & STARTS_BLOCK) && blk->length > 0)
+			break;
+
+		Instruction * ins = &blk->ins[blk->length++];
+		decode_instruction(cpu_reg, opcode, ins);
+
+		native = emit_native(&p, ins);
+		if (!native)
+			emit_handler_call(&p, ins, addr);
+
+		addr += 2;
+		if (flags & ENDS_BLOCK)
+			break;
+	}
+
+	// handlers keep pc up to date themselves; inline code doesn't
+	if (native)
+		emit_set_pc(&p, addr);
+
+	emit8(&p, 0x5B);   // pop rbx
+	emit8(&p, 0xC3);   // ret
+
+	blk->end = addr;
+	blk->valid = 1;
+	jit->block_map[start / 2] = blk;
+	jit->code_used = p - jit->code_buffer;
+	jit->stats.blocks_compiled++;
+
+	return blk;
+}
+
+
+/*
+ *	find_block()
+ *	Inputs: jit - Recompiler
+ *	        prev - Block that just ran (or NULL)
+ *	Return Value: Block starting at pc
+ *	Function: Follows prev's successor link when it still matches, otherwise
+ *	          looks the block up (compiling it on a miss) and re-links prev
+ */
+static JitBlock * find_block(Jit * jit, JitBlock * prev) {
+	uint16_t pc = jit->cpu_reg->pc;
+	uint32_t flushes = jit->stats.flushes;
+
+	if (prev != NULL && prev->link != NULL && prev->link->valid && prev->link->start == pc) {
+		jit->stats.blocks_chained++;
+		return prev->link;
+	}
+
+	JitBlock * blk = jit->block_map[pc / 2];
+	if (blk == NULL)
+		blk = compile_block(jit, pc);
+
+	// a flush recycles prev's slot, so only link it if it survived
+	if (prev != NULL && prev->valid && flushes == jit->stats.flushes)
+		prev->link = blk;
+
+	return blk;
+}
+
+
+/*
+ *	jit_create()
+ *	Inputs: cpu_reg - Machine to compile for (already initialized)
+ *	Return Value: Returns the recompiler; returns NULL if out of memory
+ *	Function: Sets up the code buffer and hooks the machine's memory writes.
+ *	          If executable memory can't be allocated, jit_run() interprets.
+ */
+Jit * jit_create(Chip8 * cpu_reg) {
+	Jit * jit = calloc(1, sizeof(Jit));
+	if (jit == NULL)
+		return NULL;
+
+	void * buf = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf != MAP_FAILED)
+		jit->code_buffer = buf;
+
+	jit->cpu_reg = cpu_reg;
+	set_memory_write_listener(cpu_reg, jit_memory_written, jit);
+
+	return jit;
+}
+
+
+/*
+ *	jit_destroy()
+ *	Inputs: jit - Recompiler from jit_create()
+ *	Return Value: None
+ *	Function: Unhooks the machine and frees the code buffer
+ */
+void jit_destroy(Jit * jit) {
+	set_memory_write_listener(jit->cpu_reg, NULL, NULL);
+	if (jit->code_buffer != NULL)
+		munmap(jit->code_buffer, CODE_BUFFER_SIZE);
+	free(jit);
+}
+
+
+/*
+ *	jit_get_stats()
+ *	Inputs: jit - Recompiler
+ *	Return Value: Counters since jit_create()
+ *	Function: See JitStats
+ */
+const JitStats * jit_get_stats(const Jit * jit) {
+	return &jit->stats;
+}
+
+
+/*
+ *	jit_run()
+ *	Inputs: jit - Recompiler
+ *	        count - Minimum number of instructions to execute
+ *	Return Value: Number of instructions actually executed (whole blocks
+ *	              are run, so this can exceed count)
+ *	Function: Runs compiled blocks, falling back to the interpreter at odd
+ *	          addresses
+ */
+uint32_t jit_run(Jit * jit, uint32_t count) {
+	Chip8 * cpu_reg = jit->cpu_reg;
+	uint32_t executed = 0;
+	JitBlock * blk = NULL;
+
+	if (jit->code_buffer == NULL) {
+		run_cycles(cpu_reg, count);
+		return count;
+	}
+
+	while (executed < count) {
+		if ((cpu_reg->pc & 1) || cpu_reg->pc >= MEMORY_SIZE - 1) {
+			fde_cycle(cpu_reg);
+			executed++;
+			blk = NULL;
+			continue;
+		}
+
+		blk = find_block(jit, blk);
+		blk->code(cpu_reg);
+		retire_instructions(cpu_reg, blk->length);
+
+		executed += blk->length;
+		jit->stats.blocks_executed++;
+	}
+
+	return executed;
+}
+
+
+/*
+ *	jit_run_checked()
+ *	Inputs: jit - Recompiler
+ *	        count - Minimum number of instructions to execute
+ *	Return Value: Number of instructions executed
+ *	Function: Differential mode. Every block is first run through the
+ *	          interpreter one instruction at a time, then rewound and run
+ *	          natively, and the two machine states are compared. On a
+ *	          mismatch the interpreter's result is kept.
+ */
+uint32_t jit_run_checked(Jit * jit, uint32_t count) {
+	Chip8 * cpu_reg = jit->cpu_reg;
+	uint32_t executed = 0;
+
+	if (jit->code_buffer == NULL) {
+		run_cycles(cpu_reg, count);
+		return count;
+	}
+
+	while (executed < count) {
+		if ((cpu_reg->pc & 1) || cpu_reg->pc >= MEMORY_SIZE - 1) {
+			fde_cycle(cpu_reg);
+			executed++;
+			continue;
+		}
+
+		JitBlock * blk = find_block(jit, NULL);
+		block_fn code = blk->code;
+		uint16_t length = blk->length;
+
+		executed += length;
+		jit->stats.blocks_executed++;
+
+		// the snapshots include the random number state, so RND blocks can be compared too
+		save_cpu_state(cpu_reg, &jit->before);
+		for (uint16_t i=0; i < length; ++i)
+			step_instruction(cpu_reg);
+		save_cpu_state(cpu_reg, &jit->expected);
+
+		// rewinding may invalidate blk, but its code matches the rewound memory
+		restore_cpu_state(cpu_reg, &jit->before);
+		code(cpu_reg);
+		retire_instructions(cpu_reg, length);
+		save_cpu_state(cpu_reg, &jit->actual);
+
+		if (memcmp(&jit->actual, &jit->expected, sizeof(CpuState)) != 0) {
+			fprintf(stderr, "jit: block at 0x%03X (%u instructions) differs from the interpreter\n",
+			        jit->before.pc, length);
+			jit->stats.mismatches++;
+			restore_cpu_state(cpu_reg, &jit->expected);
+		}
+	}
+
+	return executed;
+}
+
+
+#else   /* no x86-64 code generator for this platform */
+
+struct jit {
+	Chip8 * cpu_reg;
+	JitStats stats;
+};
+
+Jit * jit_create(Chip8 * cpu_reg) {
+	Jit * jit = calloc(1, sizeof(Jit));
+	if (jit != NULL)
+		jit->cpu_reg = cpu_reg;
+	return jit;
+}
+
+void jit_destroy(Jit * jit) {
+	free(jit);
+}
+
+const JitStats * jit_get_stats(const Jit * jit) {
+	return &jit->stats;
+}
+
+void jit_flush(Jit * jit) {
+}
+
+uint32_t jit_run(Jit * jit, uint32_t count) {
+	run_cycles(jit->cpu_reg, count);
+	return count;
+}
+
+uint32_t jit_run_checked(Jit * jit, uint32_t count) {
+	run_cycles(jit->cpu_reg, count);
+	return count;
+}
+
+#endif
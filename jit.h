@@ -0,0 +1,29 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "cpu.h"
+
+
+/*
+ *  JIT counters (see jit_get_stats())
+ */
+typedef struct jit_stats {
+	uint32_t blocks_compiled;
+	uint32_t blocks_invalidated;
+	uint32_t flushes;   // times the code buffer filled up and was thrown away
+	uint64_t blocks_executed;
+	uint64_t blocks_chained;   // blocks found through the previous block's successor link instead of the block map
+	uint32_t mismatches;   // blocks that disagreed with the interpreter in jit_run_checked()
+} JitStats;
+
+typedef struct jit Jit;   // recompiler attached to one machine
+
+
+Jit * jit_create(Chip8 * cpu_reg);
+void jit_destroy(Jit * jit);
+const JitStats * jit_get_stats(const Jit * jit);
+void jit_flush(Jit * jit);
+uint32_t jit_run(Jit * jit, uint32_t count);
+uint32_t jit_run_checked(Jit * jit, uint32_t count);
+
+#endif
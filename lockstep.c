@@ -0,0 +1,589 @@
+// CHIP-8 lockstep engine
+//
+// Runs many machines on the same ROM at once, one instruction per lane per
+// step. The registers of every lane (V0-VF, I, pc, sp and the timers) are
+// kept as structure-of-arrays rows, so one instruction can be applied to
+// LANE_CHUNK lanes with a handful of vector operations. They are written
+// with GCC's vector extensions; build with -mavx512bw or -mavx2 to get
+// AVX-512 or AVX2 code (SSE2 otherwise).
+//
+// Each step, the lanes are split into groups sharing a pc. A group whose
+// instruction is register-only (jumps, skips, 6XKK/7XKK, the 8XYN ALU ops,
+// ANNN/BNNN and the timer/index FX ops) runs vectorized, with the group as
+// a lane mask. Everything else, and any group whose lanes have rewritten
+// the instruction differently, falls back to the interpreter one lane at a
+// time. Memory, the stack, the screen, the keys and the RNG state stay in
+// each lane's Chip8 (see lockstep_lane()).
+#include "lockstep.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+// Lanes per vector operation: as many as fit the 16-bit rows into one
+// vector register. GCC splits wider vectors up, but falls back to scalar
+// code for comparisons on them.
+#if defined(__AVX512BW__)
+#define LANE_CHUNK           32
+#elif defined(__AVX2__)
+#define LANE_CHUNK           16
+#else
+#define LANE_CHUNK           8
+#endif
+
+#define ALL_LANES            ((1ull << LANE_CHUNK) - 1)
+#define LINE_SIZE            64   // granularity of the self-modified memory map
+
+typedef uint8_t  lane_u8  __attribute__((vector_size(LANE_CHUNK)));
+typedef int8_t   lane_m8  __attribute__((vector_size(LANE_CHUNK)));
+typedef uint16_t lane_u16 __attribute__((vector_size(LANE_CHUNK * 2)));
+typedef int16_t  lane_m16 __attribute__((vector_size(LANE_CHUNK * 2)));
+
+// chunk c of a register row
+#define ROW8(row, c)         (*(lane_u8 *)&(row)[(c) * LANE_CHUNK])
+#define ROW16(row, c)        (*(lane_u16 *)&(row)[(c) * LANE_CHUNK])
+#define MASK16(row, c)       (*(lane_m16 *)&(row)[(c) * LANE_CHUNK])
+
+
+struct lockstep {
+	uint32_t lanes;
+	uint32_t chunks;   // lanes / LANE_CHUNK, rounded up
+	const QuirkSettings * quirks;
+
+	// one row per register, indexed by lane
+	uint8_t * V[16];
+	uint16_t * I;
+	uint16_t * pc;
+	uint16_t * sp;
+	uint16_t * delay_timer;
+	uint16_t * sound_timer;
+
+	// per-step bookkeeping, indexed by lane
+	uint16_t * start_pc;   // pc before the step
+	int16_t * padding;   // -1 for the lanes past the end of the last chunk
+	int16_t * done;   // -1 once the lane has run its instruction this step
+	int16_t * group;   // -1 for the lanes in the group being run
+	void * rows;   // allocation behind all of the above
+	uint64_t * done_bits;   // done and group as one bit per lane, a word per chunk
+	uint64_t * group_bits;
+
+	Chip8 * machines;
+	uint8_t written[MEMORY_SIZE / LINE_SIZE];   // lines any lane has written to since loading
+	LockstepStats stats;
+};
+
+
+/*
+ *	memory_written()
+ *	Function: Memory write listener of every lane. Marks the lines written, so
+ *	          the instructions in them are checked for differences between lanes.
+ */
+static void memory_written(void * data, uint32_t addr, uint32_t len) {
+	Lockstep * ls = data;
+
+	for (uint32_t a = addr / LINE_SIZE; a <= (addr + len - 1) / LINE_SIZE && a < MEMORY_SIZE / LINE_SIZE; ++a)
+		ls->written[a] = 1;
+}
+
+
+/*
+ *	gather_lane()
+ *	Inputs: ls - Lockstep engine
+ *	        lane - Lane number
+ *	Return Value: None
+ *	Function: Copies the lane's registers from its Chip8 into the rows
+ */
+static void gather_lane(Lockstep * ls, uint32_t lane) {
+	const Chip8 * cpu_reg = &ls->machines[lane];
+
+	for (int r=0; r < 16; ++r)
+		ls->V[r][lane] = cpu_reg->V[r];
+	ls->I[lane] = cpu_reg->I;
+	ls->pc[lane] = cpu_reg->pc;
+	ls->sp[lane] = cpu_reg->sp;
+	ls->delay_timer[lane] = cpu_reg->delay_timer;
+	ls->sound_timer[lane] = cpu_reg->sound_timer;
+}
+
+
+/*
+ *	scatter_lane()
+ *	Inputs: ls - Lockstep engine
+ *	        lane - Lane number
+ *	Return Value: None
+ *	Function: Copies the lane's registers from the rows back into its Chip8
+ */
+static void scatter_lane(Lockstep * ls, uint32_t lane) {
+	Chip8 * cpu_reg = &ls->machines[lane];
+
+	for (int r=0; r < 16; ++r)
+		cpu_reg->V[r] = ls->V[r][lane];
+	cpu_reg->I = ls->I[lane];
+	cpu_reg->pc = ls->pc[lane];
+	cpu_reg->sp = ls->sp[lane];
+	cpu_reg->delay_timer = ls->delay_timer[lane];
+	cpu_reg->sound_timer = ls->sound_timer[lane];
+}
+
+
+/*
+ *	run_scalar()
+ *	Inputs: ls - Lockstep engine
+ *	        lane - Lane number
+ *	Return Value: None
+ *	Function: Runs the lane's next instruction through the interpreter. Its
+ *	          cost isn't charged and the timers are left alone.
+ */
+static void run_scalar(Lockstep * ls, uint32_t lane) {
+	Chip8 * cpu_reg = &ls->machines[lane];
+	Instruction ins;
+
+	scatter_lane(ls, lane);
+
+	uint16_t pc = cpu_reg->pc & (MEMORY_SIZE - 1);
+	decode_instruction(cpu_reg, (cpu_reg->memory[pc] << 8) | cpu_reg->memory[(pc+1) & (MEMORY_SIZE - 1)], &ins);
+	ins.fn(&ins, cpu_reg);
+
+	gather_lane(ls, lane);
+	ls->stats.scalar_lanes++;
+}
+
+
+/*
+ *	lane_bits()
+ *	Inputs: mask - Lane mask of one chunk
+ *	Return Value: The mask as one bit per lane
+ */
+static inline uint64_t lane_bits(lane_m16 mask) {
+#if defined(__AVX512BW__)
+	return (uint32_t)_mm256_movemask_epi8((__m256i)__builtin_convertvector(mask, lane_m8));
+#elif defined(__AVX2__)
+	return (uint16_t)_mm_movemask_epi8((__m128i)__builtin_convertvector(mask, lane_m8));
+#elif defined(__SSE2__)
+	return (uint8_t)_mm_movemask_epi8(_mm_packs_epi16((__m128i)mask, (__m128i)mask));
+#else
+	uint64_t bits = 0;
+	for (int i=0; i < LANE_CHUNK; ++i)
+		bits |= (uint64_t)(mask[i] & 1) << i;
+	return bits;
+#endif
+}
+
+
+static inline void set_row8(uint8_t * row, uint32_t c, lane_m8 mask, lane_u8 value) {
+	ROW8(row, c) = (value & (lane_u8)mask) | (ROW8(row, c) & ~(lane_u8)mask);
+}
+
+
+static inline void set_row16(uint16_t * row, uint32_t c, lane_m16 mask, lane_u16 value) {
+	ROW16(row, c) = (value & (lane_u16)mask) | (ROW16(row, c) & ~(lane_u16)mask);
+}
+
+
+static inline lane_u16 widen(lane_u8 value) {
+	return __builtin_convertvector(value, lane_u16);
+}
+
+
+/*
+ *	vectorizable()
+ *	Inputs: opcode - Instruction shared by the group
+ *	Return Value: 1 if run_vector() implements it; 0 otherwise
+ */
+static int vectorizable(uint16_t opcode) {
+	switch (opcode & 0xF000) {
+	case 0x1000: case 0x3000: case 0x4000: case 0x6000:
+	case 0x7000: case 0xA000: case 0xB000:
+		return 1;
+	case 0x5000: case 0x9000:
+		return (opcode & 0x000F) == 0;
+	case 0x8000:
+		return (opcode & 0x000F) <= 0x7 || (opcode & 0x000F) == 0xE;
+	case 0xF000:
+		switch (opcode & 0x00FF) {
+		case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29:
+			return 1;
+		}
+		return 0;
+	}
+
+	return 0;
+}
+
+
+/*
+ *	run_vector()
+ *	Inputs: ls - Lockstep engine
+ *	        opcode - Instruction shared by the group (see vectorizable())
+ *	        first - First chunk with lanes in the group
+ *	Return Value: None
+ *	Function: Runs the instruction on every lane in ls->group. Each case does
+ *	          the same thing, in the same order, as its handler in cpu.c.
+ */
+static void run_vector(Lockstep * ls, uint16_t opcode, uint32_t first) {
+	const uint8_t x = (opcode & 0x0F00) >> 8;
+	const uint8_t y = (opcode & 0x00F0) >> 4;
+	const uint8_t kk = opcode & 0x00FF;
+	const uint16_t nnn = opcode & 0x0FFF;
+
+	for (uint32_t c=first; c < ls->chunks; ++c) {
+		if (ls->group_bits[c] == 0)
+			continue;
+
+		const lane_m16 mask = MASK16(ls->group, c);
+		const lane_m8 mask8 = __builtin_convertvector(mask, lane_m8);
+		const lane_u16 pc = ROW16(ls->pc, c);
+		lane_u16 next_pc = pc + 2;
+		lane_m8 skip = {0};
+		lane_u8 vx, vy, value;
+
+		switch (opcode & 0xF000) {
+		case 0x1000:
+			next_pc = (lane_u16){0} + nnn;
+			break;
+		case 0x3000:
+			skip = ROW8(ls->V[x], c) == kk;
+			break;
+		case 0x4000:
+			skip = ROW8(ls->V[x], c) != kk;
+			break;
+		case 0x5000:
+			skip = ROW8(ls->V[x], c) == ROW8(ls->V[y], c);
+			break;
+		case 0x9000:
+			skip = ROW8(ls->V[x], c) != ROW8(ls->V[y], c);
+			break;
+		case 0x6000:
+			set_row8(ls->V[x], c, mask8, (lane_u8){0} + kk);
+			break;
+		case 0x7000:
+			set_row8(ls->V[x], c, mask8, ROW8(ls->V[x], c) + kk);
+			break;
+		case 0x8000:
+			vx = ROW8(ls->V[x], c);
+			vy = ROW8(ls->V[y], c);
+
+			// VF is set first (except by the shifts) and the operands reloaded,
+			// so X or Y = F behaves as in the handlers
+			switch (opcode & 0x000F) {
+			case 0x0:
+				set_row8(ls->V[x], c, mask8, vy);
+				break;
+			case 0x1:
+				set_row8(ls->V[x], c, mask8, vx | vy);
+				break;
+			case 0x2:
+				set_row8(ls->V[x], c, mask8, vx & vy);
+				break;
+			case 0x3:
+				set_row8(ls->V[x], c, mask8, vx ^ vy);
+				break;
+			case 0x4:
+				set_row8(ls->V[0xF], c, mask8, (lane_u8)(vy > (lane_u8)(255 - vx)) & 1);
+				set_row8(ls->V[x], c, mask8, ROW8(ls->V[x], c) + ROW8(ls->V[y], c));
+				break;
+			case 0x5:
+				set_row8(ls->V[0xF], c, mask8, (lane_u8)(vx > vy) & 1);
+				set_row8(ls->V[x], c, mask8, ROW8(ls->V[x], c) - ROW8(ls->V[y], c));
+				break;
+			case 0x7:
+				set_row8(ls->V[0xF], c, mask8, (lane_u8)(vy > vx) & 1);
+				set_row8(ls->V[x], c, mask8, ROW8(ls->V[y], c) - ROW8(ls->V[x], c));
+				break;
+			case 0x6:
+				value = ls->quirks->shift_vy ? vy : vx;
+				set_row8(ls->V[x], c, mask8, value >> 1);
+				set_row8(ls->V[0xF], c, mask8, value & 1);
+				break;
+			case 0xE:
+				value = ls->quirks->shift_vy ? vy : vx;
+				set_row8(ls->V[x], c, mask8, value << 1);
+				set_row8(ls->V[0xF], c, mask8, value >> 7);
+				break;
+			}
+			break;
+		case 0xA000:
+			set_row16(ls->I, c, mask, (lane_u16){0} + nnn);
+			break;
+		case 0xB000:
+			next_pc = widen(ROW8(ls->V[ls->quirks->jump_vx ? x : 0], c)) + nnn;
+			break;
+		case 0xF000:
+			switch (opcode & 0x00FF) {
+			case 0x07:
+				set_row8(ls->V[x], c, mask8, __builtin_convertvector(ROW16(ls->delay_timer, c), lane_u8));
+				break;
+			case 0x15:
+				set_row16(ls->delay_timer, c, mask, widen(ROW8(ls->V[x], c)));
+				break;
+			case 0x18:
+				set_row16(ls->sound_timer, c, mask, widen(ROW8(ls->V[x], c)));
+				break;
+			case 0x1E:
+				set_row16(ls->I, c, mask, ROW16(ls->I, c) + widen(ROW8(ls->V[x], c)));
+				break;
+			case 0x29:
+				set_row16(ls->I, c, mask, widen(ROW8(ls->V[x], c)) * 5);
+				break;
+			}
+			break;
+		}
+
+		next_pc += (lane_u16)__builtin_convertvector(skip, lane_m16) & 2;
+		set_row16(ls->pc, c, mask, next_pc);
+	}
+
+	ls->stats.vector_groups++;
+}
+
+
+/*
+ *	run_group()
+ *	Inputs: ls - Lockstep engine
+ *	        leader - First lane of the group
+ *	Return Value: None
+ *	Function: Runs the group's instruction, vectorized if every lane in the
+ *	          group fetches the same one and it is vectorizable
+ */
+static void run_group(Lockstep * ls, uint32_t leader) {
+	const uint32_t first = leader / LANE_CHUNK;
+	const uint16_t pc = ls->start_pc[leader];
+	const uint8_t * memory = ls->machines[leader].memory;
+	int uniform = !(pc & 1) && pc < MEMORY_SIZE;
+	uint16_t opcode = 0;
+
+	if (uniform) {
+		opcode = (memory[pc] << 8) | memory[pc + 1];
+
+		// lanes can only disagree about memory one of them has written to
+		for (uint32_t c=first; ls->written[pc / LINE_SIZE] && c < ls->chunks; ++c) {
+			for (uint64_t bits = ls->group_bits[c]; bits; bits &= bits - 1) {
+				uint32_t lane = c * LANE_CHUNK + __builtin_ctzll(bits);
+				if (memcmp(ls->machines[lane].memory + pc, memory + pc, 2) != 0)
+					uniform = 0;
+			}
+		}
+	}
+
+	if (uniform && vectorizable(opcode)) {
+		run_vector(ls, opcode, first);
+		for (uint32_t c=first; c < ls->chunks; ++c)
+			ls->stats.vector_lanes += __builtin_popcountll(ls->group_bits[c]);
+		return;
+	}
+
+	for (uint32_t c=first; c < ls->chunks; ++c) {
+		for (uint64_t bits = ls->group_bits[c]; bits; bits &= bits - 1)
+			run_scalar(ls, c * LANE_CHUNK + __builtin_ctzll(bits));
+	}
+}
+
+
+/*
+ *	run_step()
+ *	Inputs: ls - Lockstep engine
+ *	Return Value: None
+ *	Function: Runs one instruction on every lane. The timers are left
+ *	          alone; only lockstep_end_frame() ticks them.
+ */
+static void run_step(Lockstep * ls) {
+	uint32_t first = 0;
+
+	memcpy(ls->start_pc, ls->pc, ls->chunks * LANE_CHUNK * sizeof(uint16_t));
+	for (uint32_t c=0; c < ls->chunks; ++c) {
+		MASK16(ls->done, c) = MASK16(ls->padding, c);
+		ls->done_bits[c] = lane_bits(MASK16(ls->padding, c));
+	}
+
+	for (;;) {
+		// every lane in the chunks before first has already run
+		while (first < ls->chunks && ls->done_bits[first] == ALL_LANES)
+			first++;
+		if (first == ls->chunks)
+			break;
+
+		const uint32_t leader = first * LANE_CHUNK + __builtin_ctzll(~ls->done_bits[first]);
+		const uint16_t pc = ls->start_pc[leader];
+
+		for (uint32_t c=first; c < ls->chunks; ++c) {
+			lane_m16 mask = (ROW16(ls->start_pc, c) == pc) & ~MASK16(ls->done, c);
+
+			MASK16(ls->group, c) = mask;
+			MASK16(ls->done, c) |= mask;
+			ls->group_bits[c] = lane_bits(mask);
+			ls->done_bits[c] |= ls->group_bits[c];
+		}
+
+		run_group(ls, leader);
+	}
+
+	ls->stats.steps++;
+}
+
+
+/*
+ *	lockstep_create()
+ *	Inputs: lanes - Number of machines
+ *	        profile - Quirk profile for all of them
+ *	Return Value: New lockstep engine; NULL if it can't be allocated
+ *	Function: Allocates the lanes and their register rows. Load a ROM with
+ *	          lockstep_load() before running.
+ */
+Lockstep * lockstep_create(uint32_t lanes, QuirkProfile profile) {
+	Lockstep * ls = calloc(1, sizeof(Lockstep));
+
+	if (ls == NULL || lanes == 0)
+		goto fail;
+
+	ls->lanes = lanes;
+	ls->chunks = (lanes + LANE_CHUNK - 1) / LANE_CHUNK;
+	ls->quirks = get_quirk_settings(profile);
+
+	// 16 byte rows, then 9 uint16_t rows, all LANE_CHUNK aligned
+	const size_t row = (size_t)ls->chunks * LANE_CHUNK;
+	ls->rows = aligned_alloc(LANE_CHUNK * 2, row * (16 + 9 * sizeof(uint16_t)));
+	ls->machines = calloc(lanes, sizeof(Chip8));
+	ls->done_bits = calloc(ls->chunks, sizeof(uint64_t));
+	ls->group_bits = calloc(ls->chunks, sizeof(uint64_t));
+	if (ls->rows == NULL || ls->machines == NULL || ls->done_bits == NULL || ls->group_bits == NULL)
+		goto fail;
+	memset(ls->rows, 0, row * (16 + 9 * sizeof(uint16_t)));
+
+	uint16_t * rows16 = (uint16_t *)((uint8_t *)ls->rows + 16 * row);
+	for (int r=0; r < 16; ++r)
+		ls->V[r] = (uint8_t *)ls->rows + r * row;
+	ls->I = rows16;
+	ls->pc = rows16 + row;
+	ls->sp = rows16 + 2 * row;
+	ls->delay_timer = rows16 + 3 * row;
+	ls->sound_timer = rows16 + 4 * row;
+	ls->start_pc = rows16 + 5 * row;
+	ls->padding = (int16_t *)(rows16 + 6 * row);
+	ls->done = (int16_t *)(rows16 + 7 * row);
+	ls->group = (int16_t *)(rows16 + 8 * row);
+
+	for (uint32_t lane=lanes; lane < row; ++lane)
+		ls->padding[lane] = -1;
+
+	for (uint32_t lane=0; lane < lanes; ++lane) {
+		set_quirk_profile(&ls->machines[lane], profile);
+		initialize_cpu(&ls->machines[lane]);
+	}
+
+	return ls;
+
+fail:
+	lockstep_destroy(ls);
+	return NULL;
+}
+
+
+void lockstep_destroy(Lockstep * ls) {
+	if (ls == NULL)
+		return;
+
+	free(ls->machines);
+	free(ls->rows);
+	free(ls->done_bits);
+	free(ls->group_bits);
+	free(ls);
+}
+
+
+/*
+ *	lockstep_load()
+ *	Inputs: ls - Lockstep engine
+ *	        filename - ROM file
+ *	Return Value: Size of the ROM; -1 if it can't be loaded
+ *	Function: Resets every lane and loads the ROM into all of them. Each lane
+ *	          keeps its random number state, so seed them (seed_random()) before
+ *	          or after this.
+ */
+int lockstep_load(Lockstep * ls, const char * filename) {
+	Chip8 * first = &ls->machines[0];
+
+	set_memory_write_listener(first, NULL, NULL);
+	initialize_cpu(first);
+	int size = load_program(first, filename);
+	if (size == -1)
+		return -1;
+
+	for (uint32_t lane=1; lane < ls->lanes; ++lane) {
+		Chip8 * cpu_reg = &ls->machines[lane];
+
+		set_memory_write_listener(cpu_reg, NULL, NULL);
+		initialize_cpu(cpu_reg);
+		memcpy(cpu_reg->memory, first->memory, MEMORY_SIZE);
+		invalidate_icache(cpu_reg, 0, MEMORY_SIZE);
+	}
+
+	// listen only from here, so loading doesn't count as writing
+	memset(ls->written, 0, sizeof(ls->written));
+	for (uint32_t lane=0; lane < ls->lanes; ++lane)
+		set_memory_write_listener(&ls->machines[lane], memory_written, ls);
+
+	return size;
+}
+
+
+/*
+ *	lockstep_lane()
+ *	Inputs: ls - Lockstep engine
+ *	        lane - Lane number
+ *	Return Value: The lane's machine
+ *	Function: For setting keys and seeds and for reading results between
+ *	          lockstep_run() calls. Don't change its write listener.
+ */
+Chip8 * lockstep_lane(Lockstep * ls, uint32_t lane) {
+	return &ls->machines[lane];
+}
+
+
+uint32_t lockstep_lanes(const Lockstep * ls) {
+	return ls->lanes;
+}
+
+
+const LockstepStats * lockstep_get_stats(const Lockstep * ls) {
+	return &ls->stats;
+}
+
+
+/*
+ *	lockstep_run()
+ *	Inputs: ls - Lockstep engine
+ *	        steps - Number of instructions to run on every lane
+ *	Return Value: None
+ *	Function: Picks up each lane's registers, runs the steps and writes the
+ *	          registers back, so every lane ends up exactly as if it had run
+ *	          step_instruction() steps times (VIP cycles
+ *	          aren't charged). Timers only tick in lockstep_end_frame().
+ */
+void lockstep_run(Lockstep * ls, uint32_t steps) {
+	for (uint32_t lane=0; lane < ls->lanes; ++lane)
+		gather_lane(ls, lane);
+
+	for (uint32_t i=0; i < steps; ++i)
+		run_step(ls);
+
+	for (uint32_t lane=0; lane < ls->lanes; ++lane) {
+		scatter_lane(ls, lane);
+		ls->machines[lane].instructions_retired += steps;
+	}
+}
+
+
+/*
+ *	lockstep_end_frame()
+ *	Inputs: ls - Lockstep engine
+ *	Return Value: None
+ *	Function: Ends a 60 Hz frame on every lane (see end_frame()). With
+ *	          lockstep_run(ls, budget) before it, each lane matches a machine
+ *	          calling run_frame() with an instruction budget, apart from the
+ *	          VIP cycles lockstep doesn't charge.
+ */
+void lockstep_end_frame(Lockstep * ls) {
+	for (uint32_t lane=0; lane < ls->lanes; ++lane)
+		end_frame(&ls->machines[lane]);
+}
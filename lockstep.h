@@ -0,0 +1,29 @@
+#ifndef _LOCKSTEP_H_
+#define _LOCKSTEP_H_
+
+#include "cpu.h"
+
+
+/*
+ *  Lockstep counters (see lockstep_get_stats())
+ */
+typedef struct lockstep_stats {
+	uint64_t steps;   // instructions executed by every lane
+	uint64_t vector_groups;   // groups of lanes that ran one instruction together
+	uint64_t vector_lanes;   // lane instructions executed by those groups
+	uint64_t scalar_lanes;   // lane instructions executed one lane at a time
+} LockstepStats;
+
+typedef struct lockstep Lockstep;   // many machines running one ROM side by side
+
+
+Lockstep * lockstep_create(uint32_t lanes, QuirkProfile profile);
+void lockstep_destroy(Lockstep * ls);
+int lockstep_load(Lockstep * ls, const char * filename);
+Chip8 * lockstep_lane(Lockstep * ls, uint32_t lane);
+uint32_t lockstep_lanes(const Lockstep * ls);
+const LockstepStats * lockstep_get_stats(const Lockstep * ls);
+void lockstep_run(Lockstep * ls, uint32_t steps);
+void lockstep_end_frame(Lockstep * ls);
+
+#endif
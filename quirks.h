@@ -0,0 +1,149 @@
+// CHIP-8 quirk profile instantiation
+//
+// Included by cpu.c once per quirk profile, with PROFILE (the name suffix)
+// and the QUIRK_* settings defined:
+//   QUIRK_SHIFT_VY   - 8XY6/8XYE shift VY into VX instead of shifting VX
+//   QUIRK_INDEX      - what FX55/FX65 leave in I (INDEX_* in cpu.c)
+//   QUIRK_JUMP_VX    - BXNN jumps to XNN + VX instead of NNN + V0
+//   QUIRK_DRAW_WRAP  - sprites wrap around the screen edges instead of clipping
+// The settings are constants here, so each copy of the handlers (and of the
+// threaded loop) is compiled without any quirk tests in it.
+//
+// No include guard: this file is meant to be included more than once.
+
+
+/*
+ *  0x8XY6 - Set VX = VX SHR 1, set VF = least sig. bit
+ */
+void QUIRK(SHR_VX_VY)(const Instruction * ins, Chip8 * cpu_reg) {
+	shift_right(ins, cpu_reg, QUIRK_SHIFT_VY);
+}
+
+
+/*
+ *  0x8XYE - Set VX = VX SHL 1, set VF = most sig. bit
+ */
+void QUIRK(SHL_VX_VY)(const Instruction * ins, Chip8 * cpu_reg) {
+	shift_left(ins, cpu_reg, QUIRK_SHIFT_VY);
+}
+
+
+/*
+ *  0xBNNN - Jump to location (NNN + V0)
+ */
+void QUIRK(JP_V0_addr)(const Instruction * ins, Chip8 * cpu_reg) {
+	jump_offset(ins, cpu_reg, QUIRK_JUMP_VX);
+}
+
+
+/*
+ *  0xDXYN - Display N-byte sprite starting at memory location I at (VX,VY), set VF = collison
+ */
+void QUIRK(DRW_VX_VY_nibble)(const Instruction * ins, Chip8 * cpu_reg) {
+	draw_sprite(ins, cpu_reg, QUIRK_DRAW_WRAP);
+}
+
+
+/*
+ *  0xFX55 - Store registers V0 through VX in memory starting at location I
+ */
+void QUIRK(LD_I_VX)(const Instruction * ins, Chip8 * cpu_reg) {
+	store_registers(ins, cpu_reg, QUIRK_INDEX);
+}
+
+
+/*
+ *  0xFX65 - Read into registers V0 through VX from memory starting at location I
+ */
+void QUIRK(LD_VX_I)(const Instruction * ins, Chip8 * cpu_reg) {
+	load_registers(ins, cpu_reg, QUIRK_INDEX);
+}
+
+
+/*
+ *  0xANNN, 0xDXYN - Point I at a sprite, then draw it
+ */
+static void QUIRK(FUSED_LD_I_DRW)(const Instruction * ins, Chip8 * cpu_reg) {
+	LD_I_addr(ins, cpu_reg);
+	if (!fusion_fits(ins, cpu_reg, 2))
+		return;
+
+	draw_sprite(ins + 1, cpu_reg, QUIRK_DRAW_WRAP);
+	count_fusion(ins, cpu_reg, FUSION_LD_I_DRW, 2);
+}
+
+
+/*
+ *  0xANNN, 0xFX65 - Point I at a table, then load registers from it
+ */
+static void QUIRK(FUSED_LD_I_LOAD)(const Instruction * ins, Chip8 * cpu_reg) {
+	LD_I_addr(ins, cpu_reg);
+	if (!fusion_fits(ins, cpu_reg, 2))
+		return;
+
+	load_registers(ins + 1, cpu_reg, QUIRK_INDEX);
+	count_fusion(ins, cpu_reg, FUSION_LD_I_LOAD, 2);
+}
+
+
+static const instruction_fn QUIRK(handlers)[OP_COUNT] = {
+	OPCODE_LIST(OPCODE_HANDLER)
+};
+
+static const char * const QUIRK(handler_names)[OP_COUNT] = {
+	OPCODE_LIST(OPCODE_NAME)
+};
+
+static const QuirkSettings QUIRK(settings) = {
+	QUIRK_SHIFT_VY, QUIRK_INDEX, QUIRK_JUMP_VX, QUIRK_DRAW_WRAP
+};
+
+
+#ifdef THREADED_LOOP
+/*
+ *	run_cycles_<profile>()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        count - Number of instructions to execute
+ *	Return Value: None
+ *	Function: Threaded version of the fetch-decode-execute loop. Each handler
+ *	          ends with its own fetch and computed goto to the next one, so
+ *	          there is no central dispatch branch to mispredict.
+ */
+static void QUIRK(run_cycles)(Chip8 * cpu_reg, uint32_t count) {
+#define OPCODE_LABEL(name, fn)   [OP_##name] = &&op_##name,
+	static void * const labels[OP_COUNT] = {
+		OPCODE_LIST(OPCODE_LABEL)
+	};
+	uint64_t end = cpu_reg->instructions_retired + count;
+	Instruction scratch;
+	const Instruction * ins;
+
+#define DISPATCH() \
+	do { \
+		if (cpu_reg->instructions_retired >= end) \
+			return; \
+		ins = fetch_instruction(cpu_reg, &scratch); \
+		goto *labels[ins->op]; \
+	} while (0)
+
+#define OPCODE_BODY(name, fn) \
+	op_##name: \
+		retire_instruction(cpu_reg, ins); \
+		fn(ins, cpu_reg); \
+		DISPATCH();
+
+	DISPATCH();
+	OPCODE_LIST(OPCODE_BODY)
+
+#undef OPCODE_BODY
+#undef DISPATCH
+#undef OPCODE_LABEL
+}
+#endif
+
+
+#undef PROFILE
+#undef QUIRK_SHIFT_VY
+#undef QUIRK_INDEX
+#undef QUIRK_JUMP_VX
+#undef QUIRK_DRAW_WRAP
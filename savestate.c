@@ -0,0 +1,464 @@
+// CHIP-8 save states and rewind
+//
+// A save state is SAVE_STATE_SIZE bytes, little-endian throughout:
+//   0   "C8SS", version (16 bits), quirk profile, 0
+//   8   instructions retired (64 bits)
+//   16  V0-VF
+//   32  I, pc, sp, stack[16], delay timer, sound timer (16 bits each)
+//   74  keys[16]
+//   90  random number state (32 bits)
+//   94  frames, VIP cycles (64 bits each), frame overrun (32 bits)
+//   114 memory, then the video buffer (HEIGHT rows of 64 bits)
+//
+// The rewind buffer keeps the newest captured frame in full and, for every
+// frame before it, the XOR of that frame with the one after it. Only the
+// 64-byte lines that changed are stored, and of those only the nonzero
+// 8-byte words, so a frame usually takes tens of bytes. Memory lines are
+// only compared when dirty_lines() says the ROM wrote them; the screen and
+// registers are always compared. The oldest frames are dropped when the
+// buffer fills up.
+#include "savestate.h"
+
+
+#define LINE_SIZE            64
+#define MEMORY_LINES         (MEMORY_SIZE / LINE_SIZE)
+#define SCREEN_LINES         (sizeof(((Chip8 *)0)->video_buffer) / LINE_SIZE)
+#define REGISTER_LINES       2      // SAVE_STATE_REGISTERS, padded
+#define STATE_LINES          (MEMORY_LINES + SCREEN_LINES + REGISTER_LINES)
+
+// largest record: size, line mask, every line with every word, size again
+#define MAX_RECORD           (4 + 16 + STATE_LINES * (1 + LINE_SIZE) + 4)
+
+_Static_assert(SAVE_STATE_REGISTERS <= REGISTER_LINES * LINE_SIZE, "registers don't fit their lines");
+_Static_assert(STATE_LINES <= 128, "a record's line mask is 128 bits");
+
+
+struct rewind {
+	uint8_t latest[STATE_LINES][LINE_SIZE];   // newest frame: memory, screen, then registers
+	int have_latest;
+	uint64_t captured_at;   // memory_writes when the machine last matched latest
+
+	// ring of delta records, oldest at head; each starts and ends with its size
+	uint8_t * ring;
+	size_t capacity;
+	size_t head;
+	size_t used;
+	uint32_t frames;   // records in the ring
+
+	uint8_t record[MAX_RECORD];   // record being built or undone
+};
+
+
+static void put16(uint8_t * p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t * p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t * p, uint64_t v) {
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint16_t get16(const uint8_t * p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t * p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t * p) {
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+
+/*
+ *	pack_registers()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        p - Where to write SAVE_STATE_REGISTERS bytes
+ *	Return Value: None
+ *	Function: Writes everything in a save state but memory and the screen
+ */
+static void pack_registers(const Chip8 * cpu_reg, uint8_t * p) {
+	memcpy(p, "C8SS", 4);
+	put16(p + 4, SAVE_STATE_VERSION);
+	p[6] = get_quirk_profile(cpu_reg);
+	p[7] = 0;
+	put64(p + 8, cpu_reg->instructions_retired);
+	memcpy(p + 16, cpu_reg->V, 16);
+	put16(p + 32, cpu_reg->I);
+	put16(p + 34, cpu_reg->pc);
+	put16(p + 36, cpu_reg->sp);
+	for (int i=0; i < 16; ++i)
+		put16(p + 38 + i * 2, cpu_reg->stack[i]);
+	put16(p + 70, cpu_reg->delay_timer);
+	put16(p + 72, cpu_reg->sound_timer);
+	memcpy(p + 74, cpu_reg->keys, 16);
+	put32(p + 90, cpu_reg->rand_state);
+	put64(p + 94, cpu_reg->frames);
+	put64(p + 102, cpu_reg->cycles);
+	put32(p + 110, cpu_reg->frame_overrun);
+}
+
+
+/*
+ *	unpack_registers()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        p - Registers written by pack_registers()
+ *	Return Value: None
+ *	Function: The reverse of pack_registers(), except for the header
+ */
+static void unpack_registers(Chip8 * cpu_reg, const uint8_t * p) {
+	cpu_reg->instructions_retired = get64(p + 8);
+	memcpy(cpu_reg->V, p + 16, 16);
+	cpu_reg->I = get16(p + 32);
+	cpu_reg->pc = get16(p + 34);
+	cpu_reg->sp = get16(p + 36);
+	for (int i=0; i < 16; ++i)
+		cpu_reg->stack[i] = get16(p + 38 + i * 2);
+	cpu_reg->delay_timer = get16(p + 70);
+	cpu_reg->sound_timer = get16(p + 72);
+	memcpy(cpu_reg->keys, p + 74, 16);
+	cpu_reg->rand_state = get32(p + 90);
+	cpu_reg->frames = get64(p + 94);
+	cpu_reg->cycles = get64(p + 102);
+	cpu_reg->frame_overrun = get32(p + 110);
+}
+
+
+/*
+ *	load_memory()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        memory - New memory contents
+ *	        lines - Lines that may differ (bit n = line n)
+ *	Return Value: None
+ *	Function: Copies in the lines that really do differ, invalidating only those
+ */
+static void load_memory(Chip8 * cpu_reg, const uint8_t * memory, uint64_t lines) {
+	for (; lines; lines &= lines - 1) {
+		uint32_t addr = __builtin_ctzll(lines) * LINE_SIZE;
+
+		if (memcmp(cpu_reg->memory + addr, memory + addr, LINE_SIZE) != 0) {
+			memcpy(cpu_reg->memory + addr, memory + addr, LINE_SIZE);
+			invalidate_icache(cpu_reg, addr, LINE_SIZE);
+		}
+	}
+}
+
+
+/*
+ *	save_state()
+ *	Inputs: cpu_reg - Pointer to CPU register struct
+ *	        buffer - SAVE_STATE_SIZE bytes
+ *	Return Value: SAVE_STATE_SIZE
+ *	Function: Serializes the machine (see the top of this file)
+ */
+size_t save_state(const Chip8 * cpu_reg, uint8_t * buffer) {
+	pack_registers(cpu_reg, buffer);
+	memcpy(buffer + SAVE_STATE_REGISTERS, cpu_reg->memory, MEMORY_SIZE);
+	for (int row=0; row < HEIGHT; ++row)
+		put64(buffer + SAVE_STATE_REGISTERS + MEMORY_SIZE + row * 8, cpu_reg->video_buffer[row]);
+
+	return SAVE_STATE_SIZE;
+}
+
+
+/*
+ *	load_state()
+ *	Inputs: cpu_reg - Machine to load into (initialized at some point)
+ *	        buffer - Save state
+ *	        size - Its size
+ *	Return Value: Returns 0 on success; returns -1 if it isn't a save state
+ *	              this version can read
+ *	Function: Puts the machine, and its quirk profile, back into the saved state
+ */
+int load_state(Chip8 * cpu_reg, const uint8_t * buffer, size_t size) {
+	if (size != SAVE_STATE_SIZE || memcmp(buffer, "C8SS", 4) != 0 ||
+	    get16(buffer + 4) != SAVE_STATE_VERSION || buffer[6] >= QUIRK_PROFILE_COUNT)
+		return -1;
+
+	set_quirk_profile(cpu_reg, buffer[6]);
+	unpack_registers(cpu_reg, buffer);
+	load_memory(cpu_reg, buffer + SAVE_STATE_REGISTERS, ~0ull);
+	for (int row=0; row < HEIGHT; ++row)
+		cpu_reg->video_buffer[row] = get64(buffer + SAVE_STATE_REGISTERS + MEMORY_SIZE + row * 8);
+	rehash_video(cpu_reg);
+
+	return 0;
+}
+
+
+int save_state_file(const Chip8 * cpu_reg, const char * filename) {
+	uint8_t buffer[SAVE_STATE_SIZE];
+	FILE * f = fopen(filename, "wb");
+
+	if (f == NULL)
+		return -1;
+
+	size_t written = fwrite(buffer, 1, save_state(cpu_reg, buffer), f);
+	if (fclose(f) != 0 || written != SAVE_STATE_SIZE)
+		return -1;
+
+	return 0;
+}
+
+
+int load_state_file(Chip8 * cpu_reg, const char * filename) {
+	uint8_t buffer[SAVE_STATE_SIZE + 1];
+	FILE * f = fopen(filename, "rb");
+
+	if (f == NULL)
+		return -1;
+
+	size_t size = fread(buffer, 1, sizeof(buffer), f);
+	fclose(f);
+
+	return load_state(cpu_reg, buffer, size);
+}
+
+
+
+/****************************************************************/
+/*************               Rewind                 *************/
+/****************************************************************/
+
+/*
+ *	rewind_create()
+ *	Inputs: capacity - Bytes of history to keep
+ *	Return Value: New, empty rewind buffer; NULL if it can't be allocated
+ */
+Rewind * rewind_create(size_t capacity) {
+	Rewind * rw = calloc(1, sizeof(Rewind));
+
+	if (rw == NULL)
+		return NULL;
+
+	rw->capacity = (capacity > MAX_RECORD) ? capacity : MAX_RECORD;
+	rw->ring = malloc(rw->capacity);
+	if (rw->ring == NULL) {
+		free(rw);
+		return NULL;
+	}
+
+	return rw;
+}
+
+
+void rewind_destroy(Rewind * rw) {
+	if (rw == NULL)
+		return;
+
+	free(rw->ring);
+	free(rw);
+}
+
+
+/*
+ *	rewind_clear()
+ *	Inputs: rw - Rewind buffer
+ *	Return Value: None
+ *	Function: Forgets all history, e.g. after loading a ROM or a save state
+ */
+void rewind_clear(Rewind * rw) {
+	rw->have_latest = 0;
+	rw->head = 0;
+	rw->used = 0;
+	rw->frames = 0;
+}
+
+
+uint32_t rewind_frames(const Rewind * rw) {
+	return rw->frames + rw->have_latest;
+}
+
+
+size_t rewind_bytes_used(const Rewind * rw) {
+	return rw->used;
+}
+
+
+static void ring_write(Rewind * rw, size_t pos, const uint8_t * src, size_t len) {
+	pos %= rw->capacity;
+	size_t first = (len < rw->capacity - pos) ? len : rw->capacity - pos;
+
+	memcpy(rw->ring + pos, src, first);
+	memcpy(rw->ring, src + first, len - first);
+}
+
+
+static void ring_read(const Rewind * rw, size_t pos, uint8_t * dst, size_t len) {
+	pos %= rw->capacity;
+	size_t first = (len < rw->capacity - pos) ? len : rw->capacity - pos;
+
+	memcpy(dst, rw->ring + pos, first);
+	memcpy(dst + first, rw->ring, len - first);
+}
+
+
+/*
+ *	encode_line()
+ *	Inputs: rw - Rewind buffer
+ *	        line - Line number in latest
+ *	        now - The line's current contents
+ *	        p - Where to append its delta
+ *	Return Value: Bytes appended: 0 if the line hasn't changed
+ *	Function: Appends the XOR of the line with latest as a word mask and the
+ *	          nonzero words, then updates latest
+ */
+static size_t encode_line(Rewind * rw, uint32_t line, const uint8_t * now, uint8_t * p) {
+	uint8_t * old = rw->latest[line];
+	uint8_t mask = 0;
+	size_t len = 1;
+
+	for (int w=0; w < LINE_SIZE / 8; ++w) {
+		uint64_t a, b;
+
+		memcpy(&a, now + w * 8, 8);
+		memcpy(&b, old + w * 8, 8);
+		if (a != b) {
+			uint64_t delta = a ^ b;
+
+			mask |= 1 << w;
+			memcpy(p + len, &delta, 8);
+			len += 8;
+		}
+	}
+
+	if (mask == 0)
+		return 0;
+
+	p[0] = mask;
+	memcpy(old, now, LINE_SIZE);
+	return len;
+}
+
+
+/*
+ *	rewind_capture()
+ *	Inputs: rw - Rewind buffer
+ *	        cpu_reg - Machine to capture (always the same one)
+ *	Return Value: None
+ *	Function: Records the machine's current frame. Call it once per frame.
+ */
+void rewind_capture(Rewind * rw, const Chip8 * cpu_reg) {
+	uint8_t registers[REGISTER_LINES * LINE_SIZE] = {0};
+	uint64_t lines[2] = {0, 0};
+	uint8_t * p = rw->record + 4 + 16;
+
+	pack_registers(cpu_reg, registers);
+
+	if (!rw->have_latest) {
+		memcpy(rw->latest[0], cpu_reg->memory, MEMORY_SIZE);
+		memcpy(rw->latest[MEMORY_LINES], cpu_reg->video_buffer, sizeof(cpu_reg->video_buffer));
+		memcpy(rw->latest[MEMORY_LINES + SCREEN_LINES], registers, sizeof(registers));
+		rw->have_latest = 1;
+		rw->captured_at = cpu_reg->memory_writes;
+		return;
+	}
+
+	// the delta takes latest back from this frame to the previous one
+	for (uint64_t dirty = dirty_lines(cpu_reg, rw->captured_at); dirty; dirty &= dirty - 1) {
+		uint32_t line = __builtin_ctzll(dirty);
+		size_t len = encode_line(rw, line, cpu_reg->memory + line * LINE_SIZE, p);
+
+		if (len) {
+			lines[0] |= 1ull << line;
+			p += len;
+		}
+	}
+	for (uint32_t line=MEMORY_LINES; line < STATE_LINES; ++line) {
+		const uint8_t * now = (line < MEMORY_LINES + SCREEN_LINES) ?
+			(const uint8_t *)cpu_reg->video_buffer + (line - MEMORY_LINES) * LINE_SIZE :
+			registers + (line - MEMORY_LINES - SCREEN_LINES) * LINE_SIZE;
+		size_t len = encode_line(rw, line, now, p);
+
+		if (len) {
+			lines[line / 64] |= 1ull << (line % 64);
+			p += len;
+		}
+	}
+	rw->captured_at = cpu_reg->memory_writes;
+
+	uint32_t size = (p - rw->record) + 4;
+	put32(rw->record, size);
+	put64(rw->record + 4, lines[0]);
+	put64(rw->record + 12, lines[1]);
+	put32(p, size);
+
+	// make room by dropping the oldest frames
+	while (rw->used + size > rw->capacity) {
+		uint8_t header[4];
+
+		ring_read(rw, rw->head, header, 4);
+		rw->head = (rw->head + get32(header)) % rw->capacity;
+		rw->used -= get32(header);
+		rw->frames--;
+	}
+
+	ring_write(rw, rw->head + rw->used, rw->record, size);
+	rw->used += size;
+	rw->frames++;
+}
+
+
+/*
+ *	rewind_step_back()
+ *	Inputs: rw - Rewind buffer
+ *	        cpu_reg - Machine the frames were captured from
+ *	Return Value: 1 if the machine went back a frame; 0 if there was no
+ *	              earlier frame (the machine is put back to the oldest one)
+ *	Function: Drops the newest frame and puts the machine into the one
+ *	          before it. Capturing can carry on from there.
+ */
+int rewind_step_back(Rewind * rw, Chip8 * cpu_reg) {
+	uint64_t memory_lines = 0;
+	int stepped = 0;
+
+	if (!rw->have_latest)
+		return 0;
+
+	if (rw->frames > 0) {
+		uint8_t trailer[4];
+
+		ring_read(rw, rw->head + rw->used - 4, trailer, 4);
+		uint32_t size = get32(trailer);
+		ring_read(rw, rw->head + rw->used - size, rw->record, size);
+		rw->used -= size;
+		rw->frames--;
+
+		uint64_t lines[2] = { get64(rw->record + 4), get64(rw->record + 12) };
+		const uint8_t * p = rw->record + 4 + 16;
+
+		for (uint32_t line=0; line < STATE_LINES; ++line) {
+			if (!((lines[line / 64] >> (line % 64)) & 1))
+				continue;
+
+			uint8_t mask = *p++;
+			for (int w=0; w < LINE_SIZE / 8; ++w) {
+				if (mask & (1 << w)) {
+					for (int b=0; b < 8; ++b)
+						rw->latest[line][w * 8 + b] ^= p[b];
+					p += 8;
+				}
+			}
+		}
+
+		memory_lines = lines[0];
+		stepped = 1;
+	}
+
+	// lines the delta touched, plus any the machine wrote after the capture
+	memory_lines |= dirty_lines(cpu_reg, rw->captured_at);
+	load_memory(cpu_reg, rw->latest[0], memory_lines);
+	memcpy(cpu_reg->video_buffer, rw->latest[MEMORY_LINES], sizeof(cpu_reg->video_buffer));
+	rehash_video(cpu_reg);
+	unpack_registers(cpu_reg, rw->latest[MEMORY_LINES + SCREEN_LINES]);
+	rw->captured_at = cpu_reg->memory_writes;
+
+	return stepped;
+}
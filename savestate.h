@@ -0,0 +1,28 @@
+#ifndef _SAVESTATE_H_
+#define _SAVESTATE_H_
+
+#include "cpu.h"
+
+
+#define SAVE_STATE_VERSION   3
+#define SAVE_STATE_REGISTERS 114    // bytes before memory in a save state
+#define SAVE_STATE_SIZE      (SAVE_STATE_REGISTERS + MEMORY_SIZE + HEIGHT * 8)
+
+
+typedef struct rewind Rewind;   // history of one machine's frames
+
+
+size_t save_state(const Chip8 * cpu_reg, uint8_t * buffer);
+int load_state(Chip8 * cpu_reg, const uint8_t * buffer, size_t size);
+int save_state_file(const Chip8 * cpu_reg, const char * filename);
+int load_state_file(Chip8 * cpu_reg, const char * filename);
+
+Rewind * rewind_create(size_t capacity);
+void rewind_destroy(Rewind * rw);
+void rewind_capture(Rewind * rw, const Chip8 * cpu_reg);
+int rewind_step_back(Rewind * rw, Chip8 * cpu_reg);
+void rewind_clear(Rewind * rw);
+uint32_t rewind_frames(const Rewind * rw);
+size_t rewind_bytes_used(const Rewind * rw);
+
+#endif